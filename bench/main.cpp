@@ -0,0 +1,658 @@
+/**
+ * PS3EYEDriver conversion benchmark.
+ * Runs the Bayer conversion kernels on a synthetic frame, without a camera attached.
+ **/
+#include <sstream>
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include "ps3eye_debayer.h"
+
+using namespace ps3eye;
+
+static const char* isa_name(EDebayerISA isa)
+{
+	switch (isa)
+	{
+	case EDebayerISA::AVX2:	return "AVX2";
+	case EDebayerISA::SSE2:	return "SSE2";
+	default:				return "Scalar";
+	}
+}
+
+// Run func num_frames times in a few batches and return the average time per frame in milliseconds of the fastest batch.
+// Taking the best batch filters out scheduler and frequency noise, so builds can be compared run to run.
+template <typename Func>
+static double time_per_frame(int num_frames, Func func)
+{
+	const int num_batches = 10;
+	int batch_frames = num_frames > num_batches ? num_frames / num_batches : 1;
+
+	func(); // warm up caches and threads
+
+	double best_ms = 0.0;
+	for (int batch = 0; batch < num_batches; ++batch)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int frame = 0; frame < batch_frames; ++frame)
+			func();
+		auto end = std::chrono::high_resolution_clock::now();
+
+		double ms = std::chrono::duration<double, std::milli>(end - start).count() / batch_frames;
+		if (batch == 0 || ms < best_ms)
+			best_ms = ms;
+	}
+	return best_ms;
+}
+
+// Synthetic RGB test images, as the sensor would see them before the color filter array
+enum class ETestImage
+{
+	Markers,		// Saturated, anti-aliased discs on a dark background, like tracking markers
+	ZonePlate,		// Gray concentric rings of rising frequency
+	ColorEdges		// Bars of different colors separated by slanted edges
+};
+
+static const char* test_image_name(ETestImage image)
+{
+	switch (image)
+	{
+	case ETestImage::Markers:	return "Markers";
+	case ETestImage::ZonePlate:	return "Zone";
+	default:					return "Edges";
+	}
+}
+
+static void make_test_image(ETestImage image, int width, int height, std::vector<uint8_t>& rgb)
+{
+	static const uint8_t colors[][3] = { { 255, 40, 200 }, { 30, 220, 60 }, { 60, 90, 255 }, { 250, 200, 20 }, { 20, 230, 230 } };
+
+	rgb.resize(width * height * 3);
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			float value[3] = { 0.0f, 0.0f, 0.0f };
+			if (image == ETestImage::Markers)
+			{
+				value[0] = value[1] = value[2] = 20.0f;
+				for (int marker = 0; marker < 5; ++marker)
+				{
+					float dx = x - width * (marker + 1) / 6.0f;
+					float dy = y - height * (0.3f + 0.1f * marker);
+					float coverage = std::min(std::max(width / 20.0f - std::sqrt(dx * dx + dy * dy) + 0.5f, 0.0f), 1.0f);
+					for (int c = 0; c < 3; ++c)
+						value[c] += coverage * (colors[marker][c] - value[c]);
+				}
+			}
+			else if (image == ETestImage::ZonePlate)
+			{
+				float dx = x - width * 0.5f;
+				float dy = y - height * 0.5f;
+				value[0] = value[1] = value[2] = 127.5f + 127.5f * std::cos((dx * dx + dy * dy) * 3.14159265f / (4.0f * width));
+			}
+			else
+			{
+				// Slanted by one pixel every 8 rows, so the edges fall on every phase of the Bayer pattern
+				int bar = ((x + y / 8) * 5 / width) % 5;
+				for (int c = 0; c < 3; ++c)
+					value[c] = colors[bar][c];
+			}
+			for (int c = 0; c < 3; ++c)
+				rgb[(y * width + x) * 3 + c] = (uint8_t)(value[c] + 0.5f);
+		}
+	}
+}
+
+// Sample an RGB image through the GRBG color filter array
+static void mosaic_test_image(int width, int height, const std::vector<uint8_t>& rgb, std::vector<uint8_t>& bayer)
+{
+	bayer.resize(width * height);
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			int channel = (y & 1) == 0 ? ((x & 1) == 0 ? 1 : 0) : ((x & 1) == 0 ? 2 : 1);
+			bayer[y * width + x] = rgb[(y * width + x) * 3 + channel];
+		}
+	}
+}
+
+// PSNR of a demosaiced RGB image against the original in dB, leaving out a 2 pixel border that neither demosaic sees whole
+static double psnr(int width, int height, const std::vector<uint8_t>& original, const std::vector<uint8_t>& demosaiced)
+{
+	double sum = 0.0;
+	int count = 0;
+	for (int y = 2; y < height - 2; ++y)
+	{
+		for (int i = 2 * 3; i < (width - 2) * 3; ++i)
+		{
+			double error = (double)original[y * width * 3 + i] - (double)demosaiced[y * width * 3 + i];
+			sum += error * error;
+			++count;
+		}
+	}
+	return sum == 0.0 ? 99.0 : 10.0 * std::log10(255.0 * 255.0 * count / sum);
+}
+
+// Run convert with every instruction set the CPU has and compare its output, output_size bytes, to that of reference.
+// Every kernel is meant to be bit-identical to the scalar code, so any difference is a bug. Prints the first one.
+template <typename Reference, typename Convert>
+static bool verify_isas(const char* name, int width, int height, size_t output_size, Reference reference, Convert convert)
+{
+	std::vector<uint8_t> expected(output_size, 0xCD);
+	std::vector<uint8_t> actual(output_size);
+	reference(expected.data());
+
+	bool identical = true;
+	EDebayerISA isas[] = { EDebayerISA::Scalar, EDebayerISA::SSE2, EDebayerISA::AVX2 };
+	for (EDebayerISA isa : isas)
+	{
+		if ((int)isa > (int)GetBestDebayerISA())
+			break;
+
+		SetDebayerISA(isa);
+		std::fill(actual.begin(), actual.end(), (uint8_t)0xCD);
+		convert(actual.data());
+
+		for (size_t i = 0; i < output_size; ++i)
+		{
+			if (actual[i] != expected[i])
+			{
+				printf("%-8s %dx%d %s: byte %d is %d instead of %d\n", name, width, height, isa_name(isa), (int)i, actual[i], expected[i]);
+				identical = false;
+				break;
+			}
+		}
+	}
+	SetDebayerISA(GetBestDebayerISA());
+	return identical;
+}
+
+// Like verify_isas, for the conversions that have no reference of their own: the expected output is that of reference
+// run with the Scalar instruction set
+template <typename Reference, typename Convert>
+static bool verify_against_scalar(const char* name, int width, int height, size_t output_size, Reference reference, Convert convert)
+{
+	return verify_isas(name, width, height, output_size, [&](uint8_t* out) { SetDebayerISA(EDebayerISA::Scalar); reference(out); }, convert);
+}
+
+template <typename Convert>
+static bool verify_against_scalar(const char* name, int width, int height, size_t output_size, Convert convert)
+{
+	return verify_against_scalar(name, width, height, output_size, convert, convert);
+}
+
+// Copy every level of pyramid to out, gray then color, and return the number of bytes
+static size_t copy_pyramid(const FramePyramid& pyramid, uint8_t* out)
+{
+	size_t size = 0;
+	for (int index = 0; index < pyramid.GetNumLevels(); ++index)
+	{
+		const FramePyramid::Level& level = pyramid.GetLevel(index);
+		for (int y = 0; y < level.height; ++y)
+		{
+			if (out)
+				std::copy(level.gray + y * level.gray_stride, level.gray + y * level.gray_stride + level.width, out + size);
+			size += level.width;
+			if (level.color)
+			{
+				if (out)
+					std::copy(level.color + y * level.color_stride, level.color + y * level.color_stride + level.width * 3, out + size);
+				size += level.width * 3;
+			}
+		}
+	}
+	return size;
+}
+
+// Check the conversions of a random frame of this size against the scalar references
+static bool verify_conversions(int width, int height)
+{
+	std::vector<uint8_t> bayer(width * height);
+	for (size_t i = 0; i < bayer.size(); ++i)
+		bayer[i] = (uint8_t)(rand() & 0xFF);
+	const uint8_t* in = bayer.data();
+
+	bool identical = true;
+	identical &= verify_isas("BGR", width, height, width * height * 3,
+		[&](uint8_t* out) { DebayerRGBScalar(width, height, in, out, true); },
+		[&](uint8_t* out) { DebayerRGB(width, height, in, out, width * 3, true); });
+	identical &= verify_isas("RGB", width, height, width * height * 3,
+		[&](uint8_t* out) { DebayerRGBScalar(width, height, in, out, false); },
+		[&](uint8_t* out) { DebayerRGB(width, height, in, out, width * 3, false); });
+	identical &= verify_isas("Gray", width, height, width * height,
+		[&](uint8_t* out) { DebayerGrayScalar(width, height, in, out); },
+		[&](uint8_t* out) { DebayerGray(width, height, in, out, width); });
+
+	// Bands must join up without seams
+	DebayerThreadPool pool(3);
+	identical &= verify_isas("PoolBGR", width, height, width * height * 3,
+		[&](uint8_t* out) { DebayerRGBScalar(width, height, in, out, true); },
+		[&](uint8_t* out) { pool.DebayerRGB(width, height, in, out, width * 3, true); });
+	identical &= verify_isas("PoolGray", width, height, width * height,
+		[&](uint8_t* out) { DebayerGrayScalar(width, height, in, out); },
+		[&](uint8_t* out) { pool.DebayerGray(width, height, in, out, width); });
+
+	// 4 byte pixels are the 3 byte ones with an opaque alpha
+	identical &= verify_isas("BGRA", width, height, width * height * 4,
+		[&](uint8_t* out) {
+			std::vector<uint8_t> rgb(width * height * 3);
+			DebayerRGBScalar(width, height, in, rgb.data(), true);
+			for (int i = 0; i < width * height; ++i)
+			{
+				std::copy(&rgb[i * 3], &rgb[i * 3] + 3, out + i * 4);
+				out[i * 4 + 3] = 0xFF;
+			}
+		},
+		[&](uint8_t* out) { DebayerRGBA(width, height, in, out, width * 4, true); });
+	identical &= verify_against_scalar("RGBA", width, height, width * height * 4,
+		[&](uint8_t* out) { DebayerRGBA(width, height, in, out, width * 4, false); });
+
+	// Masks are the gray image thresholded
+	const uint8_t threshold = 100;
+	const int bits_stride = (width + 7) / 8;
+	identical &= verify_isas("Mask", width, height, width * height,
+		[&](uint8_t* out) {
+			DebayerGrayScalar(width, height, in, out);
+			for (int i = 0; i < width * height; ++i)
+				out[i] = out[i] >= threshold ? 0xFF : 0;
+		},
+		[&](uint8_t* out) { DebayerMask(width, height, in, out, width, threshold, false); });
+	identical &= verify_isas("BitMask", width, height, bits_stride * height,
+		[&](uint8_t* out) {
+			std::vector<uint8_t> gray(width * height);
+			DebayerGrayScalar(width, height, in, gray.data());
+			std::fill(out, out + bits_stride * height, (uint8_t)0);
+			for (int y = 0; y < height; ++y)
+				for (int x = 0; x < width; ++x)
+					if (gray[y * width + x] >= threshold)
+						out[y * bits_stride + x / 8] |= (uint8_t)(1 << (x % 8));
+		},
+		[&](uint8_t* out) { DebayerMask(width, height, in, out, bits_stride, threshold, true); });
+
+	// The color pixels go through the tables after they are demosaiced
+	ColorLUT lut(1.2f, 1.0f, 1.4f, 1.1f, 2.2f);
+	identical &= verify_isas("LUT", width, height, width * height * 3,
+		[&](uint8_t* out) {
+			DebayerRGBScalar(width, height, in, out, true);
+			for (int i = 0; i < width * height; ++i)
+			{
+				out[i * 3 + 0] = lut.blue[out[i * 3 + 0]];
+				out[i * 3 + 1] = lut.green[out[i * 3 + 1]];
+				out[i * 3 + 2] = lut.red[out[i * 3 + 2]];
+			}
+		},
+		[&](uint8_t* out) { DebayerRGB(width, height, in, out, width * 3, true, NULL, &lut); });
+
+	const float correction[9] = { 1.6f, -0.4f, -0.2f, -0.3f, 1.5f, -0.2f, -0.1f, -0.5f, 1.6f };
+	ColorMatrix matrix(correction);
+	identical &= verify_against_scalar("CCM", width, height, width * height * 3,
+		[&](uint8_t* out) { DebayerRGB(width, height, in, out, width * 3, true, &matrix); });
+	identical &= verify_against_scalar("CCMRGBA", width, height, width * height * 4,
+		[&](uint8_t* out) { DebayerRGBA(width, height, in, out, width * 4, false, &matrix, &lut); });
+
+	identical &= verify_against_scalar("HQ", width, height, width * height * 3,
+		[&](uint8_t* out) { DebayerRGBHQ(width, height, in, out, width * 3, 3, true); });
+	identical &= verify_against_scalar("HQRGBA", width, height, width * height * 4,
+		[&](uint8_t* out) { DebayerRGBHQ(width, height, in, out, width * 4, 4, false, &matrix, &lut); });
+
+	identical &= verify_against_scalar("HalfGray", width, height, width / 2 * (height / 2),
+		[&](uint8_t* out) { DebayerHalfGray(width, height, in, out, width / 2); });
+	identical &= verify_against_scalar("HalfBGR", width, height, width / 2 * 3 * (height / 2),
+		[&](uint8_t* out) { DebayerHalfRGB(width, height, in, out, width / 2 * 3, true); });
+	identical &= verify_against_scalar("HalfCCM", width, height, width / 2 * 3 * (height / 2),
+		[&](uint8_t* out) { DebayerHalfRGB(width, height, in, out, width / 2 * 3, false, &matrix, &lut); });
+
+	identical &= verify_against_scalar("YUYV", width, height, width * height * 2,
+		[&](uint8_t* out) { DebayerYUYV(width, height, in, out, width * 2); });
+	identical &= verify_against_scalar("NV12", width, height, width * height * 3 / 2,
+		[&](uint8_t* out) { DebayerYUV420(width, height, in, out, width, true); });
+	identical &= verify_against_scalar("I420", width, height, width * height * 3 / 2,
+		[&](uint8_t* out) { DebayerYUV420(width, height, in, out, width, false); });
+
+	FramePyramid pyramid(4, true);
+	pyramid.Allocate(width, height);
+	identical &= verify_against_scalar("Pyramid", width, height, copy_pyramid(pyramid, NULL),
+		[&](uint8_t* out) { DebayerPyramid(width, height, in, pyramid); copy_pyramid(pyramid, out); });
+
+	// A barrel undistortion with a rotation, so the fractions vary and some sources are outside the frame
+	std::vector<float> map_x(width * height);
+	std::vector<float> map_y(width * height);
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			float u = (x - width * 0.5f) / width;
+			float v = (y - height * 0.5f) / width;
+			float scale = 1.0f + 0.4f * (u * u + v * v);
+			map_x[y * width + x] = width * 0.5f + (u - 0.05f * v) * scale * width;
+			map_y[y * width + x] = height * 0.5f + (v + 0.05f * u) * scale * width;
+		}
+	}
+	RemapTable remap_table(width, height, map_x.data(), map_y.data());
+	identical &= verify_against_scalar("RemapGray", width, height, width * height,
+		[&](uint8_t* out) { DebayerRemap(width, height, in, remap_table, out, width, 1, true); });
+	identical &= verify_against_scalar("RemapBGR", width, height, width * height * 3,
+		[&](uint8_t* out) { DebayerRemap(width, height, in, remap_table, out, width * 3, 3, true, &matrix); });
+	identical &= verify_against_scalar("RemapRGBA", width, height, width * height * 4,
+		[&](uint8_t* out) { DebayerRemap(width, height, in, remap_table, out, width * 4, 4, false, NULL, &lut); });
+
+	// Raw frame corrections work in place, on a copy of the frame
+	BayerCorrection bayer_correction(width, height);
+	std::vector<uint32_t> defects;
+	for (int index = 0; index < 200; ++index)
+		defects.push_back((uint32_t)(index * 7919 % (width * height)));
+	defects.push_back(0);
+	defects.push_back(width * height - 1);
+	bayer_correction.SetDefects(defects.data(), defects.size());
+	std::vector<float> gains(width * height);
+	for (size_t i = 0; i < gains.size(); ++i)
+		gains[i] = 0.5f + (rand() & 0xFFF) / 1024.0f;
+	bayer_correction.SetGains(gains.data());
+	identical &= verify_against_scalar("Correct", width, height, width * height,
+		[&](uint8_t* out) { std::copy(in, in + width * height, out); bayer_correction.Apply(out); });
+
+	// A few frames through a fresh denoiser, moving a little between frames, so both still and moving pixels are filtered
+	const int num_denoised = 4;
+	identical &= verify_against_scalar("Denoise", width, height, width * height * num_denoised,
+		[&](uint8_t* out) {
+			TemporalDenoiser denoiser;
+			for (int frame = 0; frame < num_denoised; ++frame)
+			{
+				uint8_t* denoised = out + frame * width * height;
+				for (int i = 0; i < width * height; ++i)
+					denoised[i] = (uint8_t)std::min(in[i] + (i * 7 + frame * 13) % 40, 255);
+				denoiser.Apply(denoised, width * height, 0.75f, 16);
+			}
+		});
+
+	// Pool bands of the formats with row constraints, against the whole frame converted on this thread
+	identical &= verify_against_scalar("PoolNV12", width, height, width * height * 3 / 2,
+		[&](uint8_t* out) { DebayerYUV420(width, height, in, out, width, true); },
+		[&](uint8_t* out) { pool.DebayerYUV420(width, height, in, out, width, true); });
+	identical &= verify_against_scalar("PoolPyr", width, height, copy_pyramid(pyramid, NULL),
+		[&](uint8_t* out) { DebayerPyramid(width, height, in, pyramid); copy_pyramid(pyramid, out); },
+		[&](uint8_t* out) { pool.DebayerPyramid(width, height, in, pyramid); copy_pyramid(pyramid, out); });
+	identical &= verify_against_scalar("PoolRemap", width, height, width * height * 3,
+		[&](uint8_t* out) { DebayerRemap(width, height, in, remap_table, out, width * 3, 3, true); },
+		[&](uint8_t* out) { pool.DebayerRemap(width, height, in, remap_table, out, width * 3, 3, true); });
+	return identical;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int width = 640;
+	int height = 480;
+	int num_frames = 500;
+	int num_cameras = 8;
+	int max_threads = (int)std::thread::hardware_concurrency();
+	bool verify_only = false;
+	if (max_threads < 1)
+		max_threads = 1;
+
+	for (int arg_ix = 1; arg_ix < argc; ++arg_ix)
+	{
+		std::string arg(argv[arg_ix]);
+		if (arg == "--qvga")
+		{
+			width = 320;
+			height = 240;
+		}
+		else if (arg == "--frames" && arg_ix + 1 < argc)
+		{
+			std::istringstream(argv[++arg_ix]) >> num_frames;
+		}
+		else if (arg == "--threads" && arg_ix + 1 < argc)
+		{
+			std::istringstream(argv[++arg_ix]) >> max_threads;
+		}
+		else if (arg == "--cameras" && arg_ix + 1 < argc)
+		{
+			std::istringstream(argv[++arg_ix]) >> num_cameras;
+		}
+		else if (arg == "--verify")
+		{
+			verify_only = true;
+		}
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--qvga] [--frames N] [--threads N] [--cameras N] [--verify]" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Timings of wrong output are no use, so check every instruction set at both sensor resolutions first
+	bool identical = verify_conversions(320, 240);
+	identical &= verify_conversions(640, 480);
+	if (!identical)
+	{
+		printf("Conversions don't match the scalar references\n");
+		return EXIT_FAILURE;
+	}
+	printf("Conversions match the scalar references\n");
+	if (verify_only)
+		return EXIT_SUCCESS;
+
+	std::vector<uint8_t> bayer(width * height);
+	std::vector<uint8_t> output(width * height * 4);
+	for (size_t i = 0; i < bayer.size(); ++i)
+		bayer[i] = (uint8_t)(rand() & 0xFF);
+
+	printf("\nFrame: %dx%d, %d frames per measurement\n\n", width, height, num_frames);
+
+	// Single-threaded, per instruction set
+	printf("%-8s %12s %12s %12s %12s %12s %12s %12s %12s\n", "ISA", "BGR ms", "BGRA ms", "Gray ms", "BitMask ms", "NV12 ms", "YUYV ms", "HalfBGR ms", "BGR MPix/s");
+	printf("%-8s %12.3f %12s %12.3f\n", "Ref",
+		time_per_frame(num_frames, [&]() { DebayerRGBScalar(width, height, bayer.data(), output.data(), true); }), "",
+		time_per_frame(num_frames, [&]() { DebayerGrayScalar(width, height, bayer.data(), output.data()); }));
+
+	EDebayerISA isas[] = { EDebayerISA::Scalar, EDebayerISA::SSE2, EDebayerISA::AVX2 };
+	for (EDebayerISA isa : isas)
+	{
+		if ((int)isa > (int)GetBestDebayerISA())
+			break;
+
+		SetDebayerISA(isa);
+		double rgb_ms = time_per_frame(num_frames, [&]() { DebayerRGB(width, height, bayer.data(), output.data(), width * 3, true); });
+		double bgra_ms = time_per_frame(num_frames, [&]() { DebayerRGBA(width, height, bayer.data(), output.data(), width * 4, true); });
+		double gray_ms = time_per_frame(num_frames, [&]() { DebayerGray(width, height, bayer.data(), output.data(), width); });
+		double mask_ms = time_per_frame(num_frames, [&]() { DebayerMask(width, height, bayer.data(), output.data(), width / 8, 128, true); });
+		double nv12_ms = time_per_frame(num_frames, [&]() { DebayerYUV420(width, height, bayer.data(), output.data(), width, true); });
+		double yuyv_ms = time_per_frame(num_frames, [&]() { DebayerYUYV(width, height, bayer.data(), output.data(), width * 2); });
+		double half_ms = time_per_frame(num_frames, [&]() { DebayerHalfRGB(width, height, bayer.data(), output.data(), width / 2 * 3, true); });
+		printf("%-8s %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f %12.1f\n", isa_name(isa), rgb_ms, bgra_ms, gray_ms, mask_ms, nv12_ms, yuyv_ms, half_ms, width * height / (rgb_ms * 1000.0));
+	}
+	SetDebayerISA(GetBestDebayerISA());
+
+	// High quality demosaic, per instruction set
+	printf("\n%-8s %12s %12s %12s\n", "HQ", "BGR ms", "BGRA ms", "BGR MPix/s");
+	for (EDebayerISA isa : isas)
+	{
+		if ((int)isa > (int)GetBestDebayerISA())
+			break;
+
+		SetDebayerISA(isa);
+		double rgb_ms = time_per_frame(num_frames, [&]() { DebayerRGBHQ(width, height, bayer.data(), output.data(), width * 3, 3, true); });
+		double bgra_ms = time_per_frame(num_frames, [&]() { DebayerRGBHQ(width, height, bayer.data(), output.data(), width * 4, 4, true); });
+		printf("%-8s %12.3f %12.3f %12.1f\n", isa_name(isa), rgb_ms, bgra_ms, width * height / (rgb_ms * 1000.0));
+	}
+	SetDebayerISA(GetBestDebayerISA());
+
+	// Color lookup tables applied while demosaicing, per instruction set
+	ColorLUT lut(1.2f, 1.0f, 1.4f, 1.1f, 2.2f);
+	printf("\n%-8s %12s %12s %12s %12s\n", "LUT", "BGR ms", "BGRA ms", "HQ BGR ms", "HalfBGR ms");
+	for (EDebayerISA isa : isas)
+	{
+		if ((int)isa > (int)GetBestDebayerISA())
+			break;
+
+		SetDebayerISA(isa);
+		double rgb_ms = time_per_frame(num_frames, [&]() { DebayerRGB(width, height, bayer.data(), output.data(), width * 3, true, NULL, &lut); });
+		double bgra_ms = time_per_frame(num_frames, [&]() { DebayerRGBA(width, height, bayer.data(), output.data(), width * 4, true, NULL, &lut); });
+		double hq_ms = time_per_frame(num_frames, [&]() { DebayerRGBHQ(width, height, bayer.data(), output.data(), width * 3, 3, true, NULL, &lut); });
+		double half_ms = time_per_frame(num_frames, [&]() { DebayerHalfRGB(width, height, bayer.data(), output.data(), width / 2 * 3, true, NULL, &lut); });
+		printf("%-8s %12.3f %12.3f %12.3f %12.3f\n", isa_name(isa), rgb_ms, bgra_ms, hq_ms, half_ms);
+	}
+	SetDebayerISA(GetBestDebayerISA());
+
+	// Color correction matrix applied while demosaicing, per instruction set
+	const float correction[9] = { 1.6f, -0.4f, -0.2f, -0.3f, 1.5f, -0.2f, -0.1f, -0.5f, 1.6f };
+	ColorMatrix matrix(correction);
+	printf("\n%-8s %12s %12s %12s %12s\n", "CCM", "BGR ms", "BGRA ms", "HQ BGR ms", "HalfBGR ms");
+	for (EDebayerISA isa : isas)
+	{
+		if ((int)isa > (int)GetBestDebayerISA())
+			break;
+
+		SetDebayerISA(isa);
+		double rgb_ms = time_per_frame(num_frames, [&]() { DebayerRGB(width, height, bayer.data(), output.data(), width * 3, true, &matrix); });
+		double bgra_ms = time_per_frame(num_frames, [&]() { DebayerRGBA(width, height, bayer.data(), output.data(), width * 4, true, &matrix); });
+		double hq_ms = time_per_frame(num_frames, [&]() { DebayerRGBHQ(width, height, bayer.data(), output.data(), width * 3, 3, true, &matrix); });
+		double half_ms = time_per_frame(num_frames, [&]() { DebayerHalfRGB(width, height, bayer.data(), output.data(), width / 2 * 3, true, &matrix); });
+		printf("%-8s %12.3f %12.3f %12.3f %12.3f\n", isa_name(isa), rgb_ms, bgra_ms, hq_ms, half_ms);
+	}
+	SetDebayerISA(GetBestDebayerISA());
+
+	// Raw frame correction with a few hundred defective pixels and a flat field, per instruction set
+	BayerCorrection bayer_correction(width, height);
+	std::vector<uint32_t> defects;
+	for (int index = 0; index < 200; ++index)
+		defects.push_back((uint32_t)(index * 7919 % (width * height)));
+	bayer_correction.SetDefects(defects.data(), defects.size());
+	std::vector<float> flat_field(width * height);
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+		{
+			float dx = (x - width / 2) / (float)width;
+			float dy = (y - height / 2) / (float)width;
+			flat_field[y * width + x] = 1.0f + 1.5f * (dx * dx + dy * dy);
+		}
+	bayer_correction.SetGains(flat_field.data());
+	std::vector<uint8_t> corrected(bayer);
+	printf("\n%-8s %12s %12s\n", "Correct", "Defects ms", "All ms");
+	for (EDebayerISA isa : isas)
+	{
+		if ((int)isa > (int)GetBestDebayerISA())
+			break;
+
+		SetDebayerISA(isa);
+		BayerCorrection defects_only(width, height);
+		defects_only.SetDefects(defects.data(), defects.size());
+		double defects_ms = time_per_frame(num_frames, [&]() { defects_only.Apply(corrected.data()); });
+		double all_ms = time_per_frame(num_frames, [&]() { bayer_correction.Apply(corrected.data()); });
+		printf("%-8s %12.3f %12.3f\n", isa_name(isa), defects_ms, all_ms);
+	}
+	SetDebayerISA(GetBestDebayerISA());
+
+	// Temporal denoise of raw frames, per instruction set
+	printf("\n%-8s %12s\n", "Denoise", "Bayer ms");
+	for (EDebayerISA isa : isas)
+	{
+		if ((int)isa > (int)GetBestDebayerISA())
+			break;
+
+		SetDebayerISA(isa);
+		TemporalDenoiser denoiser;
+		std::vector<uint8_t> denoised(bayer);
+		denoiser.Apply(denoised.data(), width * height, 0.75f, 16);
+		double denoise_ms = time_per_frame(num_frames, [&]() { denoiser.Apply(denoised.data(), width * height, 0.75f, 16); });
+		printf("%-8s %12.3f\n", isa_name(isa), denoise_ms);
+	}
+	SetDebayerISA(GetBestDebayerISA());
+
+	// Demosaic quality on synthetic images
+	printf("\n%-8s %12s %12s\n", "PSNR", "Bilinear dB", "HQ dB");
+	ETestImage images[] = { ETestImage::Markers, ETestImage::ZonePlate, ETestImage::ColorEdges };
+	for (ETestImage image : images)
+	{
+		std::vector<uint8_t> original, mosaic, demosaiced(width * height * 3);
+		make_test_image(image, width, height, original);
+		mosaic_test_image(width, height, original, mosaic);
+
+		DebayerRGB(width, height, mosaic.data(), demosaiced.data(), width * 3, false);
+		double bilinear_db = psnr(width, height, original, demosaiced);
+		DebayerRGBHQ(width, height, mosaic.data(), demosaiced.data(), width * 3, 3, false);
+		double hq_db = psnr(width, height, original, demosaiced);
+		printf("%-8s %12.2f %12.2f\n", test_image_name(image), bilinear_db, hq_db);
+	}
+
+	// Image pyramids, where level 1 is just the level 0 conversion, so the other rows show the cost of the extra levels
+	printf("\n%-8s %12s %12s\n", "Levels", "Gray ms", "Gray+BGR ms");
+	for (int num_levels = 1; num_levels <= 4; ++num_levels)
+	{
+		FramePyramid gray_pyramid(num_levels, false);
+		FramePyramid color_pyramid(num_levels, true);
+		double gray_ms = time_per_frame(num_frames, [&]() { DebayerPyramid(width, height, bayer.data(), gray_pyramid); });
+		double color_ms = time_per_frame(num_frames, [&]() { DebayerPyramid(width, height, bayer.data(), color_pyramid); });
+		printf("%-8d %12.3f %12.3f\n", num_levels, gray_ms, color_ms);
+	}
+
+	// Remapping through a barrel undistortion map, per instruction set
+	std::vector<float> map_x(width * height);
+	std::vector<float> map_y(width * height);
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			float u = (x - width * 0.5f) / width;
+			float v = (y - height * 0.5f) / width;
+			float scale = 1.0f + 0.3f * (u * u + v * v);
+			map_x[y * width + x] = width * 0.5f + u * scale * width;
+			map_y[y * width + x] = height * 0.5f + v * scale * width;
+		}
+	}
+	RemapTable remap_table(width, height, map_x.data(), map_y.data());
+
+	printf("\n%-8s %12s %12s %12s\n", "Remap", "BGR ms", "BGRA ms", "Gray ms");
+	for (EDebayerISA isa : isas)
+	{
+		if ((int)isa > (int)GetBestDebayerISA())
+			break;
+
+		SetDebayerISA(isa);
+		double rgb_ms = time_per_frame(num_frames, [&]() { DebayerRemap(width, height, bayer.data(), remap_table, output.data(), width * 3, 3, true); });
+		double bgra_ms = time_per_frame(num_frames, [&]() { DebayerRemap(width, height, bayer.data(), remap_table, output.data(), width * 4, 4, true); });
+		double gray_ms = time_per_frame(num_frames, [&]() { DebayerRemap(width, height, bayer.data(), remap_table, output.data(), width, 1, true); });
+		printf("%-8s %12.3f %12.3f %12.3f\n", isa_name(isa), rgb_ms, bgra_ms, gray_ms);
+	}
+	SetDebayerISA(GetBestDebayerISA());
+
+	// Band-parallel scaling with the best instruction set
+	printf("\n%-8s %12s %12s %12s\n", "Threads", "BGR ms", "Gray ms", "BGR speedup");
+	double base_ms = 0.0;
+	for (int num_threads = 1; num_threads <= max_threads; ++num_threads)
+	{
+		DebayerThreadPool pool(num_threads);
+		double rgb_ms = time_per_frame(num_frames, [&]() { pool.DebayerRGB(width, height, bayer.data(), output.data(), width * 3, true); });
+		double gray_ms = time_per_frame(num_frames, [&]() { pool.DebayerGray(width, height, bayer.data(), output.data(), width); });
+		if (num_threads == 1)
+			base_ms = rgb_ms;
+		printf("%-8d %12.3f %12.3f %11.2fx\n", num_threads, rgb_ms, gray_ms, base_ms / rgb_ms);
+	}
+
+	// Several cameras, each with its own source and output frame, converted round robin like a multi-camera host does.
+	// Once the frames no longer fit in the caches, this shows the cost of the memory traffic per frame.
+	printf("\n%-8s %12s %12s %12s %12s\n", "Cameras", "BGR ms", "BGRA ms", "Gray ms", "BGR GB/s");
+	for (int cameras = 1; cameras <= num_cameras; cameras *= 2)
+	{
+		std::vector<std::vector<uint8_t> > camera_bayer(cameras, bayer);
+		std::vector<std::vector<uint8_t> > camera_output(cameras, output);
+		int camera = 0;
+		auto next_camera = [&]() { camera = (camera + 1) % cameras; return camera; };
+
+		double rgb_ms = time_per_frame(num_frames, [&]() { int c = next_camera(); DebayerRGB(width, height, camera_bayer[c].data(), camera_output[c].data(), width * 3, true); });
+		double bgra_ms = time_per_frame(num_frames, [&]() { int c = next_camera(); DebayerRGBA(width, height, camera_bayer[c].data(), camera_output[c].data(), width * 4, true); });
+		double gray_ms = time_per_frame(num_frames, [&]() { int c = next_camera(); DebayerGray(width, height, camera_bayer[c].data(), camera_output[c].data(), width); });
+		// A BGR frame moves at least 4 bytes per pixel: every source byte read once, every output byte written once
+		printf("%-8d %12.3f %12.3f %12.3f %12.2f\n", cameras, rgb_ms, bgra_ms, gray_ms, width * height * 4 / (rgb_ms * 1e6));
+	}
+
+	return EXIT_SUCCESS;
+}
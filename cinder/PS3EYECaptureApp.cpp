@@ -43,7 +43,7 @@ class PS3EYECaptureApp : public AppBasic {
     ps3eye::PS3EYECam::PS3EYERef eye;
 
 	gl::Texture mTexture;
-	uint8_t *frame_bgr;
+	uint8_t *frame_bgra;
 	Surface mFrame;
 
 	// mesure cam fps
@@ -76,13 +76,13 @@ void PS3EYECaptureApp::setup()
     if(devices.size())
     {   
         eye = devices.at(0);
-        bool res = eye->init(640, 480, 60);
+        bool res = eye->init(640, 480, 60, ps3eye::PS3EYECam::EOutputFormat::BGRA);
         console() << "init eye result " << res << std::endl;
         eye->start();
         
-		frame_bgr = new uint8_t[eye->getWidth()*eye->getHeight()*3];
-		mFrame = Surface(frame_bgr, eye->getWidth(), eye->getHeight(), eye->getWidth()*3, SurfaceChannelOrder::BGR);
-		memset(frame_bgr, 0, eye->getWidth()*eye->getHeight()*3);
+		frame_bgra = new uint8_t[eye->getWidth()*eye->getHeight()*4];
+		mFrame = Surface(frame_bgra, eye->getWidth(), eye->getHeight(), eye->getWidth()*4, SurfaceChannelOrder::BGRA);
+		memset(frame_bgra, 0, eye->getWidth()*eye->getHeight()*4);
 		        
         gui->addWidgetDown(new ciUILabel("EYE", CI_UI_FONT_MEDIUM));
         
@@ -167,7 +167,7 @@ void PS3EYECaptureApp::shutdown()
 	if (eye)
 		eye->stop();
     //
-	delete[] frame_bgr;
+	delete[] frame_bgra;
 	delete gui;
 }
 
@@ -180,7 +180,7 @@ void PS3EYECaptureApp::update()
 {
     if(eye)
     {
-		eye->getFrame(frame_bgr);
+		eye->getFrame(frame_bgra);
         mTexture = gl::Texture( mFrame );
 
         mCamFrameCount++;
@@ -15,11 +15,11 @@ void testApp::setup(){
     if(devices.size())
     {
         eye = devices.at(0);
-        bool res = eye->init(640, 480, 60);
+        bool res = eye->init(640, 480, 60, PS3EYECam::EOutputFormat::BGRA);
         eye->start();
         
-        videoFrame 	= new unsigned char[eye->getWidth()*eye->getHeight()*3];
-        videoTexture.allocate(eye->getWidth(), eye->getHeight(), GL_BGR_EXT);
+        videoFrame 	= new unsigned char[eye->getWidth()*eye->getHeight()*4];
+        videoTexture.allocate(eye->getWidth(), eye->getHeight(), GL_RGBA);
     }
 }
 void testApp::exit(){
@@ -35,7 +35,7 @@ void testApp::update()
     if(eye)
     {
 		eye->getFrame(videoFrame);
-        videoTexture.loadData(videoFrame, eye->getWidth(),eye->getHeight(), GL_BGR_EXT);
+        videoTexture.loadData(videoFrame, eye->getWidth(),eye->getHeight(), GL_BGRA);
 
         camFrameCount++;
         float timeNow = ofGetElapsedTimeMillis();
@@ -18,7 +18,7 @@ struct ps3eye_context {
     {
         if (hasDevices()) {
             eye = devices[0];
-            eye->init(width, height, (uint16_t)fps);
+            eye->init(width, height, (uint16_t)fps, ps3eye::PS3EYECam::EOutputFormat::BGRA);
         }
     }
 
@@ -74,7 +74,7 @@ void run_camera(int width, int height, int fps, Uint32 duration)
 	print_renderer_info(renderer);
 
 	SDL_Texture *video_tex = SDL_CreateTexture(
-		renderer, SDL_PIXELFORMAT_BGR24, SDL_TEXTUREACCESS_STREAMING,
+		renderer, SDL_PIXELFORMAT_BGRA32, SDL_TEXTUREACCESS_STREAMING,
 		ctx.eye->getWidth(), ctx.eye->getHeight());
 
 	if (video_tex == NULL)
@@ -119,7 +119,7 @@ void run_camera(int width, int height, int fps, Uint32 duration)
 		int pitch;
 		SDL_LockTexture(video_tex, NULL, &video_tex_pixels, &pitch);
 
-		ctx.eye->getFrame((uint8_t*)video_tex_pixels);
+		ctx.eye->getFrame((uint8_t*)video_tex_pixels, (uint32_t)pitch, -1, NULL);
 
 		SDL_UnlockTexture(video_tex);
 
@@ -1,10 +1,13 @@
 // source code from https://github.com/inspirit/PS3EYEDriver
 #include "ps3eye.h"
+#include "ps3eye_debayer.h"
 
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <chrono>
+#include <algorithm>
 
 #if defined WIN32 || defined _WIN32 || defined WINCE
 	#include <windows.h>
@@ -426,22 +429,42 @@ int USBMgr::listDevices( std::vector<PS3EYECam::PS3EYERef>& list )
 
 static void LIBUSB_CALL transfer_completed_callback(struct libusb_transfer *xfr);
 
+uint64_t monotonic_time_us()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Single-producer/single-consumer frame ring. The producer is the USB transfer thread (Enqueue), the consumer is the
+// thread calling getFrame (Dequeue/AcquireFrame). head and tail are ring indices in [0, 2*num_frames), so that a full
+// and an empty ring can be told apart. head is only written by the producer. tail is advanced by the consumer, and
+// by the producer when it drops the oldest frame; its lowest bit is set while the consumer is reading the tail frame,
+// so the producer never drops a frame that is being read. Neither side ever needs a lock: the mutex/condition
+// variable are only used to put the consumer to sleep when the ring is empty, and the producer only touches them
+// when the consumer is actually waiting.
 class FrameQueue
 {
 public:
-	FrameQueue(uint32_t frame_size) :
+	FrameQueue(uint32_t frame_size, uint32_t num_frames, PS3EYECam::EQueuePolicy policy) :
 		frame_size			(frame_size),
-		num_frames			(2),
-		frame_buffer		((uint8_t*)malloc(frame_size * num_frames)),
+		num_frames			(num_frames < 2 ? 2 : num_frames),
+		policy				(policy),
+		frame_buffer		((uint8_t*)malloc(frame_size * this->num_frames)),
+		frame_metadata		(new FrameMetadata[this->num_frames]),
 		head				(0),
 		tail				(0),
-		available			(0)
+		read_index			(0),
+		next_sequence		(0),
+		last_delivered_sequence(0xFFFFFFFF),
+		dropped_frames		(0),
+		status				(PS3EYECam::EFrameStatus::OK),
+		consumer_waiting	(false)
 	{
 	}
 
 	~FrameQueue()
 	{
 		free(frame_buffer);
+		delete[] frame_metadata;
 	}
 
 	uint8_t* GetFrameBufferStart()
@@ -449,279 +472,600 @@ public:
 		return frame_buffer;
 	}
 
-	uint8_t* Enqueue()
+	uint32_t GetFrameSize() const
 	{
-		uint8_t* new_frame = NULL;
+		return frame_size;
+	}
 
-		std::lock_guard<std::mutex> lock(mutex);
+	uint32_t GetDroppedFrameCount() const
+	{
+		return dropped_frames.load(std::memory_order_relaxed);
+	}
+
+	// Publish the frame the producer just finished writing and return the buffer for the next one.
+	// The metadata is stored alongside the frame; its sequence number is assigned here and written back.
+	uint8_t* Enqueue(FrameMetadata& metadata)
+	{
+		metadata.sequence = next_sequence++;
+		return Publish(metadata);
+	}
+
+	// Like Enqueue, but keep the sequence number of the metadata, e.g. for a frame converted from another queue
+	uint8_t* Publish(const FrameMetadata& metadata)
+	{
+		uint32_t cur_head = head.load(std::memory_order_relaxed);
+		uint32_t cur_tail = tail.load(std::memory_order_acquire);
+
+		// The metadata slot belongs to the producer just like the frame slot, until head is published
+		frame_metadata[cur_head % num_frames] = metadata;
 
 		// Unlike traditional producer/consumer, we don't block the producer if the buffer is full (ie. the consumer is not reading data fast enough).
-		// Instead, if the buffer is full, we simply return the current frame pointer, causing the producer to overwrite the previous frame.
+		// Instead, if the buffer is full, we drop a frame: by default we simply return the current frame pointer, causing the producer to overwrite the previous frame.
 		// This allows performance to degrade gracefully: if the consumer is not fast enough (< Camera FPS), it will miss frames, but if it is fast enough (>= Camera FPS), it will see everything.
 		//
 		// Note that because the the producer is writing directly to the ring buffer, we can only ever be a maximum of num_frames-1 ahead of the consumer, 
-		// otherwise the producer could overwrite the frame the consumer is currently reading (in case of a slow consumer)
-		if (available >= num_frames - 1)
+		// otherwise the producer could overwrite the frame the consumer is currently reading (in case of a slow consumer).
+		// A stale tail only makes the buffer look fuller than it is, so reading it without a lock is safe.
+		while (Distance(cur_head, cur_tail >> 1) >= num_frames - 1)
 		{
-			return frame_buffer + head * frame_size;
+			// The oldest frame can only be dropped if the consumer isn't reading it; otherwise we drop the newest one instead
+			if (policy == PS3EYECam::EQueuePolicy::DropNewest || (cur_tail & 1) != 0)
+			{
+				dropped_frames.fetch_add(1, std::memory_order_relaxed);
+				return frame_buffer + (cur_head % num_frames) * frame_size;
+			}
+
+			// Drop the oldest frame to make room, unless the consumer got to it first (in which case cur_tail is reloaded and we try again)
+			if (tail.compare_exchange_weak(cur_tail, Advance(cur_tail >> 1, 1) << 1, std::memory_order_acq_rel, std::memory_order_acquire))
+			{
+				dropped_frames.fetch_add(1, std::memory_order_relaxed);
+				break;
+			}
 		}
 
 		// Note: we don't need to copy any data to the buffer since the USB packets are directly written to the frame buffer.
-		// We just need to update head and available count to signal to the consumer that a new frame is available
-		head = (head + 1) % num_frames;
-		available++;
+		// We just need to publish the new head to signal to the consumer that a new frame is available
+		cur_head = Advance(cur_head, 1);
+		head.store(cur_head, std::memory_order_seq_cst);
 
-		// Determine the next frame pointer that the producer should write to
-		new_frame = frame_buffer + head * frame_size;
-
-		// Signal consumer that data became available
-		empty_condition.notify_one();
+		// Signal consumer that data became available, but only if it is (about to be) asleep
+		if (consumer_waiting.load(std::memory_order_seq_cst))
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			empty_condition.notify_one();
+		}
 
-		return new_frame;
+		// Determine the next frame pointer that the producer should write to
+		return frame_buffer + (cur_head % num_frames) * frame_size;
 	}
 
-	void Dequeue(uint8_t* new_frame, int frame_width, int frame_height, PS3EYECam::EOutputFormat outputFormat)
-	{		
-		std::unique_lock<std::mutex> lock(mutex);
-
-		// If there is no data in the buffer, wait until data becomes available
-		empty_condition.wait(lock, [this] () { return available != 0; });
-
-		// Copy from internal buffer
-		uint8_t* source = frame_buffer + frame_size * tail;
+	// Converts a raw frame to one output format. dest_stride is the distance between two output rows in bytes.
+	// Each format has its own instantiation, so the format is only dispatched on once, when the function is looked up.
+	template <PS3EYECam::EOutputFormat Format>
+	static void ConvertTo(const uint8_t* source, int frame_width, int frame_height, DebayerThreadPool* debayer_pool, const PS3EYECam::FrameConvertOptions& options, uint8_t* dest, int dest_stride)
+	{
+		typedef PS3EYECam::EOutputFormat F;
 
-		if (outputFormat == PS3EYECam::EOutputFormat::Bayer)
+		// Remapped frames are interpolated from rows demosaiced on the fly instead
+		int remap_channels = GetRemapChannels(Format, options, frame_width, frame_height);
+		if (remap_channels != 0)
+		{
+			bool inBGR = Format == F::BGR || Format == F::BGRA;
+			if (debayer_pool)
+				debayer_pool->DebayerRemap(frame_width, frame_height, source, *options.remap, dest, dest_stride, remap_channels, inBGR, options.color_matrix.get(), options.color_lut.get());
+			else
+				DebayerRemap(frame_width, frame_height, source, *options.remap, dest, dest_stride, remap_channels, inBGR, options.color_matrix.get(), options.color_lut.get());
+		}
+		else if (Format == F::Bayer)
+		{
+			if (dest_stride == frame_width)
+				memcpy(dest, source, frame_width * frame_height);
+			else
+				copy_rect(source, frame_width, 0, 0, dest, dest_stride, frame_width, frame_height);
+		}
+		else if ((Format == F::BGR || Format == F::RGB || Format == F::BGRA || Format == F::RGBA) && options.demosaic_quality == PS3EYECam::EDemosaicQuality::HighQuality)
+		{
+			int channels	= Format == F::BGR || Format == F::RGB ? 3 : 4;
+			bool inBGR		= Format == F::BGR || Format == F::BGRA;
+			if (debayer_pool)
+				debayer_pool->DebayerRGBHQ(frame_width, frame_height, source, dest, dest_stride, channels, inBGR, options.color_matrix.get(), options.color_lut.get());
+			else
+				DebayerRGBHQ(frame_width, frame_height, source, dest, dest_stride, channels, inBGR, options.color_matrix.get(), options.color_lut.get());
+		}
+		else if (Format == F::BGR || Format == F::RGB)
+		{
+			if (debayer_pool)
+				debayer_pool->DebayerRGB(frame_width, frame_height, source, dest, dest_stride, Format == F::BGR, options.color_matrix.get(), options.color_lut.get());
+			else
+				DebayerRGB(frame_width, frame_height, source, dest, dest_stride, Format == F::BGR, options.color_matrix.get(), options.color_lut.get());
+		}
+		else if (Format == F::BGRA || Format == F::RGBA)
+		{
+			if (debayer_pool)
+				debayer_pool->DebayerRGBA(frame_width, frame_height, source, dest, dest_stride, Format == F::BGRA, options.color_matrix.get(), options.color_lut.get());
+			else
+				DebayerRGBA(frame_width, frame_height, source, dest, dest_stride, Format == F::BGRA, options.color_matrix.get(), options.color_lut.get());
+		}
+		else if (Format == F::Gray)
+		{
+			if (debayer_pool)
+				debayer_pool->DebayerGray(frame_width, frame_height, source, dest, dest_stride);
+			else
+				DebayerGray(frame_width, frame_height, source, dest, dest_stride);
+		}
+		else if (Format == F::Mask || Format == F::BitMask)
+		{
+			if (debayer_pool)
+				debayer_pool->DebayerMask(frame_width, frame_height, source, dest, dest_stride, options.mask_threshold, Format == F::BitMask);
+			else
+				DebayerMask(frame_width, frame_height, source, dest, dest_stride, options.mask_threshold, Format == F::BitMask);
+		}
+		else if (Format == F::NV12 || Format == F::I420)
+		{
+			if (debayer_pool)
+				debayer_pool->DebayerYUV420(frame_width, frame_height, source, dest, dest_stride, Format == F::NV12);
+			else
+				DebayerYUV420(frame_width, frame_height, source, dest, dest_stride, Format == F::NV12);
+		}
+		else if (Format == F::YUYV)
 		{
-			memcpy(new_frame, source, frame_size);
+			if (debayer_pool)
+				debayer_pool->DebayerYUYV(frame_width, frame_height, source, dest, dest_stride);
+			else
+				DebayerYUYV(frame_width, frame_height, source, dest, dest_stride);
 		}
-		else if (outputFormat == PS3EYECam::EOutputFormat::BGR ||
-				 outputFormat == PS3EYECam::EOutputFormat::RGB)
+		else if (Format == F::HalfBGR || Format == F::HalfRGB)
 		{
-			DebayerRGB(frame_width, frame_height, source, new_frame, outputFormat == PS3EYECam::EOutputFormat::BGR);
-		}		
-		else if (outputFormat == PS3EYECam::EOutputFormat::Gray)
+			if (debayer_pool)
+				debayer_pool->DebayerHalfRGB(frame_width, frame_height, source, dest, dest_stride, Format == F::HalfBGR, options.color_matrix.get(), options.color_lut.get());
+			else
+				DebayerHalfRGB(frame_width, frame_height, source, dest, dest_stride, Format == F::HalfBGR, options.color_matrix.get(), options.color_lut.get());
+		}
+		else if (Format == F::HalfGray)
 		{
-			DebayerGray(frame_width, frame_height, source, new_frame);
+			if (debayer_pool)
+				debayer_pool->DebayerHalfGray(frame_width, frame_height, source, dest, dest_stride);
+			else
+				DebayerHalfGray(frame_width, frame_height, source, dest, dest_stride);
 		}
-		// Update tail and available count
-		tail = (tail + 1) % num_frames;
-		available--;
 	}
-	
-	void DebayerGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+
+	static PS3EYECam::FrameConvertFunc GetConvertFunc(PS3EYECam::EOutputFormat outputFormat)
 	{
-		// PSMove output is in the following Bayer format (GRBG):
-		//
-		// G R G R G R
-		// B G B G B G
-		// G R G R G R
-		// B G B G B G
-		//
-		// This is the normal Bayer pattern shifted left one place.
-		
-		int				source_stride	= frame_width;
-		const uint8_t*	source_row		= inBayer;						// Start at first bayer pixel
-		int				dest_stride		= frame_width;
-		uint8_t*		dest_row		= outBuffer + dest_stride + 1; 	// We start outputting at the second pixel of the second row's G component
-		uint32_t R,G,B;
-		
-		// Fill rows 1 to height-1 of the destination buffer. First and last row are filled separately (they are copied from the second row and second-to-last rows respectively)
-		for (int y = 0; y < frame_height-1; source_row += source_stride, dest_row += dest_stride, ++y)
+		typedef PS3EYECam::EOutputFormat F;
+
+		switch (outputFormat)
 		{
-			const uint8_t* source		= source_row;
-			const uint8_t* source_end	= source + (source_stride-2);								// -2 to deal with the fact that we're starting at the second pixel of the row and should end at the second-to-last pixel of the row (first and last are filled separately)
-			uint8_t* dest				= dest_row;
-			
-			// Row starting with Green
-			if (y % 2 == 0)
-			{
-				// Fill first pixel (green)
-				B = (source[source_stride] + source[source_stride + 2] + 1) >> 1;
-				G = source[source_stride + 1];
-				R = (source[1] + source[source_stride * 2 + 1] + 1) >> 1;
-				*dest = (uint8_t)((R*77 + G*151 + B*28)>>8);
-				
-				source++;
-				dest++;
-				
-				// Fill remaining pixel
-				for (; source <= source_end - 2; source += 2, dest += 2)
-				{
-					// Blue pixel
-					B = source[source_stride + 1];
-					G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
-					R = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;
-					dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
-
-					//  Green pixel
-					B = (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
-					G = source[source_stride + 2];
-					R = (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
-					dest[1] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+		case F::Bayer:		return ConvertTo<F::Bayer>;
+		case F::BGR:		return ConvertTo<F::BGR>;
+		case F::RGB:		return ConvertTo<F::RGB>;
+		case F::Gray:		return ConvertTo<F::Gray>;
+		case F::NV12:		return ConvertTo<F::NV12>;
+		case F::I420:		return ConvertTo<F::I420>;
+		case F::YUYV:		return ConvertTo<F::YUYV>;
+		case F::HalfBGR:	return ConvertTo<F::HalfBGR>;
+		case F::HalfRGB:	return ConvertTo<F::HalfRGB>;
+		case F::HalfGray:	return ConvertTo<F::HalfGray>;
+		case F::BGRA:		return ConvertTo<F::BGRA>;
+		case F::RGBA:		return ConvertTo<F::RGBA>;
+		case F::Mask:		return ConvertTo<F::Mask>;
+		case F::BitMask:	return ConvertTo<F::BitMask>;
+		}
+		return ConvertTo<F::Bayer>;
+	}
 
-				}
-			}
-			else
-			{
-				for (; source <= source_end - 2; source += 2, dest += 2)
-				{
-					// Red pixel
-					B = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
-					G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;;
-					R = source[source_stride + 1];
-					dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
-
-					// Green pixel
-					B = (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
-					G = source[source_stride + 2];
-					R = (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
-					dest[1] = (uint8_t)((R*77 + G*151 + B*28)>>8);
-				}
-			}
-			
-			if (source < source_end)
-			{
-				B = source[source_stride + 1];
-				G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
-				R = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
-				dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+	static void Convert(const uint8_t* source, int frame_width, int frame_height, PS3EYECam::EOutputFormat outputFormat, DebayerThreadPool* debayer_pool, const PS3EYECam::FrameConvertOptions& options, uint8_t* dest, int dest_stride)
+	{
+		GetConvertFunc(outputFormat)(source, frame_width, frame_height, debayer_pool, options, dest, dest_stride);
+	}
 
-				source++;
-				dest++;
-			}
-			
-			// Fill first pixel of row (copy second pixel)
-			uint8_t* first_pixel	= dest_row-1;
-			first_pixel[0]			= dest_row[0];
-			
-			// Fill last pixel of row (copy second-to-last pixel). Note: dest row starts at the *second* pixel of the row, so dest_row + (width-2) * num_output_channels puts us at the last pixel of the row
-			uint8_t* last_pixel				= dest_row + (frame_width - 2);
-			uint8_t* second_to_last_pixel	= last_pixel - 1;
-			last_pixel[0]					= second_to_last_pixel[0];
+	// Wake up the consumer and make any further Dequeue/AcquireFrame fail with the given status.
+	// Only the first reason is kept, so a device error is still reported after the camera is stopped.
+	void Close(PS3EYECam::EFrameStatus reason)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		PS3EYECam::EFrameStatus expected = PS3EYECam::EFrameStatus::OK;
+		status.compare_exchange_strong(expected, reason);
+
+		empty_condition.notify_all();
+	}
+
+	PS3EYECam::EFrameStatus Dequeue(uint8_t* new_frame, int new_frame_stride, int frame_width, int frame_height, PS3EYECam::FrameConvertFunc convert, DebayerThreadPool* debayer_pool, const PS3EYECam::FrameConvertOptions& options, FrameMetadata* metadata, int timeout_ms)
+	{
+		// The slot stays reserved until ReleaseFrame, so we can convert without holding anything the producer needs
+		uint8_t* source = NULL;
+		PS3EYECam::EFrameStatus result = AcquireFrame(&source, metadata, timeout_ms);
+		if (result != PS3EYECam::EFrameStatus::OK)
+			return result;
+
+		convert(source, frame_width, frame_height, debayer_pool, options, new_frame, new_frame_stride);
+		if (metadata)
+			metadata->converted_us = monotonic_time_us();
+
+		ReleaseFrame();
+		return PS3EYECam::EFrameStatus::OK;
+	}
+
+	// Copy the oldest frame out of a queue of frames that are already in the output format, with packed rows of row_bytes
+	PS3EYECam::EFrameStatus DequeueCopy(uint8_t* dest, int dest_stride, int row_bytes, int height, PS3EYECam::EOutputFormat outputFormat, FrameMetadata* metadata, int timeout_ms)
+	{
+		uint8_t* source = NULL;
+		PS3EYECam::EFrameStatus result = AcquireFrame(&source, metadata, timeout_ms);
+		if (result != PS3EYECam::EFrameStatus::OK)
+			return result;
+
+		if (dest_stride == row_bytes)
+		{
+			memcpy(dest, source, frame_size);
 		}
-		
-		// Fill first & last row
-		for (int i = 0; i < dest_stride; i++)
+		else
 		{
-			outBuffer[i]									= outBuffer[i + dest_stride];
-			outBuffer[i + (frame_height - 1)*dest_stride]	= outBuffer[i + (frame_height - 2)*dest_stride];
+			copy_rect(source, row_bytes, 0, 0, dest, dest_stride, row_bytes, height);
+
+			// The V plane of I420 directly follows the U plane with the same stride, so both are copied as one plane of twice the height
+			const uint8_t* source_chroma	= source + row_bytes * height;
+			uint8_t* dest_chroma			= dest + dest_stride * height;
+			if (outputFormat == PS3EYECam::EOutputFormat::NV12)
+				copy_rect(source_chroma, row_bytes, 0, 0, dest_chroma, dest_stride, row_bytes, height / 2);
+			else if (outputFormat == PS3EYECam::EOutputFormat::I420)
+				copy_rect(source_chroma, row_bytes / 2, 0, 0, dest_chroma, dest_stride / 2, row_bytes / 2, height);
 		}
+
+		ReleaseFrame();
+		return PS3EYECam::EFrameStatus::OK;
 	}
 
-	void DebayerRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR)
+	PS3EYECam::EFrameStatus DequeueROIs(FrameROI* rois, uint32_t num_rois, int frame_width, int frame_height, PS3EYECam::EOutputFormat outputFormat, const PS3EYECam::FrameConvertOptions& options, FrameMetadata* metadata, int timeout_ms)
 	{
-		// PSMove output is in the following Bayer format (GRBG):
-		//
-		// G R G R G R
-		// B G B G B G
-		// G R G R G R
-		// B G B G B G
-		//
-		// This is the normal Bayer pattern shifted left one place.
+		uint8_t* source = NULL;
+		PS3EYECam::EFrameStatus result = AcquireFrame(&source, metadata, timeout_ms);
+		if (result != PS3EYECam::EFrameStatus::OK)
+			return result;
+
+		for (uint32_t index = 0; index < num_rois; ++index)
+			ConvertROI(source, frame_width, frame_height, outputFormat, options, rois[index]);
+		if (metadata)
+			metadata->converted_us = monotonic_time_us();
+
+		ReleaseFrame();
+		return PS3EYECam::EFrameStatus::OK;
+	}
+
+	// Find the blobs of the raw frame, and convert it too unless new_frame is NULL
+	PS3EYECam::EFrameStatus DequeueBlobs(const BlobParams& params, std::vector<Blob>& blobs, uint8_t* new_frame, int new_frame_stride, int frame_width, int frame_height,
+										 PS3EYECam::FrameConvertFunc convert, DebayerThreadPool* debayer_pool, const PS3EYECam::FrameConvertOptions& options, FrameMetadata* metadata, int timeout_ms)
+	{
+		uint8_t* source = NULL;
+		PS3EYECam::EFrameStatus result = AcquireFrame(&source, metadata, timeout_ms);
+		if (result != PS3EYECam::EFrameStatus::OK)
+			return result;
+
+		blob_detector.Detect(frame_width, frame_height, source, params, blobs);
+		if (new_frame)
+			convert(source, frame_width, frame_height, debayer_pool, options, new_frame, new_frame_stride);
+		if (metadata)
+			metadata->converted_us = monotonic_time_us();
+
+		ReleaseFrame();
+		return PS3EYECam::EFrameStatus::OK;
+	}
+
+	PS3EYECam::EFrameStatus DequeuePyramid(FramePyramid& pyramid, int frame_width, int frame_height, DebayerThreadPool* debayer_pool, FrameMetadata* metadata, int timeout_ms)
+	{
+		uint8_t* source = NULL;
+		PS3EYECam::EFrameStatus result = AcquireFrame(&source, metadata, timeout_ms);
+		if (result != PS3EYECam::EFrameStatus::OK)
+			return result;
+
+		if (debayer_pool)
+			debayer_pool->DebayerPyramid(frame_width, frame_height, source, pyramid);
+		else
+			DebayerPyramid(frame_width, frame_height, source, pyramid);
+		if (metadata)
+			metadata->converted_us = monotonic_time_us();
+
+		ReleaseFrame();
+		return PS3EYECam::EFrameStatus::OK;
+	}
 
-		int				num_output_channels	    = 3;
-		int				source_stride			= frame_width;
-		const uint8_t*	source_row				= inBayer;												// Start at first bayer pixel
-		int				dest_stride				= frame_width * num_output_channels;
-		uint8_t*		dest_row				= outBuffer + dest_stride + num_output_channels + 1; 	// We start outputting at the second pixel of the second row's G component
-		int				swap_br					= inBGR ? 1 : -1;
+	// Wait for the oldest frame (or the newest one in LatestOnly mode) and return a pointer to it inside the ring buffer.
+	// Its slot stays reserved until ReleaseFrame() is called: the producer only ever writes to the head slot, head never
+	// catches up with tail, and the producer won't drop the tail frame while it is marked as being read.
+	// timeout_ms < 0 waits forever, 0 doesn't wait at all. ReleaseFrame() must only be called if OK is returned.
+	// Only one frame can be read at a time: Busy is returned while the previous one hasn't been released.
+	PS3EYECam::EFrameStatus AcquireFrame(uint8_t** frame, FrameMetadata* metadata, int timeout_ms)
+	{
+		const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms > 0 ? timeout_ms : 0);
 
-		// Fill rows 1 to height-1 of the destination buffer. First and last row are filled separately (they are copied from the second row and second-to-last rows respectively)
-		for (int y = 0; y < frame_height-1; source_row += source_stride, dest_row += dest_stride, ++y)
+		for (;;)
 		{
-			const uint8_t* source		= source_row;
-			const uint8_t* source_end	= source + (source_stride-2);								// -2 to deal with the fact that we're starting at the second pixel of the row and should end at the second-to-last pixel of the row (first and last are filled separately)
-			uint8_t* dest				= dest_row;		
+			PS3EYECam::EFrameStatus cur_status = status.load(std::memory_order_acquire);
+			if (cur_status != PS3EYECam::EFrameStatus::OK)
+				return cur_status;
 
-			// Row starting with Green
-			if (y % 2 == 0)
-			{
-				// Fill first pixel (green)
-				dest[-1*swap_br]	= (source[source_stride] + source[source_stride + 2] + 1) >> 1;
-				dest[0]				= source[source_stride + 1];
-				dest[1*swap_br]		= (source[1] + source[source_stride * 2 + 1] + 1) >> 1;		
+			uint32_t cur_tail	= tail.load(std::memory_order_acquire);
+			uint32_t cur_head	= head.load(std::memory_order_acquire);
+			uint32_t tail_index	= cur_tail >> 1;
 
-				source++;
-				dest += num_output_channels;
+			// Acquiring again would move the read mark away from the frame still being read and let the producer overwrite it
+			if (cur_tail & 1)
+				return PS3EYECam::EFrameStatus::Busy;
 
-				// Fill remaining pixel
-				for (; source <= source_end - 2; source += 2, dest += num_output_channels * 2)
-				{
-					// Blue pixel
-					uint8_t* cur_pixel	= dest;
-					cur_pixel[-1*swap_br]	= source[source_stride + 1];
-					cur_pixel[0]			= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
-					cur_pixel[1*swap_br]	= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;				
-
-					//  Green pixel
-					uint8_t* next_pixel		= cur_pixel+num_output_channels;
-					next_pixel[-1*swap_br]	= (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;					
-					next_pixel[0]			= source[source_stride + 2];
-					next_pixel[1*swap_br]	= (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
-				}
+			// If there is no data in the buffer, wait until data becomes available or the queue is closed
+			if (cur_head == tail_index)
+			{
+				if (timeout_ms == 0)
+					return PS3EYECam::EFrameStatus::Timeout;
+
+				std::unique_lock<std::mutex> lock(mutex);
+				consumer_waiting.store(true, std::memory_order_seq_cst);
+
+				auto ready = [this, tail_index] () { return head.load(std::memory_order_seq_cst) != tail_index || status.load(std::memory_order_relaxed) != PS3EYECam::EFrameStatus::OK; };
+				bool woken = true;
+				if (timeout_ms < 0)
+					empty_condition.wait(lock, ready);
+				else
+					woken = empty_condition.wait_until(lock, deadline, ready);
+
+				consumer_waiting.store(false, std::memory_order_relaxed);
+				if (!woken)
+					return PS3EYECam::EFrameStatus::Timeout;
+				continue;
 			}
-			else
+
+			// In LatestOnly mode skip straight to the newest frame and drop the ones before it
+			uint32_t index = tail_index;
+			if (policy == PS3EYECam::EQueuePolicy::LatestOnly)
+				index = Advance(cur_head, 2 * num_frames - 1);
+
+			// Mark the frame as being read. This fails if the producer dropped the oldest frame in the meantime.
+			if (tail.compare_exchange_weak(cur_tail, (index << 1) | 1, std::memory_order_acq_rel, std::memory_order_acquire))
 			{
-				for (; source <= source_end - 2; source += 2, dest += num_output_channels * 2)
+				uint32_t skipped = Distance(index, tail_index);
+				if (skipped > 0)
+					dropped_frames.fetch_add(skipped, std::memory_order_relaxed);
+
+				read_index = index;
+
+				// Frames that were dropped for any reason (by the producer or by skipping) show up as a gap in the sequence
+				const FrameMetadata& slot_metadata = frame_metadata[index % num_frames];
+				if (metadata)
 				{
-					// Red pixel
-					uint8_t* cur_pixel	= dest;
-					cur_pixel[-1*swap_br]	= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
-					cur_pixel[0]			= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;;
-					cur_pixel[1*swap_br]	= source[source_stride + 1];
-
-					// Green pixel
-					uint8_t* next_pixel		= cur_pixel+num_output_channels;
-					next_pixel[-1*swap_br]	= (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
-					next_pixel[0]			= source[source_stride + 2];
-					next_pixel[1*swap_br]	= (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
+					*metadata = slot_metadata;
+					metadata->dropped_frames = slot_metadata.sequence - last_delivered_sequence - 1;
 				}
+				last_delivered_sequence = slot_metadata.sequence;
+
+				*frame = frame_buffer + frame_size * (index % num_frames);
+				return PS3EYECam::EFrameStatus::OK;
 			}
+		}
+	}
 
-			if (source < source_end)
-			{
-				dest[-1*swap_br]	= source[source_stride + 1];
-				dest[0]				= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;			
-				dest[1*swap_br]		= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;			
+	// Convert one rectangle of a raw frame, clipping it to the frame first.
+	void ConvertROI(const uint8_t* source, int frame_width, int frame_height, PS3EYECam::EOutputFormat outputFormat, const PS3EYECam::FrameConvertOptions& options, FrameROI& roi)
+	{
+		bool half	= outputFormat == PS3EYECam::EOutputFormat::HalfBGR || outputFormat == PS3EYECam::EOutputFormat::HalfRGB || outputFormat == PS3EYECam::EOutputFormat::HalfGray;
+		bool yuv420	= outputFormat == PS3EYECam::EOutputFormat::NV12 || outputFormat == PS3EYECam::EOutputFormat::I420;
+		bool yuyv	= outputFormat == PS3EYECam::EOutputFormat::YUYV;
+
+		// Clip to the output frame. Chroma samples cover pixel pairs (and row pairs for 4:2:0), so shrink to whole ones.
+		// Bit masks shrink to whole bytes, except at the right frame border.
+		int out_width	= half ? frame_width / 2 : frame_width;
+		int out_height	= half ? frame_height / 2 : frame_height;
+		int x0 = (int)std::min<uint32_t>(roi.x, out_width);
+		int y0 = (int)std::min<uint32_t>(roi.y, out_height);
+		int x1 = x0 + (int)std::min<uint32_t>(roi.width, out_width - x0);
+		int y1 = y0 + (int)std::min<uint32_t>(roi.height, out_height - y0);
+		if (yuv420 || yuyv)
+		{
+			x0 = (x0 + 1) & ~1;
+			x1 = std::max(x0, x1 & ~1);
+		}
+		if (yuv420)
+		{
+			y0 = (y0 + 1) & ~1;
+			y1 = std::max(y0, y1 & ~1);
+		}
+		if (outputFormat == PS3EYECam::EOutputFormat::BitMask)
+		{
+			x0 = std::min((x0 + 7) & ~7, out_width);
+			x1 = std::max(x0, x1 == out_width ? x1 : x1 & ~7);
+		}
 
-				source++;
-				dest += num_output_channels;
-			}
+		roi.x		= x0;
+		roi.y		= y0;
+		roi.width	= x1 - x0;
+		roi.height	= y1 - y0;
+		if (roi.width == 0 || roi.height == 0)
+			return;
 
-			// Fill first pixel of row (copy second pixel)
-			uint8_t* first_pixel		= dest_row-num_output_channels;
-			first_pixel[-1*swap_br]		= dest_row[-1*swap_br];
-			first_pixel[0]				= dest_row[0];
-			first_pixel[1*swap_br]		= dest_row[1*swap_br];
-		
- 			// Fill last pixel of row (copy second-to-last pixel). Note: dest row starts at the *second* pixel of the row, so dest_row + (width-2) * num_output_channels puts us at the last pixel of the row
-			uint8_t* last_pixel				= dest_row + (frame_width - 2)*num_output_channels;
-			uint8_t* second_to_last_pixel	= last_pixel - num_output_channels;
-			
-			last_pixel[-1*swap_br]			= second_to_last_pixel[-1*swap_br];
-			last_pixel[0]					= second_to_last_pixel[0];
-			last_pixel[1*swap_br]			= second_to_last_pixel[1*swap_br];
+		int row_bytes = (int)PS3EYECam::getOutputRowBytes(outputFormat, roi.width);
+		int stride = std::max((int)roi.stride, row_bytes);
+		if (outputFormat == PS3EYECam::EOutputFormat::I420)
+			stride = (stride + 1) & ~1;
+
+		if (outputFormat == PS3EYECam::EOutputFormat::Bayer)
+		{
+			copy_rect(source, frame_width, x0, y0, roi.data, stride, roi.width, roi.height);
+			return;
 		}
 
-		// Fill first & last row
-		for (int i = 0; i < dest_stride; i++)
+		// Remapped pixels can come from anywhere in the frame, so they are interpolated from the whole frame's rows
+		int remap_channels = GetRemapChannels(outputFormat, options, frame_width, frame_height);
+		if (remap_channels != 0)
 		{
-			outBuffer[i]									= outBuffer[i + dest_stride];
-			outBuffer[i + (frame_height - 1)*dest_stride]	= outBuffer[i + (frame_height - 2)*dest_stride];
+			bool inBGR = outputFormat == PS3EYECam::EOutputFormat::BGR || outputFormat == PS3EYECam::EOutputFormat::BGRA;
+			DebayerRemapRect(frame_width, frame_height, source, *options.remap, roi.data, stride, remap_channels, inBGR, x0, x1, y0, y1, options.color_matrix.get(), options.color_lut.get());
+			return;
 		}
+
+		// Convert in strips of a few rows so the scratch buffers stay in L1/L2 instead of growing to a whole window,
+		// which would be written and read back through memory. Strips have an even number of rows so they keep 4:2:0 chroma rows whole.
+		int strip_rows = std::max(8, (ROI_STRIP_BYTES / row_bytes) & ~1);
+		for (int strip_y0 = y0; strip_y0 < y1; strip_y0 += strip_rows)
+		{
+			int strip_y1 = std::min(strip_y0 + strip_rows, y1);
+			ConvertROIStrip(source, frame_width, frame_height, outputFormat, options, x0, x1, strip_y0, strip_y1,
+							roi.data + (strip_y0 - y0) * stride, stride, roi.height, strip_y0 - y0);
+		}
+	}
+
+	void ReleaseFrame()
+	{
+		// Hand the slot back to the producer once we're done reading it
+		tail.store(Advance(read_index, 1) << 1, std::memory_order_release);
 	}
 
 private:
+	static const int ROI_STRIP_BYTES = 16 * 1024;
+
+	// Convert output rows [y0, y1) and columns [x0, x1) of a ROI. The Bayer pixels they depend on are copied into a small
+	// frame of their own, starting on an even row and column so it is a GRBG frame as well, and with the margin the
+	// interpolation needs (one pixel, or two for the high quality demosaic) except where the rows touch the frame border. Converting that frame gives the same pixels
+	// as converting the whole frame, and the rows are then copied out of it. dest points to the first row of the strip,
+	// roi_height and strip_row place the strip's chroma rows in the ROI's planes.
+	void ConvertROIStrip(const uint8_t* source, int frame_width, int frame_height, PS3EYECam::EOutputFormat outputFormat,
+						 const PS3EYECam::FrameConvertOptions& options, int x0, int x1, int y0, int y1, uint8_t* dest, int stride, int roi_height, int strip_row)
+	{
+		bool half = outputFormat == PS3EYECam::EOutputFormat::HalfBGR || outputFormat == PS3EYECam::EOutputFormat::HalfRGB || outputFormat == PS3EYECam::EOutputFormat::HalfGray;
+
+		// Source window. Half resolution pixels don't need any neighbours.
+		int sx0, sy0, sx1, sy1;
+		if (half)
+		{
+			sx0 = x0 * 2;
+			sy0 = y0 * 2;
+			sx1 = x1 * 2;
+			sy1 = y1 * 2;
+		}
+		else if (options.demosaic_quality == PS3EYECam::EDemosaicQuality::HighQuality &&
+				 (outputFormat == PS3EYECam::EOutputFormat::BGR || outputFormat == PS3EYECam::EOutputFormat::RGB ||
+				  outputFormat == PS3EYECam::EOutputFormat::BGRA || outputFormat == PS3EYECam::EOutputFormat::RGBA))
+		{
+			// High quality pixels need two neighbours on either side. Past the frame border they are mirrored, as they are
+			// when converting the whole frame, so the window only has to reach that far where it doesn't touch the border.
+			sx0 = std::max(x0 - 2, 0) & ~1;
+			sy0 = std::max(y0 - 2, 0) & ~1;
+			sx1 = std::min((x1 + 3) & ~1, frame_width);
+			sy1 = std::min((y1 + 3) & ~1, frame_height);
+		}
+		else
+		{
+			// The first and last row and column are copies of their inner neighbours, so they need those neighbours' sources.
+			// Bit mask windows start on a whole byte, so that the rectangle's bits are byte aligned in the converted window too.
+			sx0 = (clamp_inner(x0, frame_width) - 1) & (outputFormat == PS3EYECam::EOutputFormat::BitMask ? ~7 : ~1);
+			sy0 = (clamp_inner(y0, frame_height) - 1) & ~1;
+			sx1 = std::min((clamp_inner(x1 - 1, frame_width) + 3) & ~1, frame_width);
+			sy1 = std::min((clamp_inner(y1 - 1, frame_height) + 3) & ~1, frame_height);
+		}
+
+		int crop_width	= sx1 - sx0;
+		int crop_height	= sy1 - sy0;
+		roi_bayer.resize(crop_width * crop_height);
+		for (int y = sy0; y < sy1; ++y)
+			memcpy(&roi_bayer[(y - sy0) * crop_width], source + y * frame_width + sx0, crop_width);
+
+		// The half resolution window converts to exactly the rectangle
+		if (half)
+		{
+			Convert(roi_bayer.data(), crop_width, crop_height, outputFormat, NULL, options, dest, stride);
+			return;
+		}
+
+		int width	= x1 - x0;
+		int height	= y1 - y0;
+		int crop_stride = (int)PS3EYECam::getOutputRowBytes(outputFormat, crop_width);
+		bool yuv420 = outputFormat == PS3EYECam::EOutputFormat::NV12 || outputFormat == PS3EYECam::EOutputFormat::I420;
+		roi_output.resize(yuv420 ? crop_width * crop_height * 3 / 2 : crop_stride * crop_height);
+		Convert(roi_bayer.data(), crop_width, crop_height, outputFormat, NULL, options, roi_output.data(), crop_stride);
+
+		// Copy the rows out of the converted window, plane by plane. The chroma planes are laid out like
+		// those of a frame with the ROI's size and stride.
+		copy_rect(roi_output.data(), crop_stride, PS3EYECam::getOutputRowBytes(outputFormat, x0 - sx0), y0 - sy0,
+				  dest, stride, PS3EYECam::getOutputRowBytes(outputFormat, width), height);
+		uint8_t* roi_y = dest - strip_row * stride;
+		if (outputFormat == PS3EYECam::EOutputFormat::NV12)
+		{
+			copy_rect(roi_output.data() + crop_width * crop_height, crop_width, x0 - sx0, (y0 - sy0) / 2,
+					  roi_y + stride * roi_height + (strip_row / 2) * stride, stride, width, height / 2);
+		}
+		else if (outputFormat == PS3EYECam::EOutputFormat::I420)
+		{
+			const uint8_t* crop_u	= roi_output.data() + crop_width * crop_height;
+			const uint8_t* crop_v	= crop_u + (crop_width / 2) * (crop_height / 2);
+			uint8_t* roi_u			= roi_y + stride * roi_height;
+			uint8_t* roi_v			= roi_u + (stride / 2) * (roi_height / 2);
+			int chroma_row			= (strip_row / 2) * (stride / 2);
+			copy_rect(crop_u, crop_width / 2, (x0 - sx0) / 2, (y0 - sy0) / 2, roi_u + chroma_row, stride / 2, width / 2, height / 2);
+			copy_rect(crop_v, crop_width / 2, (x0 - sx0) / 2, (y0 - sy0) / 2, roi_v + chroma_row, stride / 2, width / 2, height / 2);
+		}
+	}
+
+	// Channels of the remapped output if frames of this size are remapped to outputFormat, 0 if they aren't
+	static int GetRemapChannels(PS3EYECam::EOutputFormat outputFormat, const PS3EYECam::FrameConvertOptions& options, int frame_width, int frame_height)
+	{
+		typedef PS3EYECam::EOutputFormat F;
+
+		if (!options.remap || options.remap->GetWidth() != frame_width || options.remap->GetHeight() != frame_height)
+			return 0;
+
+		switch (outputFormat)
+		{
+		case F::Gray:	return 1;
+		case F::BGR:
+		case F::RGB:	return 3;
+		case F::BGRA:
+		case F::RGBA:	return 4;
+		default:		return 0;
+		}
+	}
+
+	static int clamp_inner(int index, int size)
+	{
+		return index < 1 ? 1 : (index > size - 2 ? size - 2 : index);
+	}
+
+	// Copy num_rows rows of row_bytes bytes starting at byte x, row y of src into the rows of dest
+	static void copy_rect(const uint8_t* src, int src_stride, int x, int y, uint8_t* dest, int dest_stride, int row_bytes, int num_rows)
+	{
+		for (int row = 0; row < num_rows; ++row)
+			memcpy(dest + row * dest_stride, src + (y + row) * src_stride + x, row_bytes);
+	}
+
+	// Ring indices run over [0, 2*num_frames) so that head == tail means empty
+	uint32_t Advance(uint32_t index, uint32_t count) const
+	{
+		return (index + count) % (2 * num_frames);
+	}
+
+	uint32_t Distance(uint32_t to, uint32_t from) const
+	{
+		return (to + 2 * num_frames - from) % (2 * num_frames);
+	}
+
 	uint32_t				frame_size;
 	uint32_t				num_frames;
+	PS3EYECam::EQueuePolicy	policy;
 
 	uint8_t*				frame_buffer;
-	uint32_t				head;
-	uint32_t				tail;
-	uint32_t				available;
-
+	FrameMetadata*			frame_metadata;
+	std::atomic<uint32_t>	head;
+	std::atomic<uint32_t>	tail;
+	uint32_t				read_index;			// Only accessed by the consumer
+	uint32_t				next_sequence;		// Only accessed by the producer
+	uint32_t				last_delivered_sequence;	// Only accessed by the consumer
+	std::atomic<uint32_t>	dropped_frames;
+	std::atomic<PS3EYECam::EFrameStatus>	status;
+
+	std::atomic<bool>		consumer_waiting;
 	std::mutex				mutex;
 	std::condition_variable	empty_condition;
+
+	std::vector<uint8_t>	roi_bayer;			// Scratch buffers for ConvertROI, only accessed by the consumer
+	std::vector<uint8_t>	roi_output;
+	BlobDetector			blob_detector;		// Only accessed by the consumer
 };
 
 // URBDesc
@@ -737,8 +1081,12 @@ public:
 		transfer_buffer			(NULL),
 		cur_frame_start			(NULL),
 		cur_frame_data_len		(0),
+		cur_frame_pts			(0),
+		cur_frame_first_packet_us(0),
 		frame_size				(0),
-		frame_queue				(NULL)
+		frame_queue				(),
+		denoise_strength		(0.0f),
+		denoise_motion_threshold(16)
 	{
 	}
 
@@ -748,20 +1096,24 @@ public:
 		close_transfers();
 	}
 
-	bool start_transfers(libusb_device_handle *handle, uint32_t curr_frame_size)
+	bool start_transfers(libusb_device_handle *handle, uint32_t curr_frame_size, uint32_t queue_depth, PS3EYECam::EQueuePolicy queue_policy)
 	{
 		// Initialize the frame queue
         frame_size = curr_frame_size;
-		frame_queue = new FrameQueue(frame_size);
+		// The consumer may look at the queue from another thread, so swap it atomically
+		std::atomic_store(&frame_queue, std::shared_ptr<FrameQueue>( new FrameQueue(frame_size, queue_depth, queue_policy) ));
 
 		// Initialize the current frame pointer to the start of the buffer; it will be updated as frames are completed and pushed onto the frame queue
 		cur_frame_start = frame_queue->GetFrameBufferStart();
 		cur_frame_data_len = 0;
+		denoiser.Reset();
 
 		// Find the bulk transfer endpoint
 		uint8_t bulk_endpoint = find_ep(libusb_get_device(handle));
 		libusb_clear_halt(handle, bulk_endpoint);
 
+		std::lock_guard<std::mutex> lock(num_active_transfers_mutex);
+
 		// Allocate the transfer buffer
 		transfer_buffer = (uint8_t*)malloc(TRANSFER_SIZE * NUM_TRANSFERS);
 		memset(transfer_buffer, 0, TRANSFER_SIZE * NUM_TRANSFERS);
@@ -773,7 +1125,16 @@ public:
 			xfr[index] = libusb_alloc_transfer(0);
 			libusb_fill_bulk_transfer(xfr[index], handle, bulk_endpoint, transfer_buffer + index * TRANSFER_SIZE, TRANSFER_SIZE, transfer_completed_callback, reinterpret_cast<void*>(this), 0);
 
-			res |= libusb_submit_transfer(xfr[index]);
+			int submit_res = libusb_submit_transfer(xfr[index]);
+			res |= submit_res;
+
+			// A transfer that failed to submit never completes, so don't wait for it in close_transfers
+			if (submit_res < 0)
+			{
+				libusb_free_transfer(xfr[index]);
+				xfr[index] = NULL;
+				continue;
+			}
 			
 			num_active_transfers++;
 		}
@@ -789,14 +1150,14 @@ public:
 	void close_transfers()
 	{
 		std::unique_lock<std::mutex> lock(num_active_transfers_mutex);
-		if (num_active_transfers == 0)
+		if (transfer_buffer == NULL)
 			return;
 
+		// Wake up anyone waiting for a frame
+		frame_queue->Close(PS3EYECam::EFrameStatus::Stopped);
+
 		// Cancel any pending transfers
-		for (int index = 0; index < NUM_TRANSFERS; ++index)
-		{
-			libusb_cancel_transfer(xfr[index]);
-		}
+		cancel_transfers();
 
 		// Wait for cancelation to finish
 		num_active_transfers_condition.wait(lock, [this]() { return num_active_transfers == 0; });
@@ -806,22 +1167,39 @@ public:
 		free(transfer_buffer);
 		transfer_buffer = NULL;
 
-		delete frame_queue;
-		frame_queue = NULL;
+		// Outstanding frame leases keep the queue alive until they are released
+		std::atomic_store(&frame_queue, std::shared_ptr<FrameQueue>());
 	}
 
-	void transfer_canceled()
+	// Called from the transfer thread when a transfer is no longer active. It is freed, so forget about it.
+	void transfer_canceled(libusb_transfer* transfer)
 	{
 		std::lock_guard<std::mutex> lock(num_active_transfers_mutex);
+		for (int index = 0; index < NUM_TRANSFERS; ++index)
+		{
+			if (xfr[index] == transfer)
+				xfr[index] = NULL;
+		}
 		--num_active_transfers;
 		num_active_transfers_condition.notify_one();
 	}
 
+	// Called from the transfer thread when a transfer failed. We can't wait for the other transfers here since their
+	// callbacks run on this same thread, so just cancel them and report the error; stop() cleans up the rest.
+	void transfer_failed()
+	{
+		std::lock_guard<std::mutex> lock(num_active_transfers_mutex);
+		frame_queue->Close(PS3EYECam::EFrameStatus::DeviceError);
+		cancel_transfers();
+	}
+
 	void frame_add(enum gspca_packet_type packet_type, const uint8_t *data, int len)
 	{
 	    if (packet_type == FIRST_PACKET) 
 	    {
             cur_frame_data_len = 0;
+            cur_frame_pts = last_pts;
+            cur_frame_first_packet_us = monotonic_time_us();
 	    } 
 	    else
 	    {
@@ -856,8 +1234,30 @@ public:
 	    last_packet_type = packet_type;
 
 	    if (packet_type == LAST_PACKET) {        
+			FrameMetadata metadata;
+			metadata.pts = cur_frame_pts;
+			metadata.first_packet_us = cur_frame_first_packet_us;
+			metadata.last_packet_us = monotonic_time_us();
+
+			// The completed frame isn't touched again until the next frame starts, even if it was dropped
+			const uint8_t* completed_frame = cur_frame_start;
+
+			// Correct it before anyone else sees it
+			std::shared_ptr<const BayerCorrection> correction = std::atomic_load(&bayer_correction);
+			if (correction && (uint32_t)(correction->GetWidth() * correction->GetHeight()) == frame_size)
+				correction->Apply(cur_frame_start);
+
+			float strength = denoise_strength.load(std::memory_order_relaxed);
+			if (strength > 0.0f)
+				denoiser.Apply(cur_frame_start, frame_size, strength, denoise_motion_threshold.load(std::memory_order_relaxed));
+			else
+				denoiser.Reset();
+
 			cur_frame_data_len = 0;
-			cur_frame_start = frame_queue->Enqueue();
+			cur_frame_start = frame_queue->Enqueue(metadata);
+
+			if (frame_callback)
+				frame_callback(completed_frame, metadata);
 	        //debug("frame completed %d\n", frame_complete_ind);
 	    }
 	}
@@ -936,6 +1336,15 @@ public:
 	    } while (remaining_len > 0);
 	}
 
+	void cancel_transfers()
+	{
+		for (int index = 0; index < NUM_TRANSFERS; ++index)
+		{
+			if (xfr[index] != NULL)
+				libusb_cancel_transfer(xfr[index]);
+		}
+	}
+
 	uint8_t					num_active_transfers;
 	std::mutex				num_active_transfers_mutex;
 	std::condition_variable	num_active_transfers_condition;
@@ -948,8 +1357,15 @@ public:
 	uint8_t*				transfer_buffer;
     uint8_t*				cur_frame_start;
 	uint32_t				cur_frame_data_len;
+	uint32_t				cur_frame_pts;
+	uint64_t				cur_frame_first_packet_us;
 	uint32_t				frame_size;
-	FrameQueue*				frame_queue;
+	std::shared_ptr<FrameQueue>	frame_queue;
+	PS3EYECam::FrameCallback	frame_callback;		// Raw frame callback, only changed while not streaming
+	std::shared_ptr<const BayerCorrection> bayer_correction;	// Applied to every completed frame, swapped atomically
+	TemporalDenoiser		denoiser;			// Only accessed by the producer
+	std::atomic<float>		denoise_strength;	// 0 if frames aren't denoised
+	std::atomic<uint8_t>	denoise_motion_threshold;
 };
 
 static void LIBUSB_CALL transfer_completed_callback(struct libusb_transfer *xfr)
@@ -962,11 +1378,11 @@ static void LIBUSB_CALL transfer_completed_callback(struct libusb_transfer *xfr)
         debug("transfer status %d\n", status);
 
         libusb_free_transfer(xfr);
-		urb->transfer_canceled();
+		urb->transfer_canceled(xfr);
         
         if(status != LIBUSB_TRANSFER_CANCELLED)
         {
-            urb->close_transfers();
+            urb->transfer_failed();
         }
         return;
     }
@@ -977,7 +1393,9 @@ static void LIBUSB_CALL transfer_completed_callback(struct libusb_transfer *xfr)
 
     if (libusb_submit_transfer(xfr) < 0) {
         debug("error re-submitting URB\n");
-        urb->close_transfers();
+        libusb_free_transfer(xfr);
+        urb->transfer_canceled(xfr);
+        urb->transfer_failed();
     }
 }
 
@@ -1021,6 +1439,15 @@ PS3EYECam::PS3EYECam(libusb_device *device)
 
 	is_streaming = false;
 
+	debayer_thread_count = 1;
+	frame_queue_depth = 2;
+	frame_queue_policy = EQueuePolicy::DropNewest;
+	frame_callback_mode = ECallbackMode::Converted;
+	frame_convert = NULL;
+	decode_ahead = false;
+	mask_threshold = 128;
+	demosaic_quality = EDemosaicQuality::Bilinear;
+
 	device_ = device;
 	mgrPtr = USBMgr::instance();
 	urb = std::shared_ptr<URBDesc>( new URBDesc() );
@@ -1039,7 +1466,7 @@ void PS3EYECam::release()
 	if(usb_buf) free(usb_buf);
 }
 
-bool PS3EYECam::init(uint32_t width, uint32_t height, uint16_t desiredFrameRate, EOutputFormat outputFormat)
+bool PS3EYECam::init(uint32_t width, uint32_t height, uint16_t desiredFrameRate, EOutputFormat outputFormat, uint32_t queueDepth, EQueuePolicy queuePolicy)
 {
 	uint16_t sensor_id;
 
@@ -1067,6 +1494,11 @@ bool PS3EYECam::init(uint32_t width, uint32_t height, uint16_t desiredFrameRate,
 	}
 	frame_rate = ov534_set_frame_rate(desiredFrameRate, true);
 	frame_output_format = outputFormat;
+	frame_convert = FrameQueue::GetConvertFunc(outputFormat);
+	std::atomic_store(&remap_table, remap_tables[frame_width == 640 ? 0 : 1]);
+	std::atomic_store(&urb->bayer_correction, bayer_corrections[frame_width == 640 ? 0 : 1]);
+	frame_queue_depth = queueDepth < 2 ? 2 : queueDepth;
+	frame_queue_policy = queuePolicy;
 	//
 
 	/* reset bridge */
@@ -1138,7 +1570,16 @@ void PS3EYECam::start()
 	ov534_reg_write(0xe0, 0x00); // start stream
 
 	// init and start urb
-	urb->start_transfers(handle_, frame_width*frame_height);
+	urb->frame_callback = frame_callback_mode == ECallbackMode::Raw ? frame_callback : FrameCallback();
+	if (decode_ahead)
+		std::atomic_store(&decoded_queue, std::shared_ptr<FrameQueue>( new FrameQueue(getOutputFrameSize(), frame_queue_depth, frame_queue_policy) ));
+	urb->start_transfers(handle_, frame_width*frame_height, frame_queue_depth, frame_queue_policy);
+
+	if (decode_ahead)
+		decode_thread = std::thread(&PS3EYECam::decodeThreadFunc, this, std::atomic_load(&urb->frame_queue), std::atomic_load(&decoded_queue));
+	if (frame_callback && frame_callback_mode == ECallbackMode::Converted)
+		callback_thread = std::thread(&PS3EYECam::callbackThreadFunc, this);
+
     is_streaming = true;
 }
 
@@ -1153,6 +1594,13 @@ void PS3EYECam::stop()
 	// close urb
 	urb->close_transfers();
 
+	// Closing the frame queue makes the decode thread close the converted frame queue, and the conversion thread's getFrame return
+	if (decode_thread.joinable())
+		decode_thread.join();
+	if (callback_thread.joinable())
+		callback_thread.join();
+	std::atomic_store(&decoded_queue, std::shared_ptr<FrameQueue>());
+
     is_streaming = false;
 }
 
@@ -1202,6 +1650,11 @@ bool PS3EYECam::getUSBPortPath(char *out_identifier, size_t max_identifier_lengt
 }
 
 uint32_t PS3EYECam::getOutputBytesPerPixel() const
+{
+	return getOutputBytesPerPixel(frame_output_format);
+}
+
+uint32_t PS3EYECam::getOutputBytesPerPixel(EOutputFormat frame_output_format)
 {
 	if (frame_output_format == EOutputFormat::Bayer)
 		return 1;
@@ -1211,12 +1664,391 @@ uint32_t PS3EYECam::getOutputBytesPerPixel() const
 		return 3;
 	else if (frame_output_format == EOutputFormat::Gray)
 		return 1;
+	else if (frame_output_format == EOutputFormat::NV12)
+		return 1;
+	else if (frame_output_format == EOutputFormat::I420)
+		return 1;
+	else if (frame_output_format == EOutputFormat::YUYV)
+		return 2;
+	else if (frame_output_format == EOutputFormat::HalfBGR)
+		return 3;
+	else if (frame_output_format == EOutputFormat::HalfRGB)
+		return 3;
+	else if (frame_output_format == EOutputFormat::HalfGray)
+		return 1;
+	else if (frame_output_format == EOutputFormat::BGRA)
+		return 4;
+	else if (frame_output_format == EOutputFormat::RGBA)
+		return 4;
+	else if (frame_output_format == EOutputFormat::Mask)
+		return 1;
 	return 0;
 }
 
-void PS3EYECam::getFrame(uint8_t* frame)
+uint32_t PS3EYECam::getOutputRowBytes(EOutputFormat format, uint32_t width)
+{
+	if (format == EOutputFormat::BitMask)
+		return (width + 7) / 8;
+	return width * getOutputBytesPerPixel(format);
+}
+
+PS3EYECam::FrameConvertOptions PS3EYECam::getConvertOptions() const
+{
+	FrameConvertOptions options;
+	options.mask_threshold = mask_threshold.load(std::memory_order_relaxed);
+	options.demosaic_quality = demosaic_quality.load(std::memory_order_relaxed);
+	options.remap = std::atomic_load(&remap_table);
+	options.color_matrix = std::atomic_load(&color_matrix);
+	options.color_lut = std::atomic_load(&color_lut);
+	return options;
+}
+
+uint32_t PS3EYECam::getOutputFrameSize() const
+{
+	// The 4:2:0 formats have two chroma planes at a quarter of the size each after the Y plane
+	if (frame_output_format == EOutputFormat::NV12 || frame_output_format == EOutputFormat::I420)
+		return frame_width * frame_height * 3 / 2;
+	return getRowBytes() * getHeight();
+}
+
+PS3EYECam::EFrameStatus PS3EYECam::getFrame(uint8_t* frame, FrameMetadata* metadata)
+{
+	return getFrameTimeout(frame, -1, metadata);
+}
+
+PS3EYECam::EFrameStatus PS3EYECam::getFrameTimeout(uint8_t* frame, int timeout_ms, FrameMetadata* metadata)
+{
+	return getFrame(frame, 0, timeout_ms, metadata);
+}
+
+PS3EYECam::EFrameStatus PS3EYECam::getFrame(uint8_t* frame, uint32_t stride, int timeout_ms, FrameMetadata* metadata)
+{
+	// Hold on to the queue, so that it stays alive if the camera is stopped from another thread while we wait
+	std::shared_ptr<FrameQueue> queue = decode_ahead ? std::atomic_load(&decoded_queue) : std::atomic_load(&urb->frame_queue);
+	if (!queue)
+		return EFrameStatus::Stopped;
+
+	stride = std::max(stride, getRowBytes());
+	if (frame_output_format == EOutputFormat::I420)
+		stride = (stride + 1) & ~1u;
+
+	if (decode_ahead)
+		return queue->DequeueCopy(frame, (int)stride, (int)getRowBytes(), (int)getHeight(), frame_output_format, metadata, timeout_ms);
+
+	return queue->Dequeue(frame, (int)stride, frame_width, frame_height, frame_convert, debayer_pool.get(), getConvertOptions(), metadata, timeout_ms);
+}
+
+PS3EYECam::EFrameStatus PS3EYECam::getFrameROIs(FrameROI* rois, uint32_t num_rois, int timeout_ms, FrameMetadata* metadata)
+{
+	std::shared_ptr<FrameQueue> queue = std::atomic_load(&urb->frame_queue);
+	if (!queue || decode_ahead)
+		return EFrameStatus::Stopped;
+
+	return queue->DequeueROIs(rois, num_rois, frame_width, frame_height, frame_output_format, getConvertOptions(), metadata, timeout_ms);
+}
+
+PS3EYECam::EFrameStatus PS3EYECam::getFrameBlobs(const BlobParams& params, std::vector<Blob>& blobs, uint8_t* frame, uint32_t stride, int timeout_ms, FrameMetadata* metadata)
+{
+	std::shared_ptr<FrameQueue> queue = std::atomic_load(&urb->frame_queue);
+	if (!queue || decode_ahead)
+		return EFrameStatus::Stopped;
+
+	stride = std::max(stride, getRowBytes());
+	if (frame_output_format == EOutputFormat::I420)
+		stride = (stride + 1) & ~1u;
+
+	return queue->DequeueBlobs(params, blobs, frame, (int)stride, frame_width, frame_height, frame_convert, debayer_pool.get(), getConvertOptions(), metadata, timeout_ms);
+}
+
+PS3EYECam::EFrameStatus PS3EYECam::getFramePyramid(FramePyramid& pyramid, int timeout_ms, FrameMetadata* metadata)
+{
+	std::shared_ptr<FrameQueue> queue = std::atomic_load(&urb->frame_queue);
+	if (!queue || decode_ahead)
+		return EFrameStatus::Stopped;
+
+	return queue->DequeuePyramid(pyramid, frame_width, frame_height, debayer_pool.get(), metadata, timeout_ms);
+}
+
+uint32_t PS3EYECam::getDroppedFrameCount() const
+{
+	// In decode ahead mode, frames can be dropped by either queue
+	std::shared_ptr<FrameQueue> queue = std::atomic_load(&urb->frame_queue);
+	std::shared_ptr<FrameQueue> converted_queue = std::atomic_load(&decoded_queue);
+	return (queue ? queue->GetDroppedFrameCount() : 0) + (converted_queue ? converted_queue->GetDroppedFrameCount() : 0);
+}
+
+FrameLease PS3EYECam::acquireFrame()
+{
+	std::shared_ptr<FrameQueue> queue = std::atomic_load(&urb->frame_queue);
+	if (!queue || decode_ahead)
+		return FrameLease();
+
+	FrameMetadata metadata;
+	uint8_t* frame = NULL;
+	if (queue->AcquireFrame(&frame, &metadata, -1) != EFrameStatus::OK)
+		return FrameLease();
+
+	return FrameLease(queue, frame, queue->GetFrameSize(), metadata);
+}
+
+bool PS3EYECam::setFrameCallback(const FrameCallback& callback, ECallbackMode mode)
+{
+	if (is_streaming) return false;
+
+	frame_callback = callback;
+	frame_callback_mode = mode;
+	return true;
+}
+
+void PS3EYECam::callbackThreadFunc()
+{
+	std::vector<uint8_t> frame(getOutputFrameSize());
+	FrameMetadata metadata;
+
+	// Runs until the camera is stopped or the device fails
+	while (getFrame(frame.data(), &metadata) == EFrameStatus::OK)
+		frame_callback(frame.data(), metadata);
+}
+
+bool PS3EYECam::setDecodeAhead(bool enable)
+{
+	if (is_streaming) return false;
+
+	decode_ahead = enable;
+	return true;
+}
+
+bool PS3EYECam::setRemapTable(uint32_t width, uint32_t height, const float* map_x, const float* map_y)
+{
+	int index;
+	if (width == 640 && height == 480)
+		index = 0;
+	else if (width == 320 && height == 240)
+		index = 1;
+	else
+		return false;
+
+	if (map_x && map_y)
+		remap_tables[index] = std::shared_ptr<const RemapTable>( new RemapTable((int)width, (int)height, map_x, map_y) );
+	else
+		remap_tables[index].reset();
+
+	// Frames being converted keep the table they started with
+	if (width == frame_width && height == frame_height)
+		std::atomic_store(&remap_table, remap_tables[index]);
+	return true;
+}
+
+std::shared_ptr<BayerCorrection> PS3EYECam::editBayerCorrection(uint32_t width, uint32_t height) const
+{
+	int index;
+	if (width == 640 && height == 480)
+		index = 0;
+	else if (width == 320 && height == 240)
+		index = 1;
+	else
+		return std::shared_ptr<BayerCorrection>();
+
+	// Frames being corrected keep using the current one, so change a copy
+	if (bayer_corrections[index])
+		return std::shared_ptr<BayerCorrection>( new BayerCorrection(*bayer_corrections[index]) );
+	return std::shared_ptr<BayerCorrection>( new BayerCorrection((int)width, (int)height) );
+}
+
+void PS3EYECam::setBayerCorrection(std::shared_ptr<BayerCorrection> correction)
+{
+	int index = correction->GetWidth() == 640 ? 0 : 1;
+	if (correction->IsEmpty())
+		bayer_corrections[index].reset();
+	else
+		bayer_corrections[index] = correction;
+
+	if ((uint32_t)correction->GetWidth() == frame_width && (uint32_t)correction->GetHeight() == frame_height)
+		std::atomic_store(&urb->bayer_correction, bayer_corrections[index]);
+}
+
+bool PS3EYECam::setDefectivePixels(uint32_t width, uint32_t height, const uint32_t* pixels, uint32_t count)
+{
+	std::shared_ptr<BayerCorrection> correction = editBayerCorrection(width, height);
+	if (!correction)
+		return false;
+
+	correction->SetDefects(pixels, pixels ? count : 0);
+	setBayerCorrection(correction);
+	return true;
+}
+
+bool PS3EYECam::learnDefectivePixels(uint32_t width, uint32_t height, const uint8_t* dark_frame, uint8_t threshold)
+{
+	std::shared_ptr<BayerCorrection> correction = editBayerCorrection(width, height);
+	if (!correction || !dark_frame)
+		return false;
+
+	correction->LearnDefects(dark_frame, threshold);
+	setBayerCorrection(correction);
+	return true;
+}
+
+std::vector<uint32_t> PS3EYECam::getDefectivePixels(uint32_t width, uint32_t height) const
 {
-	urb->frame_queue->Dequeue(frame, frame_width, frame_height, frame_output_format);
+	int index = width == 640 && height == 480 ? 0 : (width == 320 && height == 240 ? 1 : -1);
+	if (index < 0 || !bayer_corrections[index])
+		return std::vector<uint32_t>();
+	return bayer_corrections[index]->GetDefects();
+}
+
+bool PS3EYECam::setFlatField(uint32_t width, uint32_t height, const float* gains)
+{
+	std::shared_ptr<BayerCorrection> correction = editBayerCorrection(width, height);
+	if (!correction)
+		return false;
+
+	correction->SetGains(gains);
+	setBayerCorrection(correction);
+	return true;
+}
+
+float PS3EYECam::getTemporalDenoiseStrength() const
+{
+	return urb->denoise_strength.load(std::memory_order_relaxed);
+}
+
+uint8_t PS3EYECam::getTemporalDenoiseThreshold() const
+{
+	return urb->denoise_motion_threshold.load(std::memory_order_relaxed);
+}
+
+void PS3EYECam::setTemporalDenoise(float strength, uint8_t motion_threshold)
+{
+	urb->denoise_motion_threshold.store(motion_threshold, std::memory_order_relaxed);
+	urb->denoise_strength.store(std::min(std::max(strength, 0.0f), TemporalDenoiser::MAX_STRENGTH), std::memory_order_relaxed);
+}
+
+void PS3EYECam::setColorMatrix(const float* matrix)
+{
+	std::shared_ptr<const ColorMatrix> fixed;
+	if (matrix)
+		fixed = std::shared_ptr<const ColorMatrix>( new ColorMatrix(matrix) );
+
+	// Frames being converted keep the matrix they started with
+	std::atomic_store(&color_matrix, fixed);
+}
+
+void PS3EYECam::setColorLUT(const uint8_t* red, const uint8_t* green, const uint8_t* blue)
+{
+	std::shared_ptr<ColorLUT> lut;
+	if (red && green && blue)
+	{
+		lut = std::shared_ptr<ColorLUT>( new ColorLUT() );
+		memcpy(lut->red, red, 256);
+		memcpy(lut->green, green, 256);
+		memcpy(lut->blue, blue, 256);
+	}
+
+	// Frames being converted keep the tables they started with
+	std::atomic_store(&color_lut, std::shared_ptr<const ColorLUT>(lut));
+}
+
+void PS3EYECam::setColorBalance(float red_gain, float green_gain, float blue_gain, float contrast, float gamma)
+{
+	std::atomic_store(&color_lut, std::shared_ptr<const ColorLUT>( new ColorLUT(red_gain, green_gain, blue_gain, contrast, gamma) ));
+}
+
+void PS3EYECam::decodeThreadFunc(std::shared_ptr<FrameQueue> raw_queue, std::shared_ptr<FrameQueue> converted_queue)
+{
+	// This thread is the raw queue's consumer and the converted queue's producer. Frames are converted straight into
+	// the converted queue's write slot, and the raw slot is handed back as soon as that is done.
+	uint8_t* dest = converted_queue->GetFrameBufferStart();
+	for (;;)
+	{
+		uint8_t* source = NULL;
+		FrameMetadata metadata;
+		EFrameStatus status = raw_queue->AcquireFrame(&source, &metadata, -1);
+		if (status != EFrameStatus::OK)
+		{
+			// Pass on why the stream ended, so that getFrame reports a device error as well
+			converted_queue->Close(status);
+			break;
+		}
+
+		frame_convert(source, frame_width, frame_height, debayer_pool.get(), getConvertOptions(), dest, (int)getRowBytes());
+		raw_queue->ReleaseFrame();
+
+		metadata.converted_us = monotonic_time_us();
+		dest = converted_queue->Publish(metadata);
+	}
+}
+
+// FrameLease
+
+FrameLease::FrameLease() :
+	frame		(NULL),
+	frame_size	(0),
+	metadata	()
+{
+}
+
+FrameLease::FrameLease(const std::shared_ptr<FrameQueue>& queue, const uint8_t* frame, uint32_t frame_size, const FrameMetadata& metadata) :
+	queue		(queue),
+	frame		(frame),
+	frame_size	(frame_size),
+	metadata	(metadata)
+{
+}
+
+FrameLease::FrameLease(FrameLease&& other) :
+	queue		(std::move(other.queue)),
+	frame		(other.frame),
+	frame_size	(other.frame_size),
+	metadata	(other.metadata)
+{
+	other.frame = NULL;
+	other.frame_size = 0;
+}
+
+FrameLease& FrameLease::operator=(FrameLease&& other)
+{
+	if (this != &other)
+	{
+		release();
+		queue = std::move(other.queue);
+		frame = other.frame;
+		frame_size = other.frame_size;
+		metadata = other.metadata;
+		other.frame = NULL;
+		other.frame_size = 0;
+	}
+	return *this;
+}
+
+FrameLease::~FrameLease()
+{
+	release();
+}
+
+void FrameLease::release()
+{
+	if (queue)
+	{
+		queue->ReleaseFrame();
+		queue.reset();
+	}
+	frame = NULL;
+	frame_size = 0;
+}
+
+bool PS3EYECam::setDebayerThreadCount(uint32_t count)
+{
+	if (is_streaming) return false;
+
+	debayer_thread_count = count < 1 ? 1 : count;
+
+	// A single thread converts directly on the calling thread, so it doesn't need a pool
+	debayer_pool.reset();
+	if (debayer_thread_count > 1)
+		debayer_pool = std::shared_ptr<DebayerThreadPool>( new DebayerThreadPool(debayer_thread_count) );
+
+	return true;
 }
 
 bool PS3EYECam::open_usb()
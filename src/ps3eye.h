@@ -8,6 +8,9 @@
 #include <vector>
 
 #include <memory>
+#include <functional>
+#include <thread>
+#include <atomic>
 
 // Get rid of annoying zero length structure warnings from libusb.h in MSVC
 
@@ -22,6 +25,8 @@
 #pragma warning(pop)
 #endif
 
+#include "ps3eye_blobs.h"
+
 #ifndef __STDC_CONSTANT_MACROS
 #  define __STDC_CONSTANT_MACROS
 #endif
@@ -37,6 +42,65 @@
 
 namespace ps3eye {
 
+// Information about a captured frame
+struct FrameMetadata
+{
+	FrameMetadata() : sequence(0), pts(0), first_packet_us(0), last_packet_us(0), converted_us(0), dropped_frames(0) {}
+
+	uint32_t sequence;			// Increases by one for every frame the camera completed since start(), including dropped ones
+	uint32_t pts;				// Presentation time stamp from the UVC payload header (camera clock)
+	uint64_t first_packet_us;	// Host time the first USB packet of the frame arrived, see monotonic_time_us()
+	uint64_t last_packet_us;	// Host time the last USB packet of the frame arrived, see monotonic_time_us()
+	uint64_t converted_us;		// Host time the frame was converted to the output format (0 for raw frames), see monotonic_time_us()
+	uint32_t dropped_frames;	// Number of frames dropped between the previously delivered frame and this one
+};
+
+// A rectangle of the output frame to convert with PS3EYECam::getFrameROIs
+struct FrameROI
+{
+	FrameROI() : x(0), y(0), width(0), height(0), data(NULL), stride(0) {}
+	FrameROI(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint8_t* data, uint32_t stride = 0) : x(x), y(y), width(width), height(height), data(data), stride(stride) {}
+
+	uint32_t x, y, width, height;	// In output pixels (see PS3EYECam::getWidth)
+	uint8_t* data;					// Destination, laid out like a frame of width * height in the output format
+	uint32_t stride;				// Distance between destination rows in bytes, as for PS3EYECam::getFrame. 0 means packed rows.
+};
+
+// Host monotonic clock used for frame timestamps, in microseconds (std::chrono::steady_clock)
+uint64_t monotonic_time_us();
+
+// Zero-copy access to a raw Bayer frame inside the driver's frame ring buffer.
+// While the lease is held, the producer will not overwrite the frame; newer frames are dropped instead
+// if the ring buffer fills up, so release it as soon as you're done with the data.
+class FrameLease
+{
+public:
+	FrameLease();
+	FrameLease(FrameLease&& other);
+	FrameLease& operator=(FrameLease&& other);
+	~FrameLease();
+
+	bool isValid() const { return frame != NULL; }
+	const uint8_t* getData() const { return frame; }
+	uint32_t getSize() const { return frame_size; }
+	const FrameMetadata& getMetadata() const { return metadata; }
+
+	// Hand the frame back to the driver. Called automatically on destruction.
+	void release();
+
+private:
+	friend class PS3EYECam;
+
+	FrameLease(const std::shared_ptr<class FrameQueue>& queue, const uint8_t* frame, uint32_t frame_size, const FrameMetadata& metadata);
+	FrameLease(const FrameLease&);
+	void operator=(const FrameLease&);
+
+	std::shared_ptr<class FrameQueue> queue;
+	const uint8_t* frame;
+	uint32_t frame_size;
+	FrameMetadata metadata;
+};
+
 class PS3EYECam
 {
 public:
@@ -45,9 +109,54 @@ public:
 		Bayer,					// Output in Bayer. Destination buffer must be width * height bytes
 		BGR,					// Output in BGR. Destination buffer must be width * height * 3 bytes
 		RGB	,					// Output in RGB. Destination buffer must be width * height * 3 bytes
-		Gray					// Output in Grayscale. Destination buffer must be width * height bytes
+		Gray,					// Output in Grayscale. Destination buffer must be width * height bytes
+		NV12,					// Output in YUV 4:2:0, Y plane followed by interleaved UV plane. Destination buffer must be width * height * 3 / 2 bytes
+		I420,					// Output in YUV 4:2:0, Y plane followed by U and V planes. Destination buffer must be width * height * 3 / 2 bytes
+		YUYV,					// Output in packed YUV 4:2:2 (Y0 U Y1 V). Destination buffer must be width * height * 2 bytes
+		HalfBGR,				// Output in BGR at half resolution, one pixel per 2x2 Bayer quad. Destination buffer must be width * height * 3 bytes (see getWidth)
+		HalfRGB,				// Output in RGB at half resolution. Destination buffer must be width * height * 3 bytes (see getWidth)
+		HalfGray,				// Output in Grayscale at half resolution. Destination buffer must be width * height bytes (see getWidth)
+		BGRA,					// Output in BGRA with opaque alpha, e.g. for GL_BGRA textures. Destination buffer must be width * height * 4 bytes
+		RGBA,					// Output in RGBA with opaque alpha. Destination buffer must be width * height * 4 bytes
+		Mask,					// Output 0xFF where the Gray output is at least the mask threshold, 0 elsewhere. Destination buffer must be width * height bytes
+		BitMask					// Like Mask, but one bit per pixel, pixel x of a row in bit x % 8 of byte x / 8. Destination buffer must be (width + 7) / 8 * height bytes
+	};
+
+	// How the BGR, RGB, BGRA and RGBA output formats interpolate the two colors every Bayer pixel lacks
+	enum class EDemosaicQuality
+	{
+		Bilinear,				// Average of the nearest samples of each color (default)
+		HighQuality				// Malvar-He-Cutler gradient-corrected 5x5 filters, without the color fringes along edges. See ps3eye::DebayerRGBHQ
+	};
+
+	// What to do when a frame completes while the frame queue is full
+	enum class EQueuePolicy
+	{
+		DropNewest,				// Drop the frame that just completed. The consumer sees the oldest queued frames first (default)
+		DropOldest,				// Drop the oldest queued frame to make room. The consumer sees the most recent frames in order
+		LatestOnly				// Like DropOldest, and getFrame skips to the newest queued frame, dropping the ones before it
 	};
 
+	// Result of getFrame/tryGetFrame
+	enum class EFrameStatus
+	{
+		OK,						// A frame was written to the output buffer
+		Timeout,				// No frame arrived within the timeout
+		Stopped,				// The camera is not streaming, or stop() was called while waiting
+		DeviceError,			// The USB transfers failed (e.g. the camera was unplugged). Call stop() before restarting
+		Busy					// A frame lease (see acquireFrame) is still held. Release it first
+	};
+
+	// Where frame callbacks are called from, see setFrameCallback
+	enum class ECallbackMode
+	{
+		Raw,					// Raw GRBG Bayer frame, called on the USB transfer thread as soon as the last packet arrived
+		Converted				// Frame in the output format, called on a per-camera conversion thread
+	};
+
+	// Called for every completed frame. The frame data is only valid during the call.
+	typedef std::function<void(const uint8_t* frame, const FrameMetadata& metadata)> FrameCallback;
+
 	typedef std::shared_ptr<PS3EYECam> PS3EYERef;
 
 	static const uint16_t VENDOR_ID;
@@ -56,7 +165,10 @@ public:
 	PS3EYECam(libusb_device *device);
 	~PS3EYECam();
 
-	bool init(uint32_t width = 0, uint32_t height = 0, uint16_t desiredFrameRate = 30, EOutputFormat outputFormat = EOutputFormat::BGR);
+	// queueDepth is the number of frame buffers in the frame queue (at least 2). One of them is always being filled
+	// by the camera, so up to queueDepth-1 complete frames can be waiting for getFrame.
+	bool init(uint32_t width = 0, uint32_t height = 0, uint16_t desiredFrameRate = 30, EOutputFormat outputFormat = EOutputFormat::BGR,
+			  uint32_t queueDepth = 2, EQueuePolicy queuePolicy = EQueuePolicy::DropNewest);
 	void start();
 	void stop();
 
@@ -168,29 +280,173 @@ public:
 	bool getUSBPortPath(char *out_identifier, size_t max_identifier_length) const;
 	
 	// Get a frame from the camera. Notes:
-	// - If there is no frame available, this function will block until one is
+	// - If there is no frame available, this function will block until one is, or until the camera stops
 	// - The output buffer must be sized correctly, depending out the output format. See EOutputFormat.
-	void getFrame(uint8_t* frame);
-
-	uint32_t getWidth() const { return frame_width; }
-	uint32_t getHeight() const { return frame_height; }
+	// - If metadata is not NULL, it receives the sequence number and timestamps of the frame
+	// - The output buffer and metadata are only written if EFrameStatus::OK is returned
+	EFrameStatus getFrame(uint8_t* frame, FrameMetadata* metadata = NULL);
+
+	// Like getFrame, but wait at most timeout_ms milliseconds for a frame. A negative timeout waits forever.
+	EFrameStatus getFrameTimeout(uint8_t* frame, int timeout_ms, FrameMetadata* metadata = NULL);
+
+	// Like getFrame, but write rows stride bytes apart, e.g. into a padded texture or a view into a larger image. Notes:
+	// - The bytes between the end of a row (getRowBytes()) and the start of the next one are left untouched
+	// - A stride smaller than getRowBytes(), e.g. 0, means packed rows
+	// - For NV12, the UV plane starts stride * getHeight() bytes in and has the same stride. For I420, the U and V planes
+	//   have half the stride, which is therefore rounded up to an even value.
+	EFrameStatus getFrame(uint8_t* frame, uint32_t stride, int timeout_ms, FrameMetadata* metadata);
+
+	// Like getFrame, but return EFrameStatus::Timeout immediately if no frame is available
+	EFrameStatus tryGetFrame(uint8_t* frame, FrameMetadata* metadata = NULL) { return getFrameTimeout(frame, 0, metadata); }
+
+	// Like getFrame, but only convert the given rectangles, each into its own buffer. Notes:
+	// - Rectangles are clipped to the frame. For YUYV, x and width are shrunk to even values, for NV12 and I420 y and height too.
+	//   For BitMask, x and width are shrunk to multiples of 8, except where the rectangle ends at the right frame border.
+	//   The rectangles are updated to what was converted, and the buffers must be large enough for the requested size.
+	// - Pixels are identical to those of a full frame conversion, including at the frame borders
+	EFrameStatus getFrameROIs(FrameROI* rois, uint32_t num_rois, int timeout_ms = -1, FrameMetadata* metadata = NULL);
+
+	// Like getFrame, but also find the blobs of the frame (see ps3eye::BlobDetector), largest first. Notes:
+	// - Blobs are found on the raw Bayer frame, so frame may be NULL to skip the conversion and only get the blobs
+	// - blobs is only written if EFrameStatus::OK is returned
+	EFrameStatus getFrameBlobs(const BlobParams& params, std::vector<Blob>& blobs, uint8_t* frame = NULL, uint32_t stride = 0, int timeout_ms = -1, FrameMetadata* metadata = NULL);
+
+	// Like getFrame, but build an image pyramid of the frame instead (see ps3eye::FramePyramid in ps3eye_debayer.h). Notes:
+	// - The pyramid is demosaiced and downsampled in one pass over the raw frame, regardless of the output format
+	// - Its storage is allocated for the sensor resolution on first use and reused for every later frame, so keep it around
+	// - The pyramid is only written if EFrameStatus::OK is returned
+	EFrameStatus getFramePyramid(class FramePyramid& pyramid, int timeout_ms = -1, FrameMetadata* metadata = NULL);
+
+	// Get the next frame without copying it. Notes:
+	// - The data is the raw GRBG Bayer frame (getSensorWidth() * getSensorHeight() bytes), regardless of the output format
+	// - If there is no frame available, this function will block until one is
+	// - Returns an invalid lease if the camera isn't streaming, is stopped while waiting, or failed
+	// - Only one lease can be held at a time: while it is, acquireFrame() returns an invalid lease and getFrame() returns
+	//   EFrameStatus::Busy, without waiting
+	FrameLease acquireFrame();
+
+	// Have frames pushed to a callback instead of (or in addition to) polling. Notes:
+	// - Can only be changed while not streaming. Pass an empty callback to remove it.
+	// - In Raw mode, the callback blocks USB processing for all cameras, so keep it short. getFrame() keeps working.
+	// - In Converted mode, the conversion thread is the frame queue's consumer: don't call getFrame() or acquireFrame() as well.
+	//   Frames that arrive while the callback is still busy are handled according to the queue policy.
+	// - Don't call stop() from within the callback.
+	bool setFrameCallback(const FrameCallback& callback, ECallbackMode mode = ECallbackMode::Converted);
+
+	// Size of the frames returned by getFrame. This is half the sensor resolution for the Half* output formats.
+	uint32_t getWidth() const { return isHalfResolutionFormat() ? frame_width / 2 : frame_width; }
+	uint32_t getHeight() const { return isHalfResolutionFormat() ? frame_height / 2 : frame_height; }
+	// Resolution the sensor runs at, which is also the size of the raw Bayer frames
+	uint32_t getSensorWidth() const { return frame_width; }
+	uint32_t getSensorHeight() const { return frame_height; }
 	uint16_t getFrameRate() const { return frame_rate; }
 	bool setFrameRate(uint8_t val) {
 		if (is_streaming) return false;
 		frame_rate = ov534_set_frame_rate(val, true);
 		return true;
 	}
-	uint32_t getRowBytes() const { return frame_width * getOutputBytesPerPixel(); }
+	// Number of threads used to convert a frame in getFrame(), including the calling thread.
+	// The frame is split into horizontal bands, one per thread. Can only be changed while not streaming.
+	uint32_t getDebayerThreadCount() const { return debayer_thread_count; }
+	bool setDebayerThreadCount(uint32_t count);
+	// Convert frames on a per-camera worker thread as soon as they arrive, instead of in getFrame(). Notes:
+	// - Converted frames go into a queue of their own with the queue depth and policy given to init(), and getFrame()
+	//   only copies a finished frame out of it. Compare FrameMetadata::converted_us to last_packet_us to see the latency.
+	// - acquireFrame(), getFrameROIs(), getFrameBlobs() and getFramePyramid() need the raw frames, which the worker consumes,
+	//   so they fail in this mode
+	// - Can only be changed while not streaming
+	bool getDecodeAhead() const { return decode_ahead; }
+	bool setDecodeAhead(bool enable);
+	// Threshold of the Mask and BitMask output formats, see ps3eye::DebayerMask. Can be changed while streaming.
+	uint8_t getMaskThreshold() const { return mask_threshold.load(std::memory_order_relaxed); }
+	void setMaskThreshold(uint8_t val) { mask_threshold.store(val, std::memory_order_relaxed); }
+	// Demosaic of the BGR, RGB, BGRA and RGBA output formats, in getFrame() and getFrameROIs(). Remapped frames (see
+	// setRemapTable) and the other formats always use the bilinear one. Can be changed while streaming.
+	EDemosaicQuality getDemosaicQuality() const { return demosaic_quality.load(std::memory_order_relaxed); }
+	void setDemosaicQuality(EDemosaicQuality val) { demosaic_quality.store(val, std::memory_order_relaxed); }
+	// Remap the frames of one sensor resolution (640x480 or 320x240), e.g. to undo lens distortion: map_x and map_y hold
+	// the source position of every output pixel, see ps3eye::RemapTable. Pass NULL maps to stop remapping. Notes:
+	// - The maps are converted to a fixed point table once and kept per resolution, so init() picks the table up again
+	// - Only the Gray, BGR, RGB, BGRA and RGBA output formats are remapped, in getFrame() as well as in getFrameROIs()
+	// - Can be changed while streaming; the table is swapped atomically and a frame is converted with one table
+	bool setRemapTable(uint32_t width, uint32_t height, const float* map_x, const float* map_y);
+	// Correct the raw frames of one sensor resolution (640x480 or 320x240) as they arrive, so that every output format,
+	// getFrameROIs(), getFrameBlobs() and raw frame callbacks get the corrected frame; see ps3eye::BayerCorrection. Notes:
+	// - Defective pixels are given as y * width + x, and a count of 0 removes them. learnDefectivePixels adds the pixels
+	//   of a dark frame (lens covered, in the Bayer output format) that are at least threshold, so learn them before
+	//   setting a flat field, which would scale the dark frame too. getDefectivePixels returns them, e.g. to save them.
+	// - The flat-field gains are per pixel, width * height of them; NULL gains remove them
+	// - The corrections are kept per resolution, so init() picks them up again
+	// - Can be changed while streaming; the corrections are swapped atomically between frames
+	bool setDefectivePixels(uint32_t width, uint32_t height, const uint32_t* pixels, uint32_t count);
+	bool learnDefectivePixels(uint32_t width, uint32_t height, const uint8_t* dark_frame, uint8_t threshold);
+	std::vector<uint32_t> getDefectivePixels(uint32_t width, uint32_t height) const;
+	bool setFlatField(uint32_t width, uint32_t height, const float* gains);
+	// Temporal denoise of the raw frames as they arrive, after the corrections above, for low light and high gain; see
+	// ps3eye::TemporalDenoiser. strength is the weight of the past frames on still pixels, from 0 (off, the default) to
+	// 0.9375, and pixels that change by motion_threshold or more are taken as they are. Every output format,
+	// getFrameROIs(), getFrameBlobs() and raw frame callbacks get the denoised frame. Can be changed while streaming.
+	float getTemporalDenoiseStrength() const;
+	uint8_t getTemporalDenoiseThreshold() const;
+	void setTemporalDenoise(float strength, uint8_t motion_threshold = 16);
+	// 3x3 color correction matrix applied to the BGR, RGB, BGRA, RGBA, HalfBGR and HalfRGB output formats as they are
+	// demosaiced, remapped frames included, before the lookup tables of setColorLUT. matrix is row-major, output R, G, B
+	// rows of input R, G, B columns; it is kept in fixed point, see ps3eye::ColorMatrix. Pass NULL to stop.
+	// Can be changed while streaming; the matrix is swapped atomically between frames.
+	void setColorMatrix(const float* matrix);
+	// Per-channel lookup tables of 256 entries applied to the BGR, RGB, BGRA, RGBA, HalfBGR and HalfRGB output formats as
+	// they are demosaiced, remapped frames included, e.g. for gamma, software white balance and contrast; see ps3eye::ColorLUT.
+	// Pass NULL tables to stop. Can be changed while streaming; the tables are swapped atomically between frames.
+	void setColorLUT(const uint8_t* red, const uint8_t* green, const uint8_t* blue);
+	// setColorLUT with the tables built from per-channel gains, a contrast around mid gray and a gamma, see ps3eye::ColorLUT
+	void setColorBalance(float red_gain, float green_gain, float blue_gain, float contrast = 1.0f, float gamma = 1.0f);
+	// For NV12 and I420, the row bytes and bytes per pixel are those of the Y plane. BitMask has 0 bytes per pixel.
+	uint32_t getRowBytes() const { return getOutputRowBytes(frame_output_format, getWidth()); }
+	static uint32_t getOutputRowBytes(EOutputFormat format, uint32_t width);
+	// Size of the destination buffer for getFrame
+	uint32_t getOutputFrameSize() const;
+	uint32_t getQueueDepth() const { return frame_queue_depth; }
+	EQueuePolicy getQueuePolicy() const { return frame_queue_policy; }
+	// Number of complete frames dropped by the frame queue since start()
+	uint32_t getDroppedFrameCount() const;
 	uint32_t getOutputBytesPerPixel() const;
+	static uint32_t getOutputBytesPerPixel(EOutputFormat format);
 
 	//
 	static const std::vector<PS3EYERef>& getDevices( bool forceRefresh = false );
 
 private:
+	friend class FrameQueue;
+
+	// Settings that are read while converting a frame, taken once per frame since they can change while streaming
+	struct FrameConvertOptions
+	{
+		FrameConvertOptions() : mask_threshold(128), demosaic_quality(EDemosaicQuality::Bilinear) {}
+
+		uint8_t mask_threshold;
+		EDemosaicQuality demosaic_quality;
+		std::shared_ptr<const class RemapTable> remap;		// Null if frames aren't remapped
+		std::shared_ptr<const struct ColorMatrix> color_matrix;	// Null if the colors aren't corrected
+		std::shared_ptr<const struct ColorLUT> color_lut;	// Null if the colors aren't looked up
+	};
+
+	// Converts a raw frame to one output format; see FrameQueue::GetConvertFunc
+	typedef void (*FrameConvertFunc)(const uint8_t* source, int frame_width, int frame_height, class DebayerThreadPool* debayer_pool, const FrameConvertOptions& options, uint8_t* dest, int dest_stride);
+	FrameConvertOptions getConvertOptions() const;
+
+	// A copy of the raw frame corrections of a resolution to change, NULL if it isn't a sensor resolution
+	std::shared_ptr<class BayerCorrection> editBayerCorrection(uint32_t width, uint32_t height) const;
+	void setBayerCorrection(std::shared_ptr<class BayerCorrection> correction);
+
 	PS3EYECam(const PS3EYECam&);
     void operator=(const PS3EYECam&);
 
 	void release();
+	void callbackThreadFunc();
+	void decodeThreadFunc(std::shared_ptr<class FrameQueue> raw_queue, std::shared_ptr<class FrameQueue> converted_queue);
+	bool isHalfResolutionFormat() const {
+		return frame_output_format == EOutputFormat::HalfBGR || frame_output_format == EOutputFormat::HalfRGB || frame_output_format == EOutputFormat::HalfGray;
+	}
 
 	// usb ops
 	uint16_t ov534_set_frame_rate(uint16_t frame_rate, bool dry_run = false);
@@ -229,6 +485,24 @@ private:
 	uint32_t frame_height;
 	uint16_t frame_rate;
 	EOutputFormat frame_output_format;
+	uint32_t frame_queue_depth;
+	EQueuePolicy frame_queue_policy;
+	uint32_t debayer_thread_count;
+	std::shared_ptr<class DebayerThreadPool> debayer_pool;
+	FrameConvertFunc frame_convert;		// Converts a raw frame to frame_output_format, looked up once in init()
+	std::atomic<uint8_t> mask_threshold;
+	std::atomic<EDemosaicQuality> demosaic_quality;
+	std::shared_ptr<const class RemapTable> remap_tables[2];	// Set with setRemapTable, for 640x480 and 320x240
+	std::shared_ptr<const class RemapTable> remap_table;		// That of the current resolution, read and swapped atomically
+	std::shared_ptr<const class BayerCorrection> bayer_corrections[2];	// For 640x480 and 320x240, null if there are none
+	std::shared_ptr<const struct ColorMatrix> color_matrix;	// Set with setColorMatrix, read and swapped atomically
+	std::shared_ptr<const struct ColorLUT> color_lut;			// Set with setColorLUT, read and swapped atomically
+	FrameCallback frame_callback;
+	ECallbackMode frame_callback_mode;
+	std::thread callback_thread;
+	bool decode_ahead;
+	std::thread decode_thread;
+	std::shared_ptr<class FrameQueue> decoded_queue;	// Converted frames in decode ahead mode, null otherwise
 
 	//usb stuff
 	libusb_device *device_;
@@ -0,0 +1,203 @@
+// source code from https://github.com/inspirit/PS3EYEDriver
+#include "ps3eye_blobs.h"
+
+#include <algorithm>
+
+namespace ps3eye {
+
+// Every 2x2 GRBG quad of a GR row and the BG row below it is one pixel, with the same colors as DebayerHalfRGB:
+//
+// G R
+// B G
+
+// Weight every quad of a row by how far its gray value is above min_luma, or 0 if it isn't
+static void classify_luminance_row(int quads_x, const uint8_t* gr_row, const uint8_t* bg_row, const BlobParams& params, uint16_t* weights)
+{
+	for (int x = 0; x < quads_x; ++x)
+	{
+		uint32_t R = gr_row[2 * x + 1];
+		uint32_t G = (gr_row[2 * x] + bg_row[2 * x + 1] + 1) >> 1;
+		uint32_t B = bg_row[2 * x];
+		uint32_t luma = (R*77 + G*151 + B*28)>>8;
+		weights[x] = luma >= params.min_luma ? (uint16_t)(luma - params.min_luma + 1) : 0;
+	}
+}
+
+// Weight every quad of a row whose HSV color is in range by how far its value is above min_value, or 0 if it isn't
+static void classify_color_row(int quads_x, const uint8_t* gr_row, const uint8_t* bg_row, const BlobParams& params, uint16_t* weights)
+{
+	// Value and saturation (delta * 255 / max) first. They don't need a division, so this loop has no branches and
+	// vectorizes; the hue is then only computed for the few quads that passed.
+	int min_value		= params.min_value;
+	int min_saturation	= params.min_saturation;
+	for (int x = 0; x < quads_x; ++x)
+	{
+		int R = gr_row[2 * x + 1];
+		int G = (gr_row[2 * x] + bg_row[2 * x + 1] + 1) >> 1;
+		int B = bg_row[2 * x];
+		int max = std::max(R, std::max(G, B));
+		int delta = max - std::min(R, std::min(G, B));
+		weights[x] = (max >= min_value && delta * 255 >= min_saturation * max) ? (uint16_t)(max - min_value + 1) : 0;
+	}
+
+	for (int x = 0; x < quads_x; ++x)
+	{
+		if (weights[x] == 0)
+			continue;
+
+		int R = gr_row[2 * x + 1];
+		int G = (gr_row[2 * x] + bg_row[2 * x + 1] + 1) >> 1;
+		int B = bg_row[2 * x];
+		int max = std::max(R, std::max(G, B));
+		int delta = max - std::min(R, std::min(G, B));
+
+		int hue = 0;
+		if (delta == 0)
+			hue = 0;
+		else if (max == R)
+			hue = (60 * (G - B) / delta + 360) % 360;
+		else if (max == G)
+			hue = 120 + 60 * (B - R) / delta;
+		else
+			hue = 240 + 60 * (R - G) / delta;
+
+		bool in_range = params.hue_min <= params.hue_max ? (hue >= params.hue_min && hue <= params.hue_max)
+														 : (hue >= params.hue_min || hue <= params.hue_max);
+		if (!in_range)
+			weights[x] = 0;
+	}
+}
+
+uint32_t BlobDetector::findRoot(uint32_t label)
+{
+	// Path halving keeps the trees flat without a second pass
+	while (parents[label] != label)
+	{
+		parents[label] = parents[parents[label]];
+		label = parents[label];
+	}
+	return label;
+}
+
+void BlobDetector::mergeLabels(uint32_t a, uint32_t b)
+{
+	uint32_t root_a = findRoot(a);
+	uint32_t root_b = findRoot(b);
+	if (root_a == root_b)
+		return;
+
+	// The older label stays the root, so blobs keep the order in which they were first seen
+	if (root_b < root_a)
+		std::swap(root_a, root_b);
+	parents[root_b] = root_a;
+
+	Accum& into			= accums[root_a];
+	const Accum& from	= accums[root_b];
+	into.count			+= from.count;
+	into.sum_weight		+= from.sum_weight;
+	into.sum_weight_x	+= from.sum_weight_x;
+	into.sum_weight_y	+= from.sum_weight_y;
+	into.x_min			= std::min(into.x_min, from.x_min);
+	into.x_max			= std::max(into.x_max, from.x_max);
+	into.y_min			= std::min(into.y_min, from.y_min);
+	into.y_max			= std::max(into.y_max, from.y_max);
+}
+
+void BlobDetector::Detect(int frame_width, int frame_height, const uint8_t* inBayer, const BlobParams& params, std::vector<Blob>& blobs)
+{
+	int quads_x = frame_width / 2;
+	int quads_y = frame_height / 2;
+
+	weights.resize(quads_x);
+	prev_runs.clear();
+	parents.clear();
+	accums.clear();
+	blobs.clear();
+
+	for (int y = 0; y < quads_y; ++y)
+	{
+		const uint8_t* gr_row = inBayer + 2 * y * frame_width;
+		const uint8_t* bg_row = gr_row + frame_width;
+		if (params.mode == BlobParams::EMode::Luminance)
+			classify_luminance_row(quads_x, gr_row, bg_row, params, weights.data());
+		else
+			classify_color_row(quads_x, gr_row, bg_row, params, weights.data());
+
+		// Collect the runs of the row. Each one starts out as a label of its own with the run's statistics.
+		cur_runs.clear();
+		for (int x = 0; x < quads_x; )
+		{
+			if (weights[x] == 0)
+			{
+				++x;
+				continue;
+			}
+
+			Run run;
+			run.x_begin	= x;
+			run.label	= (uint32_t)parents.size();
+
+			Accum accum;
+			accum.count			= 0;
+			accum.sum_weight	= 0;
+			accum.sum_weight_x	= 0;
+			for (; x < quads_x && weights[x] != 0; ++x)
+			{
+				accum.count++;
+				accum.sum_weight	+= weights[x];
+				accum.sum_weight_x	+= (uint64_t)weights[x] * x;
+			}
+			accum.sum_weight_y	= accum.sum_weight * y;
+			accum.x_min			= run.x_begin;
+			accum.x_max			= x - 1;
+			accum.y_min			= y;
+			accum.y_max			= y;
+			run.x_end			= x - 1;
+
+			parents.push_back(run.label);
+			accums.push_back(accum);
+			cur_runs.push_back(run);
+		}
+
+		// Merge every run with the runs of the row above that touch it, diagonally included. Both lists are sorted,
+		// so the row above is only scanned once; a run that reaches past the current one may touch the next one too.
+		size_t prev_index = 0;
+		for (size_t index = 0; index < cur_runs.size(); ++index)
+		{
+			const Run& run = cur_runs[index];
+			while (prev_index < prev_runs.size() && prev_runs[prev_index].x_end < run.x_begin - 1)
+				++prev_index;
+			for (size_t touching = prev_index; touching < prev_runs.size() && prev_runs[touching].x_begin <= run.x_end + 1; ++touching)
+				mergeLabels(prev_runs[touching].label, run.label);
+		}
+
+		prev_runs.swap(cur_runs);
+	}
+
+	// Every root label is a blob. Quad coordinates are turned into sensor pixels: quad x covers pixels 2x and 2x + 1.
+	for (uint32_t label = 0; label < parents.size(); ++label)
+	{
+		if (parents[label] != label)
+			continue;
+
+		const Accum& accum = accums[label];
+		Blob blob;
+		blob.area = accum.count * 4;
+		if (blob.area < params.min_area)
+			continue;
+
+		blob.x		= (float)(2.0 * (double)accum.sum_weight_x / (double)accum.sum_weight + 0.5);
+		blob.y		= (float)(2.0 * (double)accum.sum_weight_y / (double)accum.sum_weight + 0.5);
+		blob.left	= 2 * accum.x_min;
+		blob.top	= 2 * accum.y_min;
+		blob.width	= 2 * (accum.x_max - accum.x_min + 1);
+		blob.height	= 2 * (accum.y_max - accum.y_min + 1);
+		blobs.push_back(blob);
+	}
+
+	std::stable_sort(blobs.begin(), blobs.end(), [](const Blob& a, const Blob& b) { return a.area > b.area; });
+	if (params.max_blobs > 0 && blobs.size() > params.max_blobs)
+		blobs.resize(params.max_blobs);
+}
+
+} // namespace
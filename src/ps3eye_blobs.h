@@ -0,0 +1,80 @@
+// source code from https://github.com/inspirit/PS3EYEDriver
+#ifndef PS3EYE_BLOBS_H
+#define PS3EYE_BLOBS_H
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace ps3eye {
+
+// Which pixels belong to blobs. Pixels are classified per 2x2 GRBG quad, so blobs are found at half resolution.
+struct BlobParams
+{
+	enum class EMode
+	{
+		Luminance,				// Quads whose gray value (as DebayerHalfGray) is at least min_luma, e.g. IR markers
+		Color					// Quads whose HSV color is in range, e.g. a PSMove sphere
+	};
+
+	BlobParams() : mode(EMode::Luminance), min_luma(128), hue_min(0), hue_max(359), min_saturation(0), min_value(0), min_area(0), max_blobs(0) {}
+
+	EMode mode;
+	uint8_t min_luma;
+	uint16_t hue_min, hue_max;	// In degrees [0, 360). The range wraps around red if hue_min > hue_max.
+	uint8_t min_saturation;		// [0, 255]
+	uint8_t min_value;			// [0, 255]
+	uint32_t min_area;			// Smaller blobs are dropped, in sensor pixels
+	uint32_t max_blobs;			// Only keep the largest ones, 0 keeps all of them
+};
+
+// A connected (8-neighbourhood) group of classified quads. All coordinates are in sensor pixels.
+struct Blob
+{
+	Blob() : x(0.0f), y(0.0f), area(0), left(0), top(0), width(0), height(0) {}
+
+	// Centroid weighted by how far each quad is above the threshold (gray or value), with pixel centers on whole coordinates
+	float x, y;
+	uint32_t area;
+	uint32_t left, top, width, height;	// Bounding box
+};
+
+// Finds blobs in a GRBG Bayer frame in a single pass: quads are classified row by row, runs of classified quads
+// are labelled with union-find against the runs of the row above, and the blob statistics are merged along with
+// the labels. The scratch buffers are kept between frames, so reuse one detector per camera.
+class BlobDetector
+{
+public:
+	// Replace blobs with the blobs of the frame, largest first
+	void Detect(int frame_width, int frame_height, const uint8_t* inBayer, const BlobParams& params, std::vector<Blob>& blobs);
+
+private:
+	// A horizontal run of classified quads [x_begin, x_end] of the current or previous row
+	struct Run
+	{
+		int x_begin, x_end;
+		uint32_t label;
+	};
+
+	// Statistics of a label, in quads. Only those of root labels are up to date.
+	struct Accum
+	{
+		uint32_t count;
+		uint64_t sum_weight, sum_weight_x, sum_weight_y;
+		int x_min, x_max, y_min, y_max;
+	};
+
+	uint32_t findRoot(uint32_t label);
+	void mergeLabels(uint32_t a, uint32_t b);
+
+	std::vector<uint16_t>	weights;		// Weight of every quad of the current row, 0 if not classified
+	std::vector<Run>		prev_runs;
+	std::vector<Run>		cur_runs;
+	std::vector<uint32_t>	parents;
+	std::vector<Accum>		accums;
+};
+
+} // namespace
+
+
+#endif
@@ -154,6 +154,72 @@ ps3eye_grab_frame(ps3eye_t *eye, unsigned char* frame)
 	eye->eye->getFrame(frame);
 }
 
+ps3eye_frame_status
+ps3eye_grab_frame_timeout(ps3eye_t *eye, unsigned char* frame, int timeout_ms)
+{
+    return ps3eye_grab_frame_stride(eye, frame, 0, timeout_ms);
+}
+
+ps3eye_frame_status
+ps3eye_grab_frame_stride(ps3eye_t *eye, unsigned char* frame, int stride, int timeout_ms)
+{
+    if (!ps3eye_context) {
+        // No context available
+        return PS3EYE_FRAME_STOPPED;
+    }
+
+    if (!eye) {
+        // Eye is not a valid handle
+        return PS3EYE_FRAME_STOPPED;
+    }
+
+    switch (eye->eye->getFrame(frame, stride > 0 ? (uint32_t)stride : 0, timeout_ms, NULL)) {
+    case ps3eye::PS3EYECam::EFrameStatus::OK:
+        return PS3EYE_FRAME_OK;
+    case ps3eye::PS3EYECam::EFrameStatus::Timeout:
+        return PS3EYE_FRAME_TIMEOUT;
+    case ps3eye::PS3EYECam::EFrameStatus::DeviceError:
+        return PS3EYE_FRAME_DEVICE_ERROR;
+    default:
+        return PS3EYE_FRAME_STOPPED;
+    }
+}
+
+ps3eye_frame_status
+ps3eye_try_grab_frame(ps3eye_t *eye, unsigned char* frame)
+{
+    return ps3eye_grab_frame_timeout(eye, frame, 0);
+}
+
+int
+ps3eye_set_frame_callback(ps3eye_t *eye, ps3eye_frame_callback callback, void *user_data, ps3eye_callback_mode mode)
+{
+    if (!ps3eye_context) {
+        // No context available
+        return -1;
+    }
+
+    if (!eye) {
+        // Eye is not a valid handle
+        return -1;
+    }
+
+    ps3eye::PS3EYECam::FrameCallback frame_callback;
+    if (callback) {
+        frame_callback = [eye, callback, user_data](const uint8_t* frame, const ps3eye::FrameMetadata&) {
+            callback(eye, frame, user_data);
+        };
+    }
+
+    // The callback can only be changed while the camera isn't streaming
+    eye->eye->stop();
+    bool success = eye->eye->setFrameCallback(frame_callback,
+            mode == PS3EYE_CALLBACK_RAW ? ps3eye::PS3EYECam::ECallbackMode::Raw : ps3eye::PS3EYECam::ECallbackMode::Converted);
+    eye->eye->start();
+
+    return success ? 0 : -1;
+}
+
 void
 ps3eye_close(ps3eye_t *eye)
 {
@@ -193,6 +259,8 @@ ps3eye_get_parameter(ps3eye_t *eye, ps3eye_parameter param)
         return eye->eye->getFlipH();
     case PS3EYE_VFLIP:
         return eye->eye->getFlipV();
+    case PS3EYE_MASK_THRESHOLD:
+        return eye->eye->getMaskThreshold();
     default:
         return -1;
     }
@@ -245,6 +313,9 @@ ps3eye_set_parameter(ps3eye_t *eye, ps3eye_parameter param, int value)
         case PS3EYE_VFLIP:
             eye->eye->setFlip(eye->eye->getFlipH(), value > 0);
             break;
+        case PS3EYE_MASK_THRESHOLD:
+            eye->eye->setMaskThreshold((uint8_t)value);
+            break;
         default:
             break;
     }
@@ -48,15 +48,45 @@ typedef enum{
     PS3EYE_BLUEBALANCE,         // [0, 255]
     PS3EYE_GREENBALANCE,        // [0, 255]
     PS3EYE_HFLIP,               // [false, true]
-    PS3EYE_VFLIP                // [false, true]
+    PS3EYE_VFLIP,               // [false, true]
+    PS3EYE_MASK_THRESHOLD       // [0, 255]
 } ps3eye_parameter;
 
 typedef enum{
 	PS3EYE_FORMAT_BAYER,        // Output in Bayer. Destination buffer must be width * height bytes
 	PS3EYE_FORMAT_BGR,          // Output in BGR. Destination buffer must be width * height * 3 bytes
 	PS3EYE_FORMAT_RGB,          // Output in RGB. Destination buffer must be width * height * 3 bytes
+	PS3EYE_FORMAT_GRAY,         // Output in Grayscale. Destination buffer must be width * height bytes
+	PS3EYE_FORMAT_NV12,         // Output in YUV 4:2:0, Y plane then interleaved UV plane. Destination buffer must be width * height * 3 / 2 bytes
+	PS3EYE_FORMAT_I420,         // Output in YUV 4:2:0, Y plane then U and V planes. Destination buffer must be width * height * 3 / 2 bytes
+	PS3EYE_FORMAT_YUYV,         // Output in packed YUV 4:2:2. Destination buffer must be width * height * 2 bytes
+	PS3EYE_FORMAT_HALF_BGR,     // Output in BGR at half resolution. Destination buffer must be (width / 2) * (height / 2) * 3 bytes
+	PS3EYE_FORMAT_HALF_RGB,     // Output in RGB at half resolution. Destination buffer must be (width / 2) * (height / 2) * 3 bytes
+	PS3EYE_FORMAT_HALF_GRAY,    // Output in Grayscale at half resolution. Destination buffer must be (width / 2) * (height / 2) bytes
+	PS3EYE_FORMAT_BGRA,         // Output in BGRA with opaque alpha. Destination buffer must be width * height * 4 bytes
+	PS3EYE_FORMAT_RGBA,         // Output in RGBA with opaque alpha. Destination buffer must be width * height * 4 bytes
+	PS3EYE_FORMAT_MASK,         // Output 0xFF where the gray value is at least PS3EYE_MASK_THRESHOLD, 0 elsewhere. Destination buffer must be width * height bytes
+	PS3EYE_FORMAT_BIT_MASK,     // Like PS3EYE_FORMAT_MASK with one bit per pixel, pixel x of a row in bit x % 8 of byte x / 8. Destination buffer must be (width + 7) / 8 * height bytes
 } ps3eye_format;
 
+typedef enum{
+    PS3EYE_FRAME_OK,            // A frame was written to the destination buffer
+    PS3EYE_FRAME_TIMEOUT,       // No frame arrived in time
+    PS3EYE_FRAME_STOPPED,       // The camera is not streaming
+    PS3EYE_FRAME_DEVICE_ERROR,  // The USB transfers failed, e.g. because the camera was unplugged
+} ps3eye_frame_status;
+
+typedef enum{
+    PS3EYE_CALLBACK_RAW,        // Raw Bayer frame (width * height bytes), called on the USB transfer thread
+    PS3EYE_CALLBACK_CONVERTED,  // Frame in the output format, called on a per-camera conversion thread
+} ps3eye_callback_mode;
+
+/**
+ * Called for every completed frame. The frame data is only
+ * valid until the callback returns.
+ **/
+typedef void (*ps3eye_frame_callback)(ps3eye_t *eye, const unsigned char* frame, void *user_data);
+
 
 /**
  * Initialize and enumerate connected cameras.
@@ -95,16 +125,51 @@ int
 ps3eye_get_unique_identifier(ps3eye_t * eye, char *out_identifier, int max_identifier_length);
 
 /**
- * Grab the next frame as YUV422 blob.
- * A pointer to the buffer will be passed back. The buffer
- * will only be valid until the next call, or until the eye
- * is closed again with ps3eye_close(). If stride is not NULL,
- * the byte offset between two consecutive lines in the frame
- * will be written to *stride.
+ * Grab the next frame in the format passed to ps3eye_open() and
+ * write it to frame, which must be large enough for a whole frame
+ * with packed rows. Blocks until a frame is available.
  **/
 void
 ps3eye_grab_frame(ps3eye_t *eye, unsigned char* frame);
 
+/**
+ * Like ps3eye_grab_frame(), but wait at most timeout_ms milliseconds
+ * for a frame. A negative timeout waits forever.
+ * The frame buffer is only written if PS3EYE_FRAME_OK is returned.
+ **/
+ps3eye_frame_status
+ps3eye_grab_frame_timeout(ps3eye_t *eye, unsigned char* frame, int timeout_ms);
+
+/**
+ * Like ps3eye_grab_frame_timeout(), but write the frame rows stride
+ * bytes apart, e.g. into a locked texture or a padded image. The bytes
+ * past the end of each row are left untouched, and a stride smaller
+ * than a packed row (e.g. 0) means packed rows. For NV12 the UV plane
+ * starts stride * height bytes in and has the same stride; for I420
+ * the U and V planes have half of the stride, rounded up to be even.
+ **/
+ps3eye_frame_status
+ps3eye_grab_frame_stride(ps3eye_t *eye, unsigned char* frame, int stride, int timeout_ms);
+
+/**
+ * Like ps3eye_grab_frame(), but return PS3EYE_FRAME_TIMEOUT immediately
+ * if no frame is available.
+ **/
+ps3eye_frame_status
+ps3eye_try_grab_frame(ps3eye_t *eye, unsigned char* frame);
+
+/**
+ * Register a callback that is called for every completed frame,
+ * instead of polling with ps3eye_grab_frame(). The camera is
+ * briefly restarted to apply the change. Pass NULL to remove it.
+ * In PS3EYE_CALLBACK_CONVERTED mode, don't call ps3eye_grab_frame()
+ * as well, and in PS3EYE_CALLBACK_RAW mode keep the callback short.
+ * Don't call ps3eye_close() from within the callback.
+ * Returns -1 if there is an error, otherwise 0.
+ **/
+int
+ps3eye_set_frame_callback(ps3eye_t *eye, ps3eye_frame_callback callback, void *user_data, ps3eye_callback_mode mode);
+
 /**
  * Close a PSEye camera device and free allocated resources.
  * To really close the library, you should also call ps3eye_uninit().
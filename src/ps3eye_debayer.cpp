@@ -0,0 +1,3343 @@
+// source code from https://github.com/inspirit/PS3EYEDriver
+#include "ps3eye_debayer.h"
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define PS3EYE_HAVE_X86_SIMD 1
+
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+	#endif
+	#include <emmintrin.h>
+	#include <tmmintrin.h>
+	#include <immintrin.h>
+
+	// MSVC allows any intrinsic in any function; GCC and Clang need the target enabled per function
+	#if defined(_MSC_VER) && !defined(__clang__)
+		#define PS3EYE_TARGET_SSE2
+		#define PS3EYE_TARGET_SSSE3
+		#define PS3EYE_TARGET_AVX2
+	#else
+		#define PS3EYE_TARGET_SSE2	__attribute__((target("sse2")))
+		#define PS3EYE_TARGET_SSSE3	__attribute__((target("ssse3")))
+		#define PS3EYE_TARGET_AVX2	__attribute__((target("avx2")))
+	#endif
+#endif
+
+namespace ps3eye {
+
+// PSMove output is in the following Bayer format (GRBG):
+//
+// G R G R G R
+// B G B G B G
+// G R G R G R
+// B G B G B G
+//
+// This is the normal Bayer pattern shifted left one place.
+
+void DebayerGrayScalar(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	int				source_stride	= frame_width;
+	const uint8_t*	source_row		= inBayer;						// Start at first bayer pixel
+	int				dest_stride		= frame_width;
+	uint8_t*		dest_row		= outBuffer + dest_stride + 1; 	// We start outputting at the second pixel of the second row's G component
+	uint32_t R,G,B;
+
+	// Fill rows 1 to height-2 of the destination buffer. First and last row are filled separately (they are copied from the second row and second-to-last rows respectively)
+	for (int y = 0; y < frame_height-2; source_row += source_stride, dest_row += dest_stride, ++y)
+	{
+		const uint8_t* source		= source_row;
+		const uint8_t* source_end	= source + (source_stride-2);								// -2 to deal with the fact that we're starting at the second pixel of the row and should end at the second-to-last pixel of the row (first and last are filled separately)
+		uint8_t* dest				= dest_row;
+
+		// Row starting with Green
+		if (y % 2 == 0)
+		{
+			// Fill first pixel (green)
+			B = (source[source_stride] + source[source_stride + 2] + 1) >> 1;
+			G = source[source_stride + 1];
+			R = (source[1] + source[source_stride * 2 + 1] + 1) >> 1;
+			*dest = (uint8_t)((R*77 + G*151 + B*28)>>8);
+
+			source++;
+			dest++;
+
+			// Fill remaining pixel
+			for (; source <= source_end - 2; source += 2, dest += 2)
+			{
+				// Blue pixel
+				B = source[source_stride + 1];
+				G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
+				R = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;
+				dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+
+				//  Green pixel
+				B = (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
+				G = source[source_stride + 2];
+				R = (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
+				dest[1] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+
+			}
+		}
+		else
+		{
+			for (; source <= source_end - 2; source += 2, dest += 2)
+			{
+				// Red pixel
+				B = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
+				G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;;
+				R = source[source_stride + 1];
+				dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+
+				// Green pixel
+				B = (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
+				G = source[source_stride + 2];
+				R = (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
+				dest[1] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+			}
+		}
+
+		if (source < source_end)
+		{
+			B = source[source_stride + 1];
+			G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
+			R = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
+			dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+
+			source++;
+			dest++;
+		}
+
+		// Fill first pixel of row (copy second pixel)
+		uint8_t* first_pixel	= dest_row-1;
+		first_pixel[0]			= dest_row[0];
+
+		// Fill last pixel of row (copy second-to-last pixel). Note: dest row starts at the *second* pixel of the row, so dest_row + (width-2) * num_output_channels puts us at the last pixel of the row
+		uint8_t* last_pixel				= dest_row + (frame_width - 2);
+		uint8_t* second_to_last_pixel	= last_pixel - 1;
+		last_pixel[0]					= second_to_last_pixel[0];
+	}
+
+	// Fill first & last row
+	for (int i = 0; i < dest_stride; i++)
+	{
+		outBuffer[i]									= outBuffer[i + dest_stride];
+		outBuffer[i + (frame_height - 1)*dest_stride]	= outBuffer[i + (frame_height - 2)*dest_stride];
+	}
+}
+
+void DebayerRGBScalar(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR)
+{
+	int				num_output_channels	    = 3;
+	int				source_stride			= frame_width;
+	const uint8_t*	source_row				= inBayer;												// Start at first bayer pixel
+	int				dest_stride				= frame_width * num_output_channels;
+	uint8_t*		dest_row				= outBuffer + dest_stride + num_output_channels + 1; 	// We start outputting at the second pixel of the second row's G component
+	int				swap_br					= inBGR ? 1 : -1;
+
+	// Fill rows 1 to height-2 of the destination buffer. First and last row are filled separately (they are copied from the second row and second-to-last rows respectively)
+	for (int y = 0; y < frame_height-2; source_row += source_stride, dest_row += dest_stride, ++y)
+	{
+		const uint8_t* source		= source_row;
+		const uint8_t* source_end	= source + (source_stride-2);								// -2 to deal with the fact that we're starting at the second pixel of the row and should end at the second-to-last pixel of the row (first and last are filled separately)
+		uint8_t* dest				= dest_row;
+
+		// Row starting with Green
+		if (y % 2 == 0)
+		{
+			// Fill first pixel (green)
+			dest[-1*swap_br]	= (source[source_stride] + source[source_stride + 2] + 1) >> 1;
+			dest[0]				= source[source_stride + 1];
+			dest[1*swap_br]		= (source[1] + source[source_stride * 2 + 1] + 1) >> 1;
+
+			source++;
+			dest += num_output_channels;
+
+			// Fill remaining pixel
+			for (; source <= source_end - 2; source += 2, dest += num_output_channels * 2)
+			{
+				// Blue pixel
+				uint8_t* cur_pixel	= dest;
+				cur_pixel[-1*swap_br]	= source[source_stride + 1];
+				cur_pixel[0]			= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
+				cur_pixel[1*swap_br]	= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;
+
+				//  Green pixel
+				uint8_t* next_pixel		= cur_pixel+num_output_channels;
+				next_pixel[-1*swap_br]	= (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
+				next_pixel[0]			= source[source_stride + 2];
+				next_pixel[1*swap_br]	= (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
+			}
+		}
+		else
+		{
+			for (; source <= source_end - 2; source += 2, dest += num_output_channels * 2)
+			{
+				// Red pixel
+				uint8_t* cur_pixel	= dest;
+				cur_pixel[-1*swap_br]	= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
+				cur_pixel[0]			= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;;
+				cur_pixel[1*swap_br]	= source[source_stride + 1];
+
+				// Green pixel
+				uint8_t* next_pixel		= cur_pixel+num_output_channels;
+				next_pixel[-1*swap_br]	= (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
+				next_pixel[0]			= source[source_stride + 2];
+				next_pixel[1*swap_br]	= (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
+			}
+		}
+
+		if (source < source_end)
+		{
+			dest[-1*swap_br]	= source[source_stride + 1];
+			dest[0]				= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
+			dest[1*swap_br]		= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
+
+			source++;
+			dest += num_output_channels;
+		}
+
+		// Fill first pixel of row (copy second pixel)
+		uint8_t* first_pixel		= dest_row-num_output_channels;
+		first_pixel[-1*swap_br]		= dest_row[-1*swap_br];
+		first_pixel[0]				= dest_row[0];
+		first_pixel[1*swap_br]		= dest_row[1*swap_br];
+
+ 		// Fill last pixel of row (copy second-to-last pixel). Note: dest row starts at the *second* pixel of the row, so dest_row + (width-2) * num_output_channels puts us at the last pixel of the row
+		uint8_t* last_pixel				= dest_row + (frame_width - 2)*num_output_channels;
+		uint8_t* second_to_last_pixel	= last_pixel - num_output_channels;
+
+		last_pixel[-1*swap_br]			= second_to_last_pixel[-1*swap_br];
+		last_pixel[0]					= second_to_last_pixel[0];
+		last_pixel[1*swap_br]			= second_to_last_pixel[1*swap_br];
+	}
+
+	// Fill first & last row
+	for (int i = 0; i < dest_stride; i++)
+	{
+		outBuffer[i]									= outBuffer[i + dest_stride];
+		outBuffer[i + (frame_height - 1)*dest_stride]	= outBuffer[i + (frame_height - 2)*dest_stride];
+	}
+}
+
+// The row kernels work on one output row at a time, with 'above', 'row' and 'below' pointing at the
+// three source rows around it. Every output pixel is computed from the same five neighbourhood terms:
+//
+//   center	= row[x]
+//   hor2	= (row[x-1] + row[x+1] + 1) >> 1
+//   ver2	= (above[x] + below[x] + 1) >> 1
+//   cross4	= (above[x] + row[x-1] + row[x+1] + below[x] + 2) >> 2
+//   diag4	= (above[x-1] + above[x+1] + below[x-1] + below[x+1] + 2) >> 2
+//
+// and which term goes to which channel only depends on whether the row is a BG or GR row and whether
+// x is even or odd. This is exactly the arithmetic of the scalar reference, so the results are bit-identical.
+
+typedef void (*DebayerGrayRowFunc)(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t* dest);
+// Mask kernels compute the gray value like the gray kernels and write 0xFF where it is at least threshold, 0 elsewhere
+typedef void (*DebayerMaskRowFunc)(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t threshold, uint8_t* dest);
+// Pack a row of 0/0xFF mask bytes into bits, pixel x going to bit x % 8 of byte x / 8
+typedef void (*PackMaskBitsFunc)(const uint8_t* mask, int width, uint8_t* dest);
+// Color kernels are templates on the number of output channels (3, or 4 with an opaque alpha) and on the channel order,
+// so every color format of an instruction set shares one kernel
+typedef void (*DebayerColorRowFunc)(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, const ColorMatrix* matrix, uint8_t* dest);
+// High quality kernels work on the 5 source rows around an output row, rows[0] to rows[4], and fill all of its pixels
+typedef void (*DebayerHQRowFunc)(int frame_width, const uint8_t* const* rows, bool bg_row, const ColorMatrix* matrix, uint8_t* dest);
+// Half resolution kernels collapse every 2x2 GRBG quad of a GR row and the BG row below it into one pixel
+typedef void (*DebayerHalfGrayRowFunc)(int out_width, const uint8_t* gr_row, const uint8_t* bg_row, uint8_t* dest);
+typedef void (*DebayerHalfRGBRowFunc)(int out_width, const uint8_t* gr_row, const uint8_t* bg_row, const ColorMatrix* matrix, uint8_t* dest);
+// Pyramid kernels average every 2x2 block of two rows of a level into one pixel of the next level
+typedef void (*DownsampleGrayRowFunc)(int out_width, const uint8_t* row0, const uint8_t* row1, uint8_t* dest);
+typedef void (*DownsampleColorRowFunc)(int out_width, const uint8_t* row0, const uint8_t* row1, uint8_t* dest);
+// Remap kernels interpolate the pixels of a remapped row (see RemapTable) from demosaiced source rows, source row y
+// starting row_offsets[y] bytes into ring. Color source rows have 3 bytes per pixel, already in the output channel order.
+typedef void (*RemapRowFunc)(int out_width, const int32_t* positions, const uint16_t* fractions, const uint8_t* ring, const int32_t* row_offsets, uint8_t* dest);
+typedef void (*DebayerYUYVRowFunc)(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t* dest);
+// Scale count Bayer pixels in place by their flat-field gains (see BayerCorrection)
+typedef void (*ApplyGainsFunc)(uint8_t* pixels, const uint16_t* gains, int count);
+
+// Temporal denoise of count pixels in place against their 8.8 fixed point averages, see TemporalDenoiser. The weight
+// of the average is strength - min(|pixel - average|, threshold) * slope, in Q16.
+typedef void (*DenoiseFunc)(uint8_t* pixels, uint16_t* averages, int count, uint16_t strength, uint16_t slope, uint8_t threshold);
+
+// 4:2:0 kernels produce two output rows at once, since every chroma sample covers a 2x2 block. The source rows
+// are given by their center row only (above and below are one frame_width away), and the kernel also fills the
+// first and last pixel. With inNV12, dest_u receives interleaved U/V samples and dest_v is unused.
+typedef void (*DebayerYUV420RowFunc)(int frame_width, const uint8_t* row0, bool bg_row0, const uint8_t* row1, bool bg_row1, bool inNV12, uint8_t* dest_y0, uint8_t* dest_y1, uint8_t* dest_u, uint8_t* dest_v);
+
+// Compute pixel x of an output row
+static inline void debayer_pixel(const uint8_t* above, const uint8_t* row, const uint8_t* below, int x, bool bg_row, uint32_t& R, uint32_t& G, uint32_t& B)
+{
+	uint32_t center	= row[x];
+	uint32_t hor2	= (row[x - 1] + row[x + 1] + 1) >> 1;
+	uint32_t ver2	= (above[x] + below[x] + 1) >> 1;
+	uint32_t cross4	= (above[x] + row[x - 1] + row[x + 1] + below[x] + 2) >> 2;
+	uint32_t diag4	= (above[x - 1] + above[x + 1] + below[x - 1] + below[x + 1] + 2) >> 2;
+
+	bool even = (x & 1) == 0;
+	if (bg_row)
+	{
+		B = even ? center : hor2;
+		G = even ? cross4 : center;
+		R = even ? diag4 : ver2;
+	}
+	else
+	{
+		B = even ? ver2 : diag4;
+		G = even ? center : cross4;
+		R = even ? hor2 : center;
+	}
+}
+
+static inline void debayer_gray_pixels(const uint8_t* above, const uint8_t* row, const uint8_t* below, int x_begin, int x_end, bool bg_row, uint8_t* dest)
+{
+	uint32_t R, G, B;
+	for (int x = x_begin; x < x_end; ++x)
+	{
+		debayer_pixel(above, row, below, x, bg_row, R, G, B);
+		dest[x] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+	}
+}
+
+static inline void debayer_mask_pixels(const uint8_t* above, const uint8_t* row, const uint8_t* below, int x_begin, int x_end, bool bg_row, uint8_t threshold, uint8_t* dest)
+{
+	uint32_t R, G, B;
+	for (int x = x_begin; x < x_end; ++x)
+	{
+		debayer_pixel(above, row, below, x, bg_row, R, G, B);
+		dest[x] = (uint8_t)(0 - (((R*77 + G*151 + B*28)>>8) >= threshold));
+	}
+}
+
+// Mask bytes are 0 or 0xFF, so each one can simply be masked down to its own bit
+static inline void pack_mask_bits(const uint8_t* mask, int x_begin, int width, uint8_t* dest)
+{
+	int x = x_begin;
+	for (; x + 8 <= width; x += 8)
+	{
+		dest[x / 8] = (uint8_t)((mask[x] & 0x01) | (mask[x + 1] & 0x02) | (mask[x + 2] & 0x04) | (mask[x + 3] & 0x08) |
+								(mask[x + 4] & 0x10) | (mask[x + 5] & 0x20) | (mask[x + 6] & 0x40) | (mask[x + 7] & 0x80));
+	}
+
+	if (x < width)
+	{
+		uint8_t bits = 0;
+		for (int bit = 0; x + bit < width; ++bit)
+			bits |= (mask[x + bit] & 1) << bit;
+		dest[x / 8] = bits;
+	}
+}
+
+// Multiply a pixel by a color matrix. The SIMD kernels compute the same sums in 32-bit lanes and saturate them the same way.
+static inline void color_matrix_pixel(const ColorMatrix& matrix, uint32_t& R, uint32_t& G, uint32_t& B)
+{
+	const int16_t* c	= matrix.coefficients;
+	const int round		= 1 << (ColorMatrix::FRACTION_BITS - 1);
+	int sums[3];
+	for (int channel = 0; channel < 3; ++channel, c += 3)
+		sums[channel] = c[0] * (int)R + c[1] * (int)G + c[2] * (int)B + round;
+
+	R = sums[0] < 0 ? 0 : std::min(sums[0] >> ColorMatrix::FRACTION_BITS, 255);
+	G = sums[1] < 0 ? 0 : std::min(sums[1] >> ColorMatrix::FRACTION_BITS, 255);
+	B = sums[2] < 0 ? 0 : std::min(sums[2] >> ColorMatrix::FRACTION_BITS, 255);
+}
+
+// Store one pixel of a Channels byte output format, in BGR(A) or RGB(A) order. The fourth channel is an opaque alpha.
+// The pixel is multiplied by matrix first, unless it is NULL.
+template <int Channels, bool BGR>
+static inline void store_color_pixel(uint8_t* pixel, uint32_t R, uint32_t G, uint32_t B, const ColorMatrix* matrix)
+{
+	if (matrix)
+		color_matrix_pixel(*matrix, R, G, B);
+
+	if (Channels == 4)
+	{
+		// A single 4 byte store. Separate byte stores tempt the compiler into slow strided auto-vectorization.
+		uint8_t color[4] = { (uint8_t)(BGR ? B : R), (uint8_t)G, (uint8_t)(BGR ? R : B), 0xFF };
+		memcpy(pixel, color, 4);
+	}
+	else
+	{
+		pixel[0] = (uint8_t)(BGR ? B : R);
+		pixel[1] = (uint8_t)G;
+		pixel[2] = (uint8_t)(BGR ? R : B);
+	}
+}
+
+template <int Channels, bool BGR>
+static inline void debayer_color_pixels(const uint8_t* above, const uint8_t* row, const uint8_t* below, int x_begin, int x_end, bool bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	uint32_t R, G, B;
+	for (int x = x_begin; x < x_end; ++x)
+	{
+		debayer_pixel(above, row, below, x, bg_row, R, G, B);
+		store_color_pixel<Channels, BGR>(dest + x * Channels, R, G, B, matrix);
+	}
+}
+
+// Compute pixels [x_begin, x_end) of a BG (bg_row) or GR output row, two pixels per iteration. x_begin must be even.
+template <typename StorePixel>
+static inline void debayer_row_pairs(const uint8_t* above, const uint8_t* row, const uint8_t* below, int x_begin, int x_end, bool bg_row, StorePixel store)
+{
+	int x = x_begin;
+	if (bg_row)
+	{
+		for (; x + 1 < x_end; x += 2)
+		{
+			// Blue pixel
+			store(x,	(above[x - 1] + above[x + 1] + below[x - 1] + below[x + 1] + 2) >> 2,
+						(above[x] + row[x - 1] + row[x + 1] + below[x] + 2) >> 2,
+						row[x]);
+			// Green pixel
+			store(x + 1,	(above[x + 1] + below[x + 1] + 1) >> 1,
+							row[x + 1],
+							(row[x] + row[x + 2] + 1) >> 1);
+		}
+	}
+	else
+	{
+		for (; x + 1 < x_end; x += 2)
+		{
+			// Green pixel
+			store(x,	(row[x - 1] + row[x + 1] + 1) >> 1,
+						row[x],
+						(above[x] + below[x] + 1) >> 1);
+			// Red pixel
+			store(x + 1,	row[x + 1],
+							(above[x + 1] + row[x] + row[x + 2] + below[x + 1] + 2) >> 2,
+							(above[x] + above[x + 2] + below[x] + below[x + 2] + 2) >> 2);
+		}
+	}
+
+	if (x < x_end)
+	{
+		uint32_t R, G, B;
+		debayer_pixel(above, row, below, x, bg_row, R, G, B);
+		store(x, R, G, B);
+	}
+}
+
+// Fill pixels 1 to width-2 of an output row. The first and last pixel are filled by the caller.
+static void debayer_gray_row_scalar(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t* dest)
+{
+	debayer_gray_pixels(above, row, below, 1, 2, bg_row, dest);
+	debayer_row_pairs(above, row, below, 2, frame_width - 1, bg_row, [dest](int x, uint32_t R, uint32_t G, uint32_t B) {
+		dest[x] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+	});
+}
+
+static void debayer_mask_row_scalar(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t threshold, uint8_t* dest)
+{
+	debayer_mask_pixels(above, row, below, 1, 2, bg_row, threshold, dest);
+	debayer_row_pairs(above, row, below, 2, frame_width - 1, bg_row, [dest, threshold](int x, uint32_t R, uint32_t G, uint32_t B) {
+		dest[x] = (uint8_t)(0 - (((R*77 + G*151 + B*28)>>8) >= threshold));
+	});
+}
+
+static void pack_mask_bits_scalar(const uint8_t* mask, int width, uint8_t* dest)
+{
+	pack_mask_bits(mask, 0, width, dest);
+}
+
+// Pack four output bytes into a word that stores them in this order
+static inline uint32_t pack_bytes(uint32_t b0, uint32_t b1, uint32_t b2, uint32_t b3)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (b0 << 24) | (b1 << 16) | (b2 << 8) | b3;
+#else
+	return b0 | (b1 << 8) | (b2 << 16) | (b3 << 24);
+#endif
+}
+
+// Store four 3 byte pixels with three word stores. Scalar color rows are bound by their stores, and twelve byte stores
+// are slower than the reference loop; letting the compiler merge them (auto-vectorizing) is slower still.
+template <bool BGR>
+static inline void store_rgb_pixels4(uint8_t* dest,	uint32_t R0, uint32_t G0, uint32_t B0, uint32_t R1, uint32_t G1, uint32_t B1,
+													uint32_t R2, uint32_t G2, uint32_t B2, uint32_t R3, uint32_t G3, uint32_t B3)
+{
+	uint32_t word0 = pack_bytes(BGR ? B0 : R0, G0, BGR ? R0 : B0, BGR ? B1 : R1);
+	uint32_t word1 = pack_bytes(G1, BGR ? R1 : B1, BGR ? B2 : R2, G2);
+	uint32_t word2 = pack_bytes(BGR ? R2 : B2, BGR ? B3 : R3, G3, BGR ? R3 : B3);
+	memcpy(dest, &word0, 4);
+	memcpy(dest + 4, &word1, 4);
+	memcpy(dest + 8, &word2, 4);
+}
+
+// Compute 3 byte pixels from x = 2 on, four per iteration, and return the first pixel that is left
+template <bool BGR>
+static inline int debayer_rgb_row_quads(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t* dest)
+{
+	int x = 2;
+	if (bg_row)
+	{
+		for (; x + 3 < frame_width - 1; x += 4)
+		{
+			const uint8_t* a = above + x;
+			const uint8_t* c = row + x;
+			const uint8_t* d = below + x;
+			// Blue, green, blue, green
+			store_rgb_pixels4<BGR>(dest + x * 3,
+				(a[-1] + a[1] + d[-1] + d[1] + 2) >> 2,	(a[0] + c[-1] + c[1] + d[0] + 2) >> 2,	c[0],
+				(a[1] + d[1] + 1) >> 1,					c[1],									(c[0] + c[2] + 1) >> 1,
+				(a[1] + a[3] + d[1] + d[3] + 2) >> 2,	(a[2] + c[1] + c[3] + d[2] + 2) >> 2,	c[2],
+				(a[3] + d[3] + 1) >> 1,					c[3],									(c[2] + c[4] + 1) >> 1);
+		}
+	}
+	else
+	{
+		for (; x + 3 < frame_width - 1; x += 4)
+		{
+			const uint8_t* a = above + x;
+			const uint8_t* c = row + x;
+			const uint8_t* d = below + x;
+			// Green, red, green, red
+			store_rgb_pixels4<BGR>(dest + x * 3,
+				(c[-1] + c[1] + 1) >> 1,	c[0],									(a[0] + d[0] + 1) >> 1,
+				c[1],						(a[1] + c[0] + c[2] + d[1] + 2) >> 2,	(a[0] + a[2] + d[0] + d[2] + 2) >> 2,
+				(c[1] + c[3] + 1) >> 1,		c[2],									(a[2] + d[2] + 1) >> 1,
+				c[3],						(a[3] + c[2] + c[4] + d[3] + 2) >> 2,	(a[2] + a[4] + d[2] + d[4] + 2) >> 2);
+		}
+	}
+	return x;
+}
+
+template <int Channels, bool BGR>
+static void debayer_color_row_scalar(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	debayer_color_pixels<Channels, BGR>(above, row, below, 1, 2, bg_row, matrix, dest);
+
+	// The matrix is tested once per row rather than once per pixel
+	if (matrix)
+	{
+		debayer_row_pairs(above, row, below, 2, frame_width - 1, bg_row, [dest, matrix](int x, uint32_t R, uint32_t G, uint32_t B) {
+			store_color_pixel<Channels, BGR>(dest + x * Channels, R, G, B, matrix);
+		});
+	}
+	else if (Channels == 3)
+	{
+		int x = debayer_rgb_row_quads<BGR>(frame_width, above, row, below, bg_row, dest);
+		debayer_color_pixels<Channels, BGR>(above, row, below, x, frame_width - 1, bg_row, NULL, dest);
+	}
+	else
+	{
+		debayer_row_pairs(above, row, below, 2, frame_width - 1, bg_row, [dest](int x, uint32_t R, uint32_t G, uint32_t B) {
+			store_color_pixel<Channels, BGR>(dest + x * Channels, R, G, B, NULL);
+		});
+	}
+}
+
+// The high quality demosaic (Malvar, He and Cutler, "High-quality linear interpolation for demosaicing of Bayer-patterned
+// color images", ICASSP 2004) corrects the bilinear estimate of a missing color by the Laplacian of the color the pixel
+// has, which removes most of the color fringes along edges. With the neighbourhood terms
+//
+//   center	= rows[2][x]
+//   hor1	= rows[2][x-1] + rows[2][x+1]		hor2	= rows[2][x-2] + rows[2][x+2]
+//   ver1	= rows[1][x] + rows[3][x]			ver2	= rows[0][x] + rows[4][x]
+//   diag	= rows[1][x-1] + rows[1][x+1] + rows[3][x-1] + rows[3][x+1]
+//
+// its 5x5 filters, scaled by 16 so that all weights are integers, are
+//
+//   green		G at R or B:					8 center + 4 (hor1 + ver1) - 2 (hor2 + ver2)
+//   same_row	R or B at G, in the same row:	10 center + 8 hor1 - 2 (hor2 + diag) + ver2
+//   same_col	R or B at G, in the same column:	10 center + 8 ver1 - 2 (ver2 + diag) + hor2
+//   opposite	R at B or B at R:				12 center + 4 diag - 3 (hor2 + ver2)
+//
+// rounded with (sum + 8) >> 4 and clamped to [0, 255]. Every sum is within [-3060, 7140], so the SIMD kernels compute
+// them in signed 16-bit lanes with the same results. Rows and columns past the frame border are mirrored at the border
+// row or column, which keeps the Bayer pattern.
+
+static inline int mirror_index(int index, int size)
+{
+	return index < 0 ? -index : (index >= size ? 2 * (size - 1) - index : index);
+}
+
+static inline uint32_t clamp_hq(int value)
+{
+	return value < 0 ? 0 : (value > 255 ? 255 : (uint32_t)value);
+}
+
+template <int Channels, bool BGR>
+static inline void debayer_hq_pixels(int frame_width, const uint8_t* const* rows, int x_begin, int x_end, bool bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	for (int x = x_begin; x < x_end; ++x)
+	{
+		int left2	= mirror_index(x - 2, frame_width);
+		int left1	= mirror_index(x - 1, frame_width);
+		int right1	= mirror_index(x + 1, frame_width);
+		int right2	= mirror_index(x + 2, frame_width);
+
+		int center	= rows[2][x];
+		int hor1	= rows[2][left1] + rows[2][right1];
+		int hor2	= rows[2][left2] + rows[2][right2];
+		int ver1	= rows[1][x] + rows[3][x];
+		int ver2	= rows[0][x] + rows[4][x];
+		int diag	= rows[1][left1] + rows[1][right1] + rows[3][left1] + rows[3][right1];
+
+		uint32_t R, G, B;
+		bool even = (x & 1) == 0;
+		if (bg_row == even)
+		{
+			// B or R pixel
+			uint32_t green		= clamp_hq((8 * center + 4 * (hor1 + ver1) - 2 * (hor2 + ver2) + 8) >> 4);
+			uint32_t opposite	= clamp_hq((12 * center + 4 * diag - 3 * (hor2 + ver2) + 8) >> 4);
+			B = bg_row ? center : opposite;
+			G = green;
+			R = bg_row ? opposite : center;
+		}
+		else
+		{
+			// G pixel, with B on its left and right in BG rows and R in GR rows
+			uint32_t same_row	= clamp_hq((10 * center + 8 * hor1 - 2 * (hor2 + diag) + ver2 + 8) >> 4);
+			uint32_t same_col	= clamp_hq((10 * center + 8 * ver1 - 2 * (ver2 + diag) + hor2 + 8) >> 4);
+			B = bg_row ? same_row : same_col;
+			G = center;
+			R = bg_row ? same_col : same_row;
+		}
+		store_color_pixel<Channels, BGR>(dest + x * Channels, R, G, B, matrix);
+	}
+}
+
+template <int Channels, bool BGR>
+static void debayer_hq_row_scalar(int frame_width, const uint8_t* const* rows, bool bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	debayer_hq_pixels<Channels, BGR>(frame_width, rows, 0, frame_width, bg_row, matrix, dest);
+}
+
+// YUV output uses BT.601 limited range ("video") coefficients in 8.8 fixed point. For 8-bit R, G, B the results are
+// always within [16, 235] for Y and [16, 240] for U and V, so no clamping is needed, and the chroma sums fit a signed
+// 16-bit lane. Chroma is computed from the rounded average R, G and B of the pixels it covers.
+static inline uint8_t rgb_to_y(int R, int G, int B)
+{
+	return (uint8_t)(((66*R + 129*G + 25*B + 128) >> 8) + 16);
+}
+
+static inline uint8_t rgb_to_u(int R, int G, int B)
+{
+	return (uint8_t)(((-38*R - 74*G + 112*B + 128) >> 8) + 128);
+}
+
+static inline uint8_t rgb_to_v(int R, int G, int B)
+{
+	return (uint8_t)(((112*R - 94*G - 18*B + 128) >> 8) + 128);
+}
+
+// Compute pixel x of an output row, where the first and last pixel are copies of their inner neighbours
+static inline void debayer_pixel_clamped(int frame_width, const uint8_t* row, int x, bool bg_row, uint32_t& R, uint32_t& G, uint32_t& B)
+{
+	x = x < 1 ? 1 : (x > frame_width - 2 ? frame_width - 2 : x);
+	debayer_pixel(row - frame_width, row, row + frame_width, x, bg_row, R, G, B);
+}
+
+// Fill pixel pairs [x_begin, x_end) of a YUYV row. x_begin must be even.
+static inline void debayer_yuyv_pairs(int frame_width, const uint8_t* row, int x_begin, int x_end, bool bg_row, uint8_t* dest)
+{
+	for (int x = x_begin; x < x_end; x += 2)
+	{
+		uint32_t R0, G0, B0, R1, G1, B1;
+		debayer_pixel_clamped(frame_width, row, x, bg_row, R0, G0, B0);
+		debayer_pixel_clamped(frame_width, row, x + 1, bg_row, R1, G1, B1);
+
+		int R = (R0 + R1 + 1) >> 1;
+		int G = (G0 + G1 + 1) >> 1;
+		int B = (B0 + B1 + 1) >> 1;
+
+		uint8_t* pixel = dest + x * 2;
+		pixel[0] = rgb_to_y(R0, G0, B0);
+		pixel[1] = rgb_to_u(R, G, B);
+		pixel[2] = rgb_to_y(R1, G1, B1);
+		pixel[3] = rgb_to_v(R, G, B);
+	}
+}
+
+// Fill 2x2 blocks [x_begin, x_end) of a pair of 4:2:0 rows. x_begin must be even.
+static inline void debayer_yuv420_blocks(int frame_width, const uint8_t* row0, bool bg_row0, const uint8_t* row1, bool bg_row1, int x_begin, int x_end,
+										 bool inNV12, uint8_t* dest_y0, uint8_t* dest_y1, uint8_t* dest_u, uint8_t* dest_v)
+{
+	for (int x = x_begin; x < x_end; x += 2)
+	{
+		uint32_t R[4], G[4], B[4];
+		debayer_pixel_clamped(frame_width, row0, x, bg_row0, R[0], G[0], B[0]);
+		debayer_pixel_clamped(frame_width, row0, x + 1, bg_row0, R[1], G[1], B[1]);
+		debayer_pixel_clamped(frame_width, row1, x, bg_row1, R[2], G[2], B[2]);
+		debayer_pixel_clamped(frame_width, row1, x + 1, bg_row1, R[3], G[3], B[3]);
+
+		dest_y0[x]		= rgb_to_y(R[0], G[0], B[0]);
+		dest_y0[x + 1]	= rgb_to_y(R[1], G[1], B[1]);
+		dest_y1[x]		= rgb_to_y(R[2], G[2], B[2]);
+		dest_y1[x + 1]	= rgb_to_y(R[3], G[3], B[3]);
+
+		int avg_R = (R[0] + R[1] + R[2] + R[3] + 2) >> 2;
+		int avg_G = (G[0] + G[1] + G[2] + G[3] + 2) >> 2;
+		int avg_B = (B[0] + B[1] + B[2] + B[3] + 2) >> 2;
+		if (inNV12)
+		{
+			dest_u[x]		= rgb_to_u(avg_R, avg_G, avg_B);
+			dest_u[x + 1]	= rgb_to_v(avg_R, avg_G, avg_B);
+		}
+		else
+		{
+			dest_u[x >> 1] = rgb_to_u(avg_R, avg_G, avg_B);
+			dest_v[x >> 1] = rgb_to_v(avg_R, avg_G, avg_B);
+		}
+	}
+}
+
+// Fill a whole YUYV row, including the first and last pixel
+static void debayer_yuyv_row_scalar(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t* dest)
+{
+	(void)above;
+	(void)below;
+	debayer_yuyv_pairs(frame_width, row, 0, frame_width, bg_row, dest);
+}
+
+static void debayer_yuv420_row_scalar(int frame_width, const uint8_t* row0, bool bg_row0, const uint8_t* row1, bool bg_row1, bool inNV12, uint8_t* dest_y0, uint8_t* dest_y1, uint8_t* dest_u, uint8_t* dest_v)
+{
+	debayer_yuv420_blocks(frame_width, row0, bg_row0, row1, bg_row1, 0, frame_width, inNV12, dest_y0, dest_y1, dest_u, dest_v);
+}
+
+// Fill output pixels [x_begin, x_end) of a half resolution row. Red and blue are taken as is, the two greens are averaged.
+static inline void debayer_half_gray_pixels(const uint8_t* gr_row, const uint8_t* bg_row, int x_begin, int x_end, uint8_t* dest)
+{
+	for (int x = x_begin; x < x_end; ++x)
+	{
+		uint32_t R = gr_row[2 * x + 1];
+		uint32_t G = (gr_row[2 * x] + bg_row[2 * x + 1] + 1) >> 1;
+		uint32_t B = bg_row[2 * x];
+		dest[x] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+	}
+}
+
+template <bool BGR>
+static inline void debayer_half_rgb_pixels(const uint8_t* gr_row, const uint8_t* bg_row, int x_begin, int x_end, const ColorMatrix* matrix, uint8_t* dest)
+{
+	for (int x = x_begin; x < x_end; ++x)
+	{
+		uint32_t R = gr_row[2 * x + 1];
+		uint32_t G = (gr_row[2 * x] + bg_row[2 * x + 1] + 1) >> 1;
+		uint32_t B = bg_row[2 * x];
+		store_color_pixel<3, BGR>(dest + x * 3, R, G, B, matrix);
+	}
+}
+
+static void debayer_half_gray_row_scalar(int out_width, const uint8_t* gr_row, const uint8_t* bg_row, uint8_t* dest)
+{
+	debayer_half_gray_pixels(gr_row, bg_row, 0, out_width, dest);
+}
+
+template <bool BGR>
+static void debayer_half_rgb_row_scalar(int out_width, const uint8_t* gr_row, const uint8_t* bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	debayer_half_rgb_pixels<BGR>(gr_row, bg_row, 0, out_width, matrix, dest);
+}
+
+// Fill output pixels [x_begin, x_end) of a pyramid level row from rows 2y and 2y+1 of the level above
+static inline void downsample_gray_pixels(const uint8_t* row0, const uint8_t* row1, int x_begin, int x_end, uint8_t* dest)
+{
+	for (int x = x_begin; x < x_end; ++x)
+		dest[x] = (uint8_t)((row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+}
+
+static void downsample_gray_row_scalar(int out_width, const uint8_t* row0, const uint8_t* row1, uint8_t* dest)
+{
+	downsample_gray_pixels(row0, row1, 0, out_width, dest);
+}
+
+static inline void downsample_color_pixels(const uint8_t* row0, const uint8_t* row1, int x_begin, int x_end, uint8_t* dest)
+{
+	for (int x = x_begin; x < x_end; ++x)
+	{
+		for (int c = 0; c < 3; ++c)
+			dest[x * 3 + c] = (uint8_t)((row0[x * 6 + c] + row0[x * 6 + 3 + c] + row1[x * 6 + c] + row1[x * 6 + 3 + c] + 2) >> 2);
+	}
+}
+
+static void downsample_color_row_scalar(int out_width, const uint8_t* row0, const uint8_t* row1, uint8_t* dest)
+{
+	downsample_color_pixels(row0, row1, 0, out_width, dest);
+}
+
+// Blend a source pixel with its right neighbour by fx/32, and the result with that of the row below by fy/32. Both steps
+// are rounded to 8 bits, so that the SIMD kernels can do the same in 16-bit lanes.
+static inline uint32_t remap_blend(uint32_t upper0, uint32_t upper1, uint32_t lower0, uint32_t lower1, uint32_t fx, uint32_t fy)
+{
+	uint32_t top	= (upper0 * (32 - fx) + upper1 * fx + 16) >> 5;
+	uint32_t bottom	= (lower0 * (32 - fx) + lower1 * fx + 16) >> 5;
+	return (top * (32 - fy) + bottom * fy + 16) >> 5;
+}
+
+// Fill output pixels [x_begin, x_end) of a remapped row. Pixels whose source is outside the frame are black, with an opaque alpha.
+template <int Channels>
+static inline void remap_pixels(const int32_t* positions, const uint16_t* fractions, const uint8_t* ring, const int32_t* row_offsets, int x_begin, int x_end, uint8_t* dest)
+{
+	const int source_channels = Channels == 4 ? 3 : Channels;
+
+	for (int x = x_begin; x < x_end; ++x)
+	{
+		uint8_t* pixel = dest + x * Channels;
+		if (Channels == 4)
+			pixel[3] = 0xFF;
+
+		if (positions[x] < 0)
+		{
+			for (int c = 0; c < source_channels; ++c)
+				pixel[c] = 0;
+			continue;
+		}
+
+		int source_x			= (positions[x] & 0xFFFF) * source_channels;
+		int source_y			= positions[x] >> 16;
+		const uint8_t* upper	= ring + row_offsets[source_y] + source_x;
+		const uint8_t* lower	= ring + row_offsets[source_y + 1] + source_x;
+		uint32_t fx				= fractions[x] & 0xFF;
+		uint32_t fy				= fractions[x] >> 8;
+		for (int c = 0; c < source_channels; ++c)
+			pixel[c] = (uint8_t)remap_blend(upper[c], upper[c + source_channels], lower[c], lower[c + source_channels], fx, fy);
+	}
+}
+
+template <int Channels>
+static void remap_row_scalar(int out_width, const int32_t* positions, const uint16_t* fractions, const uint8_t* ring, const int32_t* row_offsets, uint8_t* dest)
+{
+	remap_pixels<Channels>(positions, fractions, ring, row_offsets, 0, out_width, dest);
+}
+
+// The product of 16 v and the gain is v * gain in Q16, so the SIMD kernels get the rounded result from the high half
+// of the 16-bit product plus the top bit of the low half
+static inline void apply_gains_pixels(uint8_t* pixels, const uint16_t* gains, int x_begin, int x_end)
+{
+	for (int x = x_begin; x < x_end; ++x)
+		pixels[x] = (uint8_t)std::min(((uint32_t)(pixels[x] * 16) * gains[x] + 0x8000) >> 16, 255u);
+}
+
+static void apply_gains_scalar(uint8_t* pixels, const uint16_t* gains, int count)
+{
+	apply_gains_pixels(pixels, gains, 0, count);
+}
+
+// The new pixel enters the average as v + 0.5 and the filtered pixel is the integer part of the average, so the
+// truncation of the two products doesn't bias still pixels down. The weights add up to 65535 and the sum can't overflow.
+static inline void denoise_pixels(uint8_t* pixels, uint16_t* averages, int x_begin, int x_end, uint16_t strength, uint16_t slope, uint8_t threshold)
+{
+	for (int x = x_begin; x < x_end; ++x)
+	{
+		uint32_t pixel		= pixels[x];
+		uint32_t average	= averages[x];
+		uint32_t prev		= average >> 8;
+		uint32_t diff		= pixel > prev ? pixel - prev : prev - pixel;
+		uint32_t weight		= strength - std::min(diff, (uint32_t)threshold) * slope;
+		average				= ((average * weight) >> 16) + ((((pixel << 8) | 0x80) * (0xFFFF - weight)) >> 16);
+		averages[x]			= (uint16_t)average;
+		pixels[x]			= (uint8_t)(average >> 8);
+	}
+}
+
+static void denoise_scalar(uint8_t* pixels, uint16_t* averages, int count, uint16_t strength, uint16_t slope, uint8_t threshold)
+{
+	denoise_pixels(pixels, averages, 0, count, strength, slope, threshold);
+}
+
+#ifdef PS3EYE_HAVE_X86_SIMD
+
+// Advance to the next vector block of a row. The last block is moved back to end exactly at last_x, overlapping the
+// one before it: computing a few pixels twice is cheaper than finishing the row with scalar code.
+static inline int next_block(int x, int block_size, int last_x)
+{
+	return (x < last_x && x + block_size > last_x) ? last_x : x + block_size;
+}
+
+// First even x >= x_begin at which the 4-byte pixel dest + x * 4 is aligned to alignment bytes, or -1 if there is none
+// because dest itself is misaligned by an odd number of pixels
+static inline int first_aligned_rgba_x(const uint8_t* dest, int x_begin, int alignment)
+{
+	for (int x = x_begin; x < x_begin + alignment / 4; x += 2)
+	{
+		if ((((uintptr_t)(dest + x * 4)) & (alignment - 1)) == 0)
+			return x;
+	}
+	return -1;
+}
+
+// SSE2
+
+// Exact (a + b + c + d + 2) >> 2 in 8-bit lanes. Averaging the two pairwise rounded averages
+// rounds up one time too many when both pairs were rounded and the final average is rounded too.
+PS3EYE_TARGET_SSE2 static inline __m128i avg4_sse2(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+	const __m128i one = _mm_set1_epi8(1);
+
+	__m128i ab		= _mm_avg_epu8(a, b);
+	__m128i cd		= _mm_avg_epu8(c, d);
+	__m128i error	= _mm_and_si128(_mm_and_si128(_mm_or_si128(_mm_xor_si128(a, b), _mm_xor_si128(c, d)), _mm_xor_si128(ab, cd)), one);
+	return _mm_sub_epi8(_mm_avg_epu8(ab, cd), error);
+}
+
+PS3EYE_TARGET_SSE2 static inline __m128i select_sse2(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Demosaic 16 pixels starting at even x
+PS3EYE_TARGET_SSE2 static inline void debayer_block_sse2(const uint8_t* above, const uint8_t* row, const uint8_t* below, int x, bool bg_row, __m128i& R, __m128i& G, __m128i& B)
+{
+	__m128i a_l = _mm_loadu_si128((const __m128i*)(above + x - 1));
+	__m128i a_c = _mm_loadu_si128((const __m128i*)(above + x));
+	__m128i a_r = _mm_loadu_si128((const __m128i*)(above + x + 1));
+	__m128i r_l = _mm_loadu_si128((const __m128i*)(row + x - 1));
+	__m128i r_c = _mm_loadu_si128((const __m128i*)(row + x));
+	__m128i r_r = _mm_loadu_si128((const __m128i*)(row + x + 1));
+	__m128i b_l = _mm_loadu_si128((const __m128i*)(below + x - 1));
+	__m128i b_c = _mm_loadu_si128((const __m128i*)(below + x));
+	__m128i b_r = _mm_loadu_si128((const __m128i*)(below + x + 1));
+
+	__m128i hor2	= _mm_avg_epu8(r_l, r_r);
+	__m128i ver2	= _mm_avg_epu8(a_c, b_c);
+	__m128i cross4	= avg4_sse2(a_c, r_l, r_r, b_c);
+	__m128i diag4	= avg4_sse2(a_l, a_r, b_l, b_r);
+
+	const __m128i even = _mm_set1_epi16(0x00FF);
+	if (bg_row)
+	{
+		B = select_sse2(even, r_c, hor2);
+		G = select_sse2(even, cross4, r_c);
+		R = select_sse2(even, diag4, ver2);
+	}
+	else
+	{
+		B = select_sse2(even, ver2, diag4);
+		G = select_sse2(even, r_c, cross4);
+		R = select_sse2(even, hor2, r_c);
+	}
+}
+
+PS3EYE_TARGET_SSE2 static inline __m128i luma_sse2(__m128i R, __m128i G, __m128i B)
+{
+	const __m128i zero	= _mm_setzero_si128();
+	const __m128i kr	= _mm_set1_epi16(77);
+	const __m128i kg	= _mm_set1_epi16(151);
+	const __m128i kb	= _mm_set1_epi16(28);
+
+	// The weighted sum is at most 255*256, so it fits in an unsigned 16-bit lane
+	__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(R, zero), kr),
+											 _mm_mullo_epi16(_mm_unpacklo_epi8(G, zero), kg)),
+							   _mm_mullo_epi16(_mm_unpacklo_epi8(B, zero), kb));
+	__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(R, zero), kr),
+											 _mm_mullo_epi16(_mm_unpackhi_epi8(G, zero), kg)),
+							   _mm_mullo_epi16(_mm_unpackhi_epi8(B, zero), kb));
+	return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+// Pack 4 pixels of 4 bytes (c0 c1 c2 0) into 12 bytes and store them
+PS3EYE_TARGET_SSE2 static inline void store_4x3_sse2(uint8_t* dest, __m128i pixels)
+{
+	const __m128i lo_mask = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+	const __m128i hi_mask = _mm_set_epi32(0x0000FFFF, 0xFF000000, 0x0000FFFF, 0xFF000000);
+
+	// 6 valid bytes at the bottom of each 64-bit lane
+	__m128i packed = _mm_or_si128(_mm_and_si128(pixels, lo_mask), _mm_and_si128(_mm_srli_epi64(pixels, 8), hi_mask));
+	// 12 valid bytes at the bottom of the register
+	packed = _mm_or_si128(_mm_move_epi64(packed), _mm_slli_si128(_mm_srli_si128(packed, 8), 6));
+
+	_mm_storel_epi64((__m128i*)dest, packed);
+	int32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+	memcpy(dest + 8, &tail, 4);
+}
+
+// Interleave 16 pixels of three planes into 48 bytes
+PS3EYE_TARGET_SSE2 static inline void store_rgb_sse2(uint8_t* dest, __m128i c0, __m128i c1, __m128i c2)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	__m128i c01_lo	= _mm_unpacklo_epi8(c0, c1);
+	__m128i c01_hi	= _mm_unpackhi_epi8(c0, c1);
+	__m128i c2_lo	= _mm_unpacklo_epi8(c2, zero);
+	__m128i c2_hi	= _mm_unpackhi_epi8(c2, zero);
+
+	store_4x3_sse2(dest,		_mm_unpacklo_epi16(c01_lo, c2_lo));
+	store_4x3_sse2(dest + 12,	_mm_unpackhi_epi16(c01_lo, c2_lo));
+	store_4x3_sse2(dest + 24,	_mm_unpacklo_epi16(c01_hi, c2_hi));
+	store_4x3_sse2(dest + 36,	_mm_unpackhi_epi16(c01_hi, c2_hi));
+}
+
+PS3EYE_TARGET_SSE2 static void debayer_gray_row_sse2(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t* dest)
+{
+	debayer_gray_pixels(above, row, below, 1, 2, bg_row, dest);
+
+	// Vector loads read up to x + 16, which must stay inside the row
+	int x = 2;
+	for (int last_x = (frame_width - 17) & ~1; x <= last_x; x = next_block(x, 16, last_x))
+	{
+		__m128i R, G, B;
+		debayer_block_sse2(above, row, below, x, bg_row, R, G, B);
+		_mm_storeu_si128((__m128i*)(dest + x), luma_sse2(R, G, B));
+	}
+
+	debayer_gray_pixels(above, row, below, x, frame_width - 1, bg_row, dest);
+}
+
+PS3EYE_TARGET_SSE2 static void debayer_mask_row_sse2(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t threshold, uint8_t* dest)
+{
+	debayer_mask_pixels(above, row, below, 1, 2, bg_row, threshold, dest);
+
+	// gray >= threshold exactly where max(gray, threshold) == gray
+	const __m128i threshold_vec = _mm_set1_epi8((char)threshold);
+	int x = 2;
+	for (int last_x = (frame_width - 17) & ~1; x <= last_x; x = next_block(x, 16, last_x))
+	{
+		__m128i R, G, B;
+		debayer_block_sse2(above, row, below, x, bg_row, R, G, B);
+		__m128i gray = luma_sse2(R, G, B);
+		_mm_storeu_si128((__m128i*)(dest + x), _mm_cmpeq_epi8(_mm_max_epu8(gray, threshold_vec), gray));
+	}
+
+	debayer_mask_pixels(above, row, below, x, frame_width - 1, bg_row, threshold, dest);
+}
+
+PS3EYE_TARGET_SSE2 static void pack_mask_bits_sse2(const uint8_t* mask, int width, uint8_t* dest)
+{
+	int x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		uint16_t bits = (uint16_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(mask + x)));
+		memcpy(dest + x / 8, &bits, 2);
+	}
+	pack_mask_bits(mask, x, width, dest);
+}
+
+// Interleave 16 pixels of three planes and an opaque alpha into 64 bytes
+PS3EYE_TARGET_SSE2 static inline void store_rgba_sse2(uint8_t* dest, __m128i c0, __m128i c1, __m128i c2, bool aligned)
+{
+	const __m128i alpha = _mm_set1_epi8(-1);
+
+	__m128i c01_lo	= _mm_unpacklo_epi8(c0, c1);
+	__m128i c01_hi	= _mm_unpackhi_epi8(c0, c1);
+	__m128i c2a_lo	= _mm_unpacklo_epi8(c2, alpha);
+	__m128i c2a_hi	= _mm_unpackhi_epi8(c2, alpha);
+
+	__m128i out0 = _mm_unpacklo_epi16(c01_lo, c2a_lo);
+	__m128i out1 = _mm_unpackhi_epi16(c01_lo, c2a_lo);
+	__m128i out2 = _mm_unpacklo_epi16(c01_hi, c2a_hi);
+	__m128i out3 = _mm_unpackhi_epi16(c01_hi, c2a_hi);
+
+	if (aligned)
+	{
+		_mm_store_si128((__m128i*)dest, out0);
+		_mm_store_si128((__m128i*)(dest + 16), out1);
+		_mm_store_si128((__m128i*)(dest + 32), out2);
+		_mm_store_si128((__m128i*)(dest + 48), out3);
+	}
+	else
+	{
+		_mm_storeu_si128((__m128i*)dest, out0);
+		_mm_storeu_si128((__m128i*)(dest + 16), out1);
+		_mm_storeu_si128((__m128i*)(dest + 32), out2);
+		_mm_storeu_si128((__m128i*)(dest + 48), out3);
+	}
+}
+
+// Multiply 16 pixels by a color matrix. The pixels are widened to (R, G) and (B, 1) pairs of 16-bit lanes, so that every
+// output channel of 4 pixels takes two madds, with the rounding term as the coefficient of the 1. The packs saturate to [0, 255].
+PS3EYE_TARGET_SSE2 static inline void color_matrix_sse2(const ColorMatrix& matrix, __m128i& R, __m128i& G, __m128i& B)
+{
+	__m128i zero	= _mm_setzero_si128();
+	__m128i one		= _mm_set1_epi16(1);
+	__m128i R_lo	= _mm_unpacklo_epi8(R, zero);
+	__m128i R_hi	= _mm_unpackhi_epi8(R, zero);
+	__m128i G_lo	= _mm_unpacklo_epi8(G, zero);
+	__m128i G_hi	= _mm_unpackhi_epi8(G, zero);
+	__m128i B_lo	= _mm_unpacklo_epi8(B, zero);
+	__m128i B_hi	= _mm_unpackhi_epi8(B, zero);
+	__m128i RG[4]	= { _mm_unpacklo_epi16(R_lo, G_lo), _mm_unpackhi_epi16(R_lo, G_lo), _mm_unpacklo_epi16(R_hi, G_hi), _mm_unpackhi_epi16(R_hi, G_hi) };
+	__m128i B1[4]	= { _mm_unpacklo_epi16(B_lo, one), _mm_unpackhi_epi16(B_lo, one), _mm_unpacklo_epi16(B_hi, one), _mm_unpackhi_epi16(B_hi, one) };
+
+	__m128i out[3];
+	const int16_t* c = matrix.coefficients;
+	for (int channel = 0; channel < 3; ++channel, c += 3)
+	{
+		__m128i coef_rg	= _mm_set1_epi32((uint16_t)c[0] | (uint32_t)(uint16_t)c[1] << 16);
+		__m128i coef_b1	= _mm_set1_epi32((uint16_t)c[2] | (uint32_t)1 << (ColorMatrix::FRACTION_BITS - 1 + 16));
+		__m128i sums[4];
+		for (int index = 0; index < 4; ++index)
+			sums[index] = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(RG[index], coef_rg), _mm_madd_epi16(B1[index], coef_b1)), ColorMatrix::FRACTION_BITS);
+		out[channel] = _mm_packus_epi16(_mm_packs_epi32(sums[0], sums[1]), _mm_packs_epi32(sums[2], sums[3]));
+	}
+
+	R = out[0];
+	G = out[1];
+	B = out[2];
+}
+
+// Store 16 pixels of a Channels byte output format, multiplied by matrix first unless it is NULL
+template <int Channels, bool BGR>
+PS3EYE_TARGET_SSE2 static inline void store_color_sse2(uint8_t* dest, __m128i R, __m128i G, __m128i B, bool aligned, const ColorMatrix* matrix)
+{
+	if (matrix)
+		color_matrix_sse2(*matrix, R, G, B);
+
+	if (Channels == 4)
+		store_rgba_sse2(dest, BGR ? B : R, G, BGR ? R : B, aligned);
+	else
+		store_rgb_sse2(dest, BGR ? B : R, G, BGR ? R : B);
+}
+
+template <int Channels, bool BGR>
+PS3EYE_TARGET_SSE2 static void debayer_color_row_sse2(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	int x = 1;
+	int last_x = (frame_width - 17) & ~1;
+	if (last_x >= 2)
+	{
+		// For 4 byte pixels, start the blocks at the first 16-byte aligned pixel, so all but the overlapping last one
+		// use aligned stores. Rows that start at an odd multiple of 4 bytes can't be aligned and use unaligned stores.
+		int aligned_x = Channels == 4 ? first_aligned_rgba_x(dest, 2, 16) : -1;
+		bool aligned = aligned_x >= 0;
+		if (!aligned)
+			aligned_x = 2;
+
+		debayer_color_pixels<Channels, BGR>(above, row, below, 1, aligned_x, bg_row, matrix, dest);
+		for (x = aligned_x; x <= last_x; x += 16)
+		{
+			__m128i R, G, B;
+			debayer_block_sse2(above, row, below, x, bg_row, R, G, B);
+			store_color_sse2<Channels, BGR>(dest + x * Channels, R, G, B, aligned, matrix);
+		}
+		if (x < last_x + 16)
+		{
+			__m128i R, G, B;
+			debayer_block_sse2(above, row, below, last_x, bg_row, R, G, B);
+			store_color_sse2<Channels, BGR>(dest + last_x * Channels, R, G, B, false, matrix);
+		}
+		x = last_x + 16;
+	}
+
+	debayer_color_pixels<Channels, BGR>(above, row, below, x, frame_width - 1, bg_row, matrix, dest);
+}
+
+// Y of 16 pixels
+PS3EYE_TARGET_SSE2 static inline __m128i rgb_to_y_sse2(__m128i R, __m128i G, __m128i B)
+{
+	const __m128i zero	= _mm_setzero_si128();
+	const __m128i kr	= _mm_set1_epi16(66);
+	const __m128i kg	= _mm_set1_epi16(129);
+	const __m128i kb	= _mm_set1_epi16(25);
+	const __m128i round	= _mm_set1_epi16(128);
+	const __m128i bias	= _mm_set1_epi8(16);
+
+	// At most 220*255 + 128, so the sum fits in an unsigned 16-bit lane
+	__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(R, zero), kr),
+											 _mm_mullo_epi16(_mm_unpacklo_epi8(G, zero), kg)),
+							   _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(B, zero), kb), round));
+	__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(R, zero), kr),
+											 _mm_mullo_epi16(_mm_unpackhi_epi8(G, zero), kg)),
+							   _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(B, zero), kb), round));
+	return _mm_add_epi8(_mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)), bias);
+}
+
+// U or V of 8 samples from 16-bit R, G and B, returned in 16-bit lanes
+PS3EYE_TARGET_SSE2 static inline __m128i rgb_to_chroma_sse2(__m128i R, __m128i G, __m128i B, short kr, short kg, short kb)
+{
+	__m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(kr)), _mm_mullo_epi16(G, _mm_set1_epi16(kg))),
+								_mm_add_epi16(_mm_mullo_epi16(B, _mm_set1_epi16(kb)), _mm_set1_epi16(128)));
+	return _mm_add_epi16(_mm_srai_epi16(sum, 8), _mm_set1_epi16(128));
+}
+
+// Sum of the even and odd pixels of a 16 pixel channel, in 8 16-bit lanes
+PS3EYE_TARGET_SSE2 static inline __m128i pair_sum_sse2(__m128i c)
+{
+	return _mm_add_epi16(_mm_and_si128(c, _mm_set1_epi16(0x00FF)), _mm_srli_epi16(c, 8));
+}
+
+PS3EYE_TARGET_SSE2 static void debayer_yuyv_row_sse2(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t* dest)
+{
+	const __m128i one = _mm_set1_epi16(1);
+
+	debayer_yuyv_pairs(frame_width, row, 0, 2, bg_row, dest);
+
+	int x = 2;
+	for (int last_x = (frame_width - 17) & ~1; x <= last_x; x = next_block(x, 16, last_x))
+	{
+		__m128i R, G, B;
+		debayer_block_sse2(above, row, below, x, bg_row, R, G, B);
+
+		__m128i Y	= rgb_to_y_sse2(R, G, B);
+		__m128i R2	= _mm_srli_epi16(_mm_add_epi16(pair_sum_sse2(R), one), 1);
+		__m128i G2	= _mm_srli_epi16(_mm_add_epi16(pair_sum_sse2(G), one), 1);
+		__m128i B2	= _mm_srli_epi16(_mm_add_epi16(pair_sum_sse2(B), one), 1);
+		__m128i U	= rgb_to_chroma_sse2(R2, G2, B2, -38, -74, 112);
+		__m128i V	= rgb_to_chroma_sse2(R2, G2, B2, 112, -94, -18);
+
+		// U and V fit the low byte of their lane, so this is U0 V0 U1 V1 ... in memory order
+		__m128i UV	= _mm_or_si128(U, _mm_slli_epi16(V, 8));
+		_mm_storeu_si128((__m128i*)(dest + x * 2),		_mm_unpacklo_epi8(Y, UV));
+		_mm_storeu_si128((__m128i*)(dest + x * 2 + 16),	_mm_unpackhi_epi8(Y, UV));
+	}
+
+	debayer_yuyv_pairs(frame_width, row, x, frame_width, bg_row, dest);
+}
+
+PS3EYE_TARGET_SSE2 static void debayer_yuv420_row_sse2(int frame_width, const uint8_t* row0, bool bg_row0, const uint8_t* row1, bool bg_row1, bool inNV12, uint8_t* dest_y0, uint8_t* dest_y1, uint8_t* dest_u, uint8_t* dest_v)
+{
+	const __m128i two = _mm_set1_epi16(2);
+
+	debayer_yuv420_blocks(frame_width, row0, bg_row0, row1, bg_row1, 0, 2, inNV12, dest_y0, dest_y1, dest_u, dest_v);
+
+	int x = 2;
+	for (int last_x = (frame_width - 17) & ~1; x <= last_x; x = next_block(x, 16, last_x))
+	{
+		__m128i R0, G0, B0, R1, G1, B1;
+		debayer_block_sse2(row0 - frame_width, row0, row0 + frame_width, x, bg_row0, R0, G0, B0);
+		debayer_block_sse2(row1 - frame_width, row1, row1 + frame_width, x, bg_row1, R1, G1, B1);
+
+		_mm_storeu_si128((__m128i*)(dest_y0 + x), rgb_to_y_sse2(R0, G0, B0));
+		_mm_storeu_si128((__m128i*)(dest_y1 + x), rgb_to_y_sse2(R1, G1, B1));
+
+		__m128i R	= _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(pair_sum_sse2(R0), pair_sum_sse2(R1)), two), 2);
+		__m128i G	= _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(pair_sum_sse2(G0), pair_sum_sse2(G1)), two), 2);
+		__m128i B	= _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(pair_sum_sse2(B0), pair_sum_sse2(B1)), two), 2);
+		__m128i U	= rgb_to_chroma_sse2(R, G, B, -38, -74, 112);
+		__m128i V	= rgb_to_chroma_sse2(R, G, B, 112, -94, -18);
+
+		if (inNV12)
+		{
+			_mm_storeu_si128((__m128i*)(dest_u + x), _mm_or_si128(U, _mm_slli_epi16(V, 8)));
+		}
+		else
+		{
+			_mm_storel_epi64((__m128i*)(dest_u + (x >> 1)), _mm_packus_epi16(U, U));
+			_mm_storel_epi64((__m128i*)(dest_v + (x >> 1)), _mm_packus_epi16(V, V));
+		}
+	}
+
+	debayer_yuv420_blocks(frame_width, row0, bg_row0, row1, bg_row1, x, frame_width, inNV12, dest_y0, dest_y1, dest_u, dest_v);
+}
+
+// Collapse 16 quads (32 source pixels) starting at source pixel x
+PS3EYE_TARGET_SSE2 static inline void debayer_half_block_sse2(const uint8_t* gr_row, const uint8_t* bg_row, int x, __m128i& R, __m128i& G, __m128i& B)
+{
+	const __m128i low = _mm_set1_epi16(0x00FF);
+
+	__m128i gr0 = _mm_loadu_si128((const __m128i*)(gr_row + x));
+	__m128i gr1 = _mm_loadu_si128((const __m128i*)(gr_row + x + 16));
+	__m128i bg0 = _mm_loadu_si128((const __m128i*)(bg_row + x));
+	__m128i bg1 = _mm_loadu_si128((const __m128i*)(bg_row + x + 16));
+
+	R = _mm_packus_epi16(_mm_srli_epi16(gr0, 8), _mm_srli_epi16(gr1, 8));
+	B = _mm_packus_epi16(_mm_and_si128(bg0, low), _mm_and_si128(bg1, low));
+	G = _mm_avg_epu8(_mm_packus_epi16(_mm_and_si128(gr0, low), _mm_and_si128(gr1, low)),
+					 _mm_packus_epi16(_mm_srli_epi16(bg0, 8), _mm_srli_epi16(bg1, 8)));
+}
+
+PS3EYE_TARGET_SSE2 static void debayer_half_gray_row_sse2(int out_width, const uint8_t* gr_row, const uint8_t* bg_row, uint8_t* dest)
+{
+	int x = 0;
+	for (int last_x = out_width - 16; x <= last_x; x = next_block(x, 16, last_x))
+	{
+		__m128i R, G, B;
+		debayer_half_block_sse2(gr_row, bg_row, x * 2, R, G, B);
+		_mm_storeu_si128((__m128i*)(dest + x), luma_sse2(R, G, B));
+	}
+
+	debayer_half_gray_pixels(gr_row, bg_row, x, out_width, dest);
+}
+
+template <bool BGR>
+PS3EYE_TARGET_SSE2 static void debayer_half_rgb_row_sse2(int out_width, const uint8_t* gr_row, const uint8_t* bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	int x = 0;
+	for (int last_x = out_width - 16; x <= last_x; x = next_block(x, 16, last_x))
+	{
+		__m128i R, G, B;
+		debayer_half_block_sse2(gr_row, bg_row, x * 2, R, G, B);
+		store_color_sse2<3, BGR>(dest + x * 3, R, G, B, false, matrix);
+	}
+
+	debayer_half_rgb_pixels<BGR>(gr_row, bg_row, x, out_width, matrix, dest);
+}
+
+PS3EYE_TARGET_SSE2 static void downsample_gray_row_sse2(int out_width, const uint8_t* row0, const uint8_t* row1, uint8_t* dest)
+{
+	const __m128i two = _mm_set1_epi16(2);
+
+	int x = 0;
+	for (int last_x = out_width - 16; x <= last_x; x = next_block(x, 16, last_x))
+	{
+		__m128i sum0 = _mm_add_epi16(pair_sum_sse2(_mm_loadu_si128((const __m128i*)(row0 + 2 * x))), pair_sum_sse2(_mm_loadu_si128((const __m128i*)(row1 + 2 * x))));
+		__m128i sum1 = _mm_add_epi16(pair_sum_sse2(_mm_loadu_si128((const __m128i*)(row0 + 2 * x + 16))), pair_sum_sse2(_mm_loadu_si128((const __m128i*)(row1 + 2 * x + 16))));
+		_mm_storeu_si128((__m128i*)(dest + x), _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(sum0, two), 2), _mm_srli_epi16(_mm_add_epi16(sum1, two), 2)));
+	}
+
+	downsample_gray_pixels(row0, row1, x, out_width, dest);
+}
+
+// The high quality filters of 8 pixels from their neighbourhood terms, in signed 16-bit lanes
+PS3EYE_TARGET_SSE2 static inline void debayer_hq_filters_sse2(__m128i center, __m128i hor1, __m128i hor2, __m128i ver1, __m128i ver2, __m128i diag,
+															   __m128i& green, __m128i& same_row, __m128i& same_col, __m128i& opposite)
+{
+	// The rounding is folded into the center terms
+	__m128i center8		= _mm_add_epi16(_mm_slli_epi16(center, 3), _mm_set1_epi16(8));
+	__m128i center10	= _mm_add_epi16(center8, _mm_slli_epi16(center, 1));
+	__m128i center12	= _mm_add_epi16(center8, _mm_slli_epi16(center, 2));
+	__m128i outer		= _mm_add_epi16(hor2, ver2);
+	__m128i diag2		= _mm_slli_epi16(diag, 1);
+
+	green		= _mm_sub_epi16(_mm_add_epi16(center8, _mm_slli_epi16(_mm_add_epi16(hor1, ver1), 2)), _mm_slli_epi16(outer, 1));
+	same_row	= _mm_add_epi16(_mm_sub_epi16(_mm_add_epi16(center10, _mm_slli_epi16(hor1, 3)), _mm_add_epi16(_mm_slli_epi16(hor2, 1), diag2)), ver2);
+	same_col	= _mm_add_epi16(_mm_sub_epi16(_mm_add_epi16(center10, _mm_slli_epi16(ver1, 3)), _mm_add_epi16(_mm_slli_epi16(ver2, 1), diag2)), hor2);
+	opposite	= _mm_sub_epi16(_mm_add_epi16(center12, _mm_slli_epi16(diag, 2)), _mm_add_epi16(outer, _mm_slli_epi16(outer, 1)));
+
+	green		= _mm_srai_epi16(green, 4);
+	same_row	= _mm_srai_epi16(same_row, 4);
+	same_col	= _mm_srai_epi16(same_col, 4);
+	opposite	= _mm_srai_epi16(opposite, 4);
+}
+
+// The source bytes around 16 pixels of a row, loaded once for both halves of the block
+struct HQTapsSSE2
+{
+	__m128i above2, above1_l, above1_c, above1_r, row_l2, row_l1, row_c, row_r1, row_r2, below1_l, below1_c, below1_r, below2;
+};
+
+// Widen the low (High = false) or high 8 bytes of v to 16-bit lanes
+template <bool High>
+PS3EYE_TARGET_SSE2 static inline __m128i widen_sse2(__m128i v)
+{
+	return High ? _mm_unpackhi_epi8(v, _mm_setzero_si128()) : _mm_unpacklo_epi8(v, _mm_setzero_si128());
+}
+
+// The high quality filters of the low or high 8 pixels of a block
+template <bool High>
+PS3EYE_TARGET_SSE2 static inline void debayer_hq_half_sse2(const HQTapsSSE2& taps, __m128i& green, __m128i& same_row, __m128i& same_col, __m128i& opposite)
+{
+	__m128i center	= widen_sse2<High>(taps.row_c);
+	__m128i hor1	= _mm_add_epi16(widen_sse2<High>(taps.row_l1), widen_sse2<High>(taps.row_r1));
+	__m128i hor2	= _mm_add_epi16(widen_sse2<High>(taps.row_l2), widen_sse2<High>(taps.row_r2));
+	__m128i ver1	= _mm_add_epi16(widen_sse2<High>(taps.above1_c), widen_sse2<High>(taps.below1_c));
+	__m128i ver2	= _mm_add_epi16(widen_sse2<High>(taps.above2), widen_sse2<High>(taps.below2));
+	__m128i diag	= _mm_add_epi16(_mm_add_epi16(widen_sse2<High>(taps.above1_l), widen_sse2<High>(taps.above1_r)),
+									_mm_add_epi16(widen_sse2<High>(taps.below1_l), widen_sse2<High>(taps.below1_r)));
+	debayer_hq_filters_sse2(center, hor1, hor2, ver1, ver2, diag, green, same_row, same_col, opposite);
+}
+
+// High quality demosaic of 16 pixels starting at even x, with x - 2 and x + 17 inside the row
+PS3EYE_TARGET_SSE2 static inline void debayer_hq_block_sse2(const uint8_t* const* rows, int x, bool bg_row, __m128i& R, __m128i& G, __m128i& B)
+{
+	HQTapsSSE2 taps;
+	taps.above2		= _mm_loadu_si128((const __m128i*)(rows[0] + x));
+	taps.above1_l	= _mm_loadu_si128((const __m128i*)(rows[1] + x - 1));
+	taps.above1_c	= _mm_loadu_si128((const __m128i*)(rows[1] + x));
+	taps.above1_r	= _mm_loadu_si128((const __m128i*)(rows[1] + x + 1));
+	taps.row_l2		= _mm_loadu_si128((const __m128i*)(rows[2] + x - 2));
+	taps.row_l1		= _mm_loadu_si128((const __m128i*)(rows[2] + x - 1));
+	taps.row_c		= _mm_loadu_si128((const __m128i*)(rows[2] + x));
+	taps.row_r1		= _mm_loadu_si128((const __m128i*)(rows[2] + x + 1));
+	taps.row_r2		= _mm_loadu_si128((const __m128i*)(rows[2] + x + 2));
+	taps.below1_l	= _mm_loadu_si128((const __m128i*)(rows[3] + x - 1));
+	taps.below1_c	= _mm_loadu_si128((const __m128i*)(rows[3] + x));
+	taps.below1_r	= _mm_loadu_si128((const __m128i*)(rows[3] + x + 1));
+	taps.below2		= _mm_loadu_si128((const __m128i*)(rows[4] + x));
+
+	__m128i green_lo, same_row_lo, same_col_lo, opposite_lo;
+	__m128i green_hi, same_row_hi, same_col_hi, opposite_hi;
+	debayer_hq_half_sse2<false>(taps, green_lo, same_row_lo, same_col_lo, opposite_lo);
+	debayer_hq_half_sse2<true>(taps, green_hi, same_row_hi, same_col_hi, opposite_hi);
+
+	// Packing clamps to [0, 255]
+	__m128i green		= _mm_packus_epi16(green_lo, green_hi);
+	__m128i same_row	= _mm_packus_epi16(same_row_lo, same_row_hi);
+	__m128i same_col	= _mm_packus_epi16(same_col_lo, same_col_hi);
+	__m128i opposite	= _mm_packus_epi16(opposite_lo, opposite_hi);
+
+	const __m128i even = _mm_set1_epi16(0x00FF);
+	if (bg_row)
+	{
+		B = select_sse2(even, taps.row_c, same_row);
+		G = select_sse2(even, green, taps.row_c);
+		R = select_sse2(even, opposite, same_col);
+	}
+	else
+	{
+		B = select_sse2(even, same_col, opposite);
+		G = select_sse2(even, taps.row_c, green);
+		R = select_sse2(even, same_row, taps.row_c);
+	}
+}
+
+template <int Channels, bool BGR>
+PS3EYE_TARGET_SSE2 static void debayer_hq_row_sse2(int frame_width, const uint8_t* const* rows, bool bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	int x = 0;
+	int last_x = (frame_width - 18) & ~1;
+	if (last_x >= 2)
+	{
+		// The two pixels at either end mirror their neighbours
+		debayer_hq_pixels<Channels, BGR>(frame_width, rows, 0, 2, bg_row, matrix, dest);
+		for (x = 2; x <= last_x; x = next_block(x, 16, last_x))
+		{
+			__m128i R, G, B;
+			debayer_hq_block_sse2(rows, x, bg_row, R, G, B);
+			store_color_sse2<Channels, BGR>(dest + x * Channels, R, G, B, false, matrix);
+		}
+	}
+
+	debayer_hq_pixels<Channels, BGR>(frame_width, rows, x, frame_width, bg_row, matrix, dest);
+}
+
+// The pixels are scaled in place, so the last block can't overlap the one before it and the tail is scalar
+PS3EYE_TARGET_SSE2 static inline __m128i apply_gains_epu16_sse2(__m128i v, __m128i gains)
+{
+	v = _mm_slli_epi16(v, 4);
+	return _mm_add_epi16(_mm_mulhi_epu16(v, gains), _mm_srli_epi16(_mm_mullo_epi16(v, gains), 15));
+}
+
+PS3EYE_TARGET_SSE2 static void apply_gains_sse2(uint8_t* pixels, const uint16_t* gains, int count)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	int x = 0;
+	for (; x + 16 <= count; x += 16)
+	{
+		__m128i v	= _mm_loadu_si128((const __m128i*)(pixels + x));
+		__m128i lo	= apply_gains_epu16_sse2(_mm_unpacklo_epi8(v, zero), _mm_loadu_si128((const __m128i*)(gains + x)));
+		__m128i hi	= apply_gains_epu16_sse2(_mm_unpackhi_epi8(v, zero), _mm_loadu_si128((const __m128i*)(gains + x + 8)));
+		_mm_storeu_si128((__m128i*)(pixels + x), _mm_packus_epi16(lo, hi));
+	}
+
+	apply_gains_pixels(pixels, gains, x, count);
+}
+
+PS3EYE_TARGET_SSE2 static inline __m128i denoise_epu16_sse2(__m128i pixels, __m128i averages, __m128i diffs, __m128i strength, __m128i slope)
+{
+	__m128i weights = _mm_sub_epi16(strength, _mm_mullo_epi16(diffs, slope));
+	__m128i samples = _mm_unpacklo_epi8(_mm_set1_epi8((char)0x80), pixels);
+	samples = _mm_mulhi_epu16(samples, _mm_xor_si128(weights, _mm_set1_epi16(-1)));
+	return _mm_add_epi16(_mm_mulhi_epu16(averages, weights), samples);
+}
+
+// In place like apply_gains_sse2. The differences are taken on bytes, against the integer parts of the averages.
+PS3EYE_TARGET_SSE2 static void denoise_sse2(uint8_t* pixels, uint16_t* averages, int count, uint16_t strength, uint16_t slope, uint8_t threshold)
+{
+	__m128i zero		= _mm_setzero_si128();
+	__m128i strength16	= _mm_set1_epi16((short)strength);
+	__m128i slope16		= _mm_set1_epi16((short)slope);
+	__m128i threshold8	= _mm_set1_epi8((char)threshold);
+
+	int x = 0;
+	for (; x + 16 <= count; x += 16)
+	{
+		__m128i v		= _mm_loadu_si128((const __m128i*)(pixels + x));
+		__m128i lo		= _mm_loadu_si128((const __m128i*)(averages + x));
+		__m128i hi		= _mm_loadu_si128((const __m128i*)(averages + x + 8));
+		__m128i prev	= _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+		__m128i diffs	= _mm_min_epu8(_mm_or_si128(_mm_subs_epu8(v, prev), _mm_subs_epu8(prev, v)), threshold8);
+		lo = denoise_epu16_sse2(v, lo, _mm_unpacklo_epi8(diffs, zero), strength16, slope16);
+		hi = denoise_epu16_sse2(_mm_unpackhi_epi64(v, v), hi, _mm_unpackhi_epi8(diffs, zero), strength16, slope16);
+		_mm_storeu_si128((__m128i*)(averages + x), lo);
+		_mm_storeu_si128((__m128i*)(averages + x + 8), hi);
+		_mm_storeu_si128((__m128i*)(pixels + x), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+
+	denoise_pixels(pixels, averages, x, count, strength, slope, threshold);
+}
+
+// AVX2
+
+PS3EYE_TARGET_AVX2 static inline __m256i avg4_avx2(__m256i a, __m256i b, __m256i c, __m256i d)
+{
+	const __m256i one = _mm256_set1_epi8(1);
+
+	__m256i ab		= _mm256_avg_epu8(a, b);
+	__m256i cd		= _mm256_avg_epu8(c, d);
+	__m256i error	= _mm256_and_si256(_mm256_and_si256(_mm256_or_si256(_mm256_xor_si256(a, b), _mm256_xor_si256(c, d)), _mm256_xor_si256(ab, cd)), one);
+	return _mm256_sub_epi8(_mm256_avg_epu8(ab, cd), error);
+}
+
+// Demosaic 32 pixels starting at even x
+PS3EYE_TARGET_AVX2 static inline void debayer_block_avx2(const uint8_t* above, const uint8_t* row, const uint8_t* below, int x, bool bg_row, __m256i& R, __m256i& G, __m256i& B)
+{
+	__m256i a_l = _mm256_loadu_si256((const __m256i*)(above + x - 1));
+	__m256i a_c = _mm256_loadu_si256((const __m256i*)(above + x));
+	__m256i a_r = _mm256_loadu_si256((const __m256i*)(above + x + 1));
+	__m256i r_l = _mm256_loadu_si256((const __m256i*)(row + x - 1));
+	__m256i r_c = _mm256_loadu_si256((const __m256i*)(row + x));
+	__m256i r_r = _mm256_loadu_si256((const __m256i*)(row + x + 1));
+	__m256i b_l = _mm256_loadu_si256((const __m256i*)(below + x - 1));
+	__m256i b_c = _mm256_loadu_si256((const __m256i*)(below + x));
+	__m256i b_r = _mm256_loadu_si256((const __m256i*)(below + x + 1));
+
+	__m256i hor2	= _mm256_avg_epu8(r_l, r_r);
+	__m256i ver2	= _mm256_avg_epu8(a_c, b_c);
+	__m256i cross4	= avg4_avx2(a_c, r_l, r_r, b_c);
+	__m256i diag4	= avg4_avx2(a_l, a_r, b_l, b_r);
+
+	const __m256i even = _mm256_set1_epi16(0x00FF);
+	if (bg_row)
+	{
+		B = _mm256_blendv_epi8(hor2, r_c, even);
+		G = _mm256_blendv_epi8(r_c, cross4, even);
+		R = _mm256_blendv_epi8(ver2, diag4, even);
+	}
+	else
+	{
+		B = _mm256_blendv_epi8(diag4, ver2, even);
+		G = _mm256_blendv_epi8(cross4, r_c, even);
+		R = _mm256_blendv_epi8(r_c, hor2, even);
+	}
+}
+
+PS3EYE_TARGET_AVX2 static inline __m256i luma_avx2(__m256i R, __m256i G, __m256i B)
+{
+	const __m256i zero	= _mm256_setzero_si256();
+	const __m256i kr	= _mm256_set1_epi16(77);
+	const __m256i kg	= _mm256_set1_epi16(151);
+	const __m256i kb	= _mm256_set1_epi16(28);
+
+	__m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(R, zero), kr),
+												   _mm256_mullo_epi16(_mm256_unpacklo_epi8(G, zero), kg)),
+								  _mm256_mullo_epi16(_mm256_unpacklo_epi8(B, zero), kb));
+	__m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(R, zero), kr),
+												   _mm256_mullo_epi16(_mm256_unpackhi_epi8(G, zero), kg)),
+								  _mm256_mullo_epi16(_mm256_unpackhi_epi8(B, zero), kb));
+	return _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+}
+
+// Interleave 16 pixels of three planes into 48 bytes
+PS3EYE_TARGET_SSSE3 static inline void store_rgb_ssse3(uint8_t* dest, __m128i c0, __m128i c1, __m128i c2)
+{
+	const __m128i m00 = _mm_setr_epi8( 0,-1,-1, 1,-1,-1, 2,-1,-1, 3,-1,-1, 4,-1,-1, 5);
+	const __m128i m01 = _mm_setr_epi8(-1, 0,-1,-1, 1,-1,-1, 2,-1,-1, 3,-1,-1, 4,-1,-1);
+	const __m128i m02 = _mm_setr_epi8(-1,-1, 0,-1,-1, 1,-1,-1, 2,-1,-1, 3,-1,-1, 4,-1);
+	const __m128i m10 = _mm_setr_epi8(-1,-1, 6,-1,-1, 7,-1,-1, 8,-1,-1, 9,-1,-1,10,-1);
+	const __m128i m11 = _mm_setr_epi8( 5,-1,-1, 6,-1,-1, 7,-1,-1, 8,-1,-1, 9,-1,-1,10);
+	const __m128i m12 = _mm_setr_epi8(-1, 5,-1,-1, 6,-1,-1, 7,-1,-1, 8,-1,-1, 9,-1,-1);
+	const __m128i m20 = _mm_setr_epi8(-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1,-1);
+	const __m128i m21 = _mm_setr_epi8(-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1);
+	const __m128i m22 = _mm_setr_epi8(10,-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15);
+
+	__m128i out0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c0, m00), _mm_shuffle_epi8(c1, m01)), _mm_shuffle_epi8(c2, m02));
+	__m128i out1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c0, m10), _mm_shuffle_epi8(c1, m11)), _mm_shuffle_epi8(c2, m12));
+	__m128i out2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c0, m20), _mm_shuffle_epi8(c1, m21)), _mm_shuffle_epi8(c2, m22));
+
+	_mm_storeu_si128((__m128i*)dest, out0);
+	_mm_storeu_si128((__m128i*)(dest + 16), out1);
+	_mm_storeu_si128((__m128i*)(dest + 32), out2);
+}
+
+PS3EYE_TARGET_AVX2 static inline void store_rgb_avx2(uint8_t* dest, __m256i c0, __m256i c1, __m256i c2)
+{
+	store_rgb_ssse3(dest,		_mm256_castsi256_si128(c0), _mm256_castsi256_si128(c1), _mm256_castsi256_si128(c2));
+	store_rgb_ssse3(dest + 48,	_mm256_extracti128_si256(c0, 1), _mm256_extracti128_si256(c1, 1), _mm256_extracti128_si256(c2, 1));
+}
+
+PS3EYE_TARGET_AVX2 static void debayer_gray_row_avx2(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t* dest)
+{
+	debayer_gray_pixels(above, row, below, 1, 2, bg_row, dest);
+
+	int x = 2;
+	for (int last_x = (frame_width - 33) & ~1; x <= last_x; x = next_block(x, 32, last_x))
+	{
+		__m256i R, G, B;
+		debayer_block_avx2(above, row, below, x, bg_row, R, G, B);
+		_mm256_storeu_si256((__m256i*)(dest + x), luma_avx2(R, G, B));
+	}
+
+	debayer_gray_pixels(above, row, below, x, frame_width - 1, bg_row, dest);
+}
+
+PS3EYE_TARGET_AVX2 static void debayer_mask_row_avx2(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t threshold, uint8_t* dest)
+{
+	debayer_mask_pixels(above, row, below, 1, 2, bg_row, threshold, dest);
+
+	const __m256i threshold_vec = _mm256_set1_epi8((char)threshold);
+	int x = 2;
+	for (int last_x = (frame_width - 33) & ~1; x <= last_x; x = next_block(x, 32, last_x))
+	{
+		__m256i R, G, B;
+		debayer_block_avx2(above, row, below, x, bg_row, R, G, B);
+		__m256i gray = luma_avx2(R, G, B);
+		_mm256_storeu_si256((__m256i*)(dest + x), _mm256_cmpeq_epi8(_mm256_max_epu8(gray, threshold_vec), gray));
+	}
+
+	debayer_mask_pixels(above, row, below, x, frame_width - 1, bg_row, threshold, dest);
+}
+
+PS3EYE_TARGET_AVX2 static void pack_mask_bits_avx2(const uint8_t* mask, int width, uint8_t* dest)
+{
+	int x = 0;
+	for (; x + 32 <= width; x += 32)
+	{
+		uint32_t bits = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(mask + x)));
+		memcpy(dest + x / 8, &bits, 4);
+	}
+	pack_mask_bits(mask, x, width, dest);
+}
+
+// Interleave 32 pixels of three planes and an opaque alpha into 128 bytes
+PS3EYE_TARGET_AVX2 static inline void store_rgba_avx2(uint8_t* dest, __m256i c0, __m256i c1, __m256i c2, bool aligned)
+{
+	const __m256i alpha = _mm256_set1_epi8(-1);
+
+	// The unpacks work within 128-bit lanes, so each result holds 4 pixels of the lower 16 and 4 of the upper 16
+	__m256i c01_lo	= _mm256_unpacklo_epi8(c0, c1);
+	__m256i c01_hi	= _mm256_unpackhi_epi8(c0, c1);
+	__m256i c2a_lo	= _mm256_unpacklo_epi8(c2, alpha);
+	__m256i c2a_hi	= _mm256_unpackhi_epi8(c2, alpha);
+
+	__m256i p0_16	= _mm256_unpacklo_epi16(c01_lo, c2a_lo);	// pixels 0-3, 16-19
+	__m256i p4_20	= _mm256_unpackhi_epi16(c01_lo, c2a_lo);	// pixels 4-7, 20-23
+	__m256i p8_24	= _mm256_unpacklo_epi16(c01_hi, c2a_hi);	// pixels 8-11, 24-27
+	__m256i p12_28	= _mm256_unpackhi_epi16(c01_hi, c2a_hi);	// pixels 12-15, 28-31
+
+	__m256i out0 = _mm256_permute2x128_si256(p0_16, p4_20, 0x20);
+	__m256i out1 = _mm256_permute2x128_si256(p8_24, p12_28, 0x20);
+	__m256i out2 = _mm256_permute2x128_si256(p0_16, p4_20, 0x31);
+	__m256i out3 = _mm256_permute2x128_si256(p8_24, p12_28, 0x31);
+
+	if (aligned)
+	{
+		_mm256_store_si256((__m256i*)dest, out0);
+		_mm256_store_si256((__m256i*)(dest + 32), out1);
+		_mm256_store_si256((__m256i*)(dest + 64), out2);
+		_mm256_store_si256((__m256i*)(dest + 96), out3);
+	}
+	else
+	{
+		_mm256_storeu_si256((__m256i*)dest, out0);
+		_mm256_storeu_si256((__m256i*)(dest + 32), out1);
+		_mm256_storeu_si256((__m256i*)(dest + 64), out2);
+		_mm256_storeu_si256((__m256i*)(dest + 96), out3);
+	}
+}
+
+// Multiply 32 pixels by a color matrix, like color_matrix_sse2. The unpacks and packs work within 128-bit lanes,
+// so the pixels end up in their original order.
+PS3EYE_TARGET_AVX2 static inline void color_matrix_avx2(const ColorMatrix& matrix, __m256i& R, __m256i& G, __m256i& B)
+{
+	__m256i zero	= _mm256_setzero_si256();
+	__m256i one		= _mm256_set1_epi16(1);
+	__m256i R_lo	= _mm256_unpacklo_epi8(R, zero);
+	__m256i R_hi	= _mm256_unpackhi_epi8(R, zero);
+	__m256i G_lo	= _mm256_unpacklo_epi8(G, zero);
+	__m256i G_hi	= _mm256_unpackhi_epi8(G, zero);
+	__m256i B_lo	= _mm256_unpacklo_epi8(B, zero);
+	__m256i B_hi	= _mm256_unpackhi_epi8(B, zero);
+	__m256i RG[4]	= { _mm256_unpacklo_epi16(R_lo, G_lo), _mm256_unpackhi_epi16(R_lo, G_lo), _mm256_unpacklo_epi16(R_hi, G_hi), _mm256_unpackhi_epi16(R_hi, G_hi) };
+	__m256i B1[4]	= { _mm256_unpacklo_epi16(B_lo, one), _mm256_unpackhi_epi16(B_lo, one), _mm256_unpacklo_epi16(B_hi, one), _mm256_unpackhi_epi16(B_hi, one) };
+
+	__m256i out[3];
+	const int16_t* c = matrix.coefficients;
+	for (int channel = 0; channel < 3; ++channel, c += 3)
+	{
+		__m256i coef_rg	= _mm256_set1_epi32((uint16_t)c[0] | (uint32_t)(uint16_t)c[1] << 16);
+		__m256i coef_b1	= _mm256_set1_epi32((uint16_t)c[2] | (uint32_t)1 << (ColorMatrix::FRACTION_BITS - 1 + 16));
+		__m256i sums[4];
+		for (int index = 0; index < 4; ++index)
+			sums[index] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(RG[index], coef_rg), _mm256_madd_epi16(B1[index], coef_b1)), ColorMatrix::FRACTION_BITS);
+		out[channel] = _mm256_packus_epi16(_mm256_packs_epi32(sums[0], sums[1]), _mm256_packs_epi32(sums[2], sums[3]));
+	}
+
+	R = out[0];
+	G = out[1];
+	B = out[2];
+}
+
+// Store 32 pixels of a Channels byte output format, multiplied by matrix first unless it is NULL
+template <int Channels, bool BGR>
+PS3EYE_TARGET_AVX2 static inline void store_color_avx2(uint8_t* dest, __m256i R, __m256i G, __m256i B, bool aligned, const ColorMatrix* matrix)
+{
+	if (matrix)
+		color_matrix_avx2(*matrix, R, G, B);
+
+	if (Channels == 4)
+		store_rgba_avx2(dest, BGR ? B : R, G, BGR ? R : B, aligned);
+	else
+		store_rgb_avx2(dest, BGR ? B : R, G, BGR ? R : B);
+}
+
+template <int Channels, bool BGR>
+PS3EYE_TARGET_AVX2 static void debayer_color_row_avx2(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	int x = 1;
+	int last_x = (frame_width - 33) & ~1;
+	if (last_x >= 2)
+	{
+		// Same as the SSE2 version, with 32-byte alignment
+		int aligned_x = Channels == 4 ? first_aligned_rgba_x(dest, 2, 32) : -1;
+		bool aligned = aligned_x >= 0;
+		if (!aligned)
+			aligned_x = 2;
+
+		debayer_color_pixels<Channels, BGR>(above, row, below, 1, aligned_x, bg_row, matrix, dest);
+		for (x = aligned_x; x <= last_x; x += 32)
+		{
+			__m256i R, G, B;
+			debayer_block_avx2(above, row, below, x, bg_row, R, G, B);
+			store_color_avx2<Channels, BGR>(dest + x * Channels, R, G, B, aligned, matrix);
+		}
+		if (x < last_x + 32)
+		{
+			__m256i R, G, B;
+			debayer_block_avx2(above, row, below, last_x, bg_row, R, G, B);
+			store_color_avx2<Channels, BGR>(dest + last_x * Channels, R, G, B, false, matrix);
+		}
+		x = last_x + 32;
+	}
+
+	debayer_color_pixels<Channels, BGR>(above, row, below, x, frame_width - 1, bg_row, matrix, dest);
+}
+
+PS3EYE_TARGET_AVX2 static inline __m256i rgb_to_y_avx2(__m256i R, __m256i G, __m256i B)
+{
+	const __m256i zero	= _mm256_setzero_si256();
+	const __m256i kr	= _mm256_set1_epi16(66);
+	const __m256i kg	= _mm256_set1_epi16(129);
+	const __m256i kb	= _mm256_set1_epi16(25);
+	const __m256i round	= _mm256_set1_epi16(128);
+	const __m256i bias	= _mm256_set1_epi8(16);
+
+	__m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(R, zero), kr),
+												   _mm256_mullo_epi16(_mm256_unpacklo_epi8(G, zero), kg)),
+								  _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(B, zero), kb), round));
+	__m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(R, zero), kr),
+												   _mm256_mullo_epi16(_mm256_unpackhi_epi8(G, zero), kg)),
+								  _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(B, zero), kb), round));
+	return _mm256_add_epi8(_mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)), bias);
+}
+
+PS3EYE_TARGET_AVX2 static inline __m256i rgb_to_chroma_avx2(__m256i R, __m256i G, __m256i B, short kr, short kg, short kb)
+{
+	__m256i sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(R, _mm256_set1_epi16(kr)), _mm256_mullo_epi16(G, _mm256_set1_epi16(kg))),
+								   _mm256_add_epi16(_mm256_mullo_epi16(B, _mm256_set1_epi16(kb)), _mm256_set1_epi16(128)));
+	return _mm256_add_epi16(_mm256_srai_epi16(sum, 8), _mm256_set1_epi16(128));
+}
+
+PS3EYE_TARGET_AVX2 static inline __m256i pair_sum_avx2(__m256i c)
+{
+	return _mm256_add_epi16(_mm256_and_si256(c, _mm256_set1_epi16(0x00FF)), _mm256_srli_epi16(c, 8));
+}
+
+PS3EYE_TARGET_AVX2 static void debayer_yuyv_row_avx2(int frame_width, const uint8_t* above, const uint8_t* row, const uint8_t* below, bool bg_row, uint8_t* dest)
+{
+	const __m256i one = _mm256_set1_epi16(1);
+
+	debayer_yuyv_pairs(frame_width, row, 0, 2, bg_row, dest);
+
+	int x = 2;
+	for (int last_x = (frame_width - 33) & ~1; x <= last_x; x = next_block(x, 32, last_x))
+	{
+		__m256i R, G, B;
+		debayer_block_avx2(above, row, below, x, bg_row, R, G, B);
+
+		__m256i Y	= rgb_to_y_avx2(R, G, B);
+		__m256i R2	= _mm256_srli_epi16(_mm256_add_epi16(pair_sum_avx2(R), one), 1);
+		__m256i G2	= _mm256_srli_epi16(_mm256_add_epi16(pair_sum_avx2(G), one), 1);
+		__m256i B2	= _mm256_srli_epi16(_mm256_add_epi16(pair_sum_avx2(B), one), 1);
+		__m256i UV	= _mm256_or_si256(rgb_to_chroma_avx2(R2, G2, B2, -38, -74, 112), _mm256_slli_epi16(rgb_to_chroma_avx2(R2, G2, B2, 112, -94, -18), 8));
+
+		// The unpacks work within 128-bit lanes, giving pixels 0-7 | 16-23 and 8-15 | 24-31
+		__m256i lo	= _mm256_unpacklo_epi8(Y, UV);
+		__m256i hi	= _mm256_unpackhi_epi8(Y, UV);
+		_mm256_storeu_si256((__m256i*)(dest + x * 2),		_mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(dest + x * 2 + 32),	_mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	debayer_yuyv_pairs(frame_width, row, x, frame_width, bg_row, dest);
+}
+
+PS3EYE_TARGET_AVX2 static void debayer_yuv420_row_avx2(int frame_width, const uint8_t* row0, bool bg_row0, const uint8_t* row1, bool bg_row1, bool inNV12, uint8_t* dest_y0, uint8_t* dest_y1, uint8_t* dest_u, uint8_t* dest_v)
+{
+	const __m256i two = _mm256_set1_epi16(2);
+
+	debayer_yuv420_blocks(frame_width, row0, bg_row0, row1, bg_row1, 0, 2, inNV12, dest_y0, dest_y1, dest_u, dest_v);
+
+	int x = 2;
+	for (int last_x = (frame_width - 33) & ~1; x <= last_x; x = next_block(x, 32, last_x))
+	{
+		__m256i R0, G0, B0, R1, G1, B1;
+		debayer_block_avx2(row0 - frame_width, row0, row0 + frame_width, x, bg_row0, R0, G0, B0);
+		debayer_block_avx2(row1 - frame_width, row1, row1 + frame_width, x, bg_row1, R1, G1, B1);
+
+		_mm256_storeu_si256((__m256i*)(dest_y0 + x), rgb_to_y_avx2(R0, G0, B0));
+		_mm256_storeu_si256((__m256i*)(dest_y1 + x), rgb_to_y_avx2(R1, G1, B1));
+
+		__m256i R	= _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(pair_sum_avx2(R0), pair_sum_avx2(R1)), two), 2);
+		__m256i G	= _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(pair_sum_avx2(G0), pair_sum_avx2(G1)), two), 2);
+		__m256i B	= _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(pair_sum_avx2(B0), pair_sum_avx2(B1)), two), 2);
+		__m256i U	= rgb_to_chroma_avx2(R, G, B, -38, -74, 112);
+		__m256i V	= rgb_to_chroma_avx2(R, G, B, 112, -94, -18);
+
+		if (inNV12)
+		{
+			_mm256_storeu_si256((__m256i*)(dest_u + x), _mm256_or_si256(U, _mm256_slli_epi16(V, 8)));
+		}
+		else
+		{
+			// packus works within 128-bit lanes: U0-7 V0-7 | U8-15 V8-15, reorder to U0-15 | V0-15
+			__m256i UV = _mm256_permute4x64_epi64(_mm256_packus_epi16(U, V), 0xD8);
+			_mm_storeu_si128((__m128i*)(dest_u + (x >> 1)), _mm256_castsi256_si128(UV));
+			_mm_storeu_si128((__m128i*)(dest_v + (x >> 1)), _mm256_extracti128_si256(UV, 1));
+		}
+	}
+
+	debayer_yuv420_blocks(frame_width, row0, bg_row0, row1, bg_row1, x, frame_width, inNV12, dest_y0, dest_y1, dest_u, dest_v);
+}
+
+// Collapse 32 quads (64 source pixels) starting at source pixel x
+PS3EYE_TARGET_AVX2 static inline void debayer_half_block_avx2(const uint8_t* gr_row, const uint8_t* bg_row, int x, __m256i& R, __m256i& G, __m256i& B)
+{
+	const __m256i low = _mm256_set1_epi16(0x00FF);
+
+	__m256i gr0 = _mm256_loadu_si256((const __m256i*)(gr_row + x));
+	__m256i gr1 = _mm256_loadu_si256((const __m256i*)(gr_row + x + 32));
+	__m256i bg0 = _mm256_loadu_si256((const __m256i*)(bg_row + x));
+	__m256i bg1 = _mm256_loadu_si256((const __m256i*)(bg_row + x + 32));
+
+	// packus works within 128-bit lanes, giving quads 0-7 16-23 | 8-15 24-31; the permute puts them back in order
+	R = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(gr0, 8), _mm256_srli_epi16(gr1, 8)), 0xD8);
+	B = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(bg0, low), _mm256_and_si256(bg1, low)), 0xD8);
+	G = _mm256_permute4x64_epi64(_mm256_avg_epu8(_mm256_packus_epi16(_mm256_and_si256(gr0, low), _mm256_and_si256(gr1, low)),
+												 _mm256_packus_epi16(_mm256_srli_epi16(bg0, 8), _mm256_srli_epi16(bg1, 8))), 0xD8);
+}
+
+PS3EYE_TARGET_AVX2 static void debayer_half_gray_row_avx2(int out_width, const uint8_t* gr_row, const uint8_t* bg_row, uint8_t* dest)
+{
+	int x = 0;
+	for (int last_x = out_width - 32; x <= last_x; x = next_block(x, 32, last_x))
+	{
+		__m256i R, G, B;
+		debayer_half_block_avx2(gr_row, bg_row, x * 2, R, G, B);
+		_mm256_storeu_si256((__m256i*)(dest + x), luma_avx2(R, G, B));
+	}
+
+	debayer_half_gray_pixels(gr_row, bg_row, x, out_width, dest);
+}
+
+template <bool BGR>
+PS3EYE_TARGET_AVX2 static void debayer_half_rgb_row_avx2(int out_width, const uint8_t* gr_row, const uint8_t* bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	int x = 0;
+	for (int last_x = out_width - 32; x <= last_x; x = next_block(x, 32, last_x))
+	{
+		__m256i R, G, B;
+		debayer_half_block_avx2(gr_row, bg_row, x * 2, R, G, B);
+		store_color_avx2<3, BGR>(dest + x * 3, R, G, B, false, matrix);
+	}
+
+	debayer_half_rgb_pixels<BGR>(gr_row, bg_row, x, out_width, matrix, dest);
+}
+
+PS3EYE_TARGET_AVX2 static void downsample_gray_row_avx2(int out_width, const uint8_t* row0, const uint8_t* row1, uint8_t* dest)
+{
+	const __m256i two = _mm256_set1_epi16(2);
+
+	int x = 0;
+	for (int last_x = out_width - 32; x <= last_x; x = next_block(x, 32, last_x))
+	{
+		__m256i sum0 = _mm256_add_epi16(pair_sum_avx2(_mm256_loadu_si256((const __m256i*)(row0 + 2 * x))), pair_sum_avx2(_mm256_loadu_si256((const __m256i*)(row1 + 2 * x))));
+		__m256i sum1 = _mm256_add_epi16(pair_sum_avx2(_mm256_loadu_si256((const __m256i*)(row0 + 2 * x + 32))), pair_sum_avx2(_mm256_loadu_si256((const __m256i*)(row1 + 2 * x + 32))));
+		// packus works within 128-bit lanes; the permute puts the pixels back in order
+		__m256i gray = _mm256_packus_epi16(_mm256_srli_epi16(_mm256_add_epi16(sum0, two), 2), _mm256_srli_epi16(_mm256_add_epi16(sum1, two), 2));
+		_mm256_storeu_si256((__m256i*)(dest + x), _mm256_permute4x64_epi64(gray, 0xD8));
+	}
+
+	downsample_gray_pixels(row0, row1, x, out_width, dest);
+}
+
+// The 3 byte color pixels don't split into byte pairs like gray does. Instead, the sums of bytes i and i + 3 of both rows
+// are computed for 16 bytes per lane, and the ones that start a pixel pair (bytes 0-2, 6-8 and 12-14) give 3 output pixels
+// per lane. The even and odd bytes are summed in separate 16-bit lanes, so that only the final compaction needs a shuffle.
+// This needs pshufb, so the SSE2 path uses the scalar kernel.
+PS3EYE_TARGET_AVX2 static inline __m256i load_pixel_pairs_avx2(const uint8_t* row, int x)
+{
+	// Lane 0 holds pixel pairs x to x + 2, lane 1 pixel pairs x + 3 to x + 5
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(row + x * 6))), _mm_loadu_si128((const __m128i*)(row + x * 6 + 18)), 1);
+}
+
+PS3EYE_TARGET_AVX2 static void downsample_color_row_avx2(int out_width, const uint8_t* row0, const uint8_t* row1, uint8_t* dest)
+{
+	const __m256i low		= _mm256_set1_epi16(0x00FF);
+	const __m256i two		= _mm256_set1_epi16(2);
+	const __m256i compact	= _mm256_setr_epi8(0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1,
+											   0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1);
+
+	// Every block stores 6 pixels as two 16 byte halves, each followed by 7 bytes that are overwritten by the next half,
+	// the next block or the remaining pixels
+	int x = 0;
+	for (; (x + 6) * 3 + 7 <= out_width * 3; x += 6)
+	{
+		__m256i a = load_pixel_pairs_avx2(row0, x);
+		__m256i b = load_pixel_pairs_avx2(row0 + 3, x);
+		__m256i c = load_pixel_pairs_avx2(row1, x);
+		__m256i d = load_pixel_pairs_avx2(row1 + 3, x);
+
+		__m256i even = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low)), _mm256_add_epi16(_mm256_and_si256(c, low), _mm256_and_si256(d, low)));
+		__m256i odd = _mm256_add_epi16(_mm256_add_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), _mm256_add_epi16(_mm256_srli_epi16(c, 8), _mm256_srli_epi16(d, 8)));
+		__m256i avg = _mm256_or_si256(_mm256_srli_epi16(_mm256_add_epi16(even, two), 2), _mm256_slli_epi16(_mm256_srli_epi16(_mm256_add_epi16(odd, two), 2), 8));
+		avg = _mm256_shuffle_epi8(avg, compact);
+
+		_mm_storeu_si128((__m128i*)(dest + x * 3), _mm256_castsi256_si128(avg));
+		_mm_storeu_si128((__m128i*)(dest + x * 3 + 9), _mm256_extracti128_si256(avg, 1));
+	}
+
+	downsample_color_pixels(row0, row1, x, out_width, dest);
+}
+
+// Gather the source pixels of the 8 output pixels at positions: the 4 bytes starting at each source pixel in its row
+// (upper) and in the row below (lower), and if SourceChannels is 3, those of the right neighbours as well. Pixels
+// whose source is outside the frame are masked out of the gathers and get zeroes, which blend to black.
+template <int SourceChannels>
+PS3EYE_TARGET_AVX2 static inline void remap_gather_avx2(const int32_t* positions, const uint8_t* ring, const int32_t* row_offsets,
+														__m256i& upper, __m256i& upper_next, __m256i& lower, __m256i& lower_next)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	__m256i position	= _mm256_loadu_si256((const __m256i*)positions);
+	__m256i valid		= _mm256_cmpgt_epi32(position, _mm256_set1_epi32(-1));
+	__m256i source_y	= _mm256_srai_epi32(position, 16);
+	__m256i source_x	= _mm256_and_si256(position, _mm256_set1_epi32(0xFFFF));
+	if (SourceChannels == 3)
+		source_x = _mm256_add_epi32(source_x, _mm256_add_epi32(source_x, source_x));
+
+	__m256i upper_offset = _mm256_add_epi32(_mm256_mask_i32gather_epi32(zero, (const int*)row_offsets, source_y, valid, 4), source_x);
+	__m256i lower_offset = _mm256_add_epi32(_mm256_mask_i32gather_epi32(zero, (const int*)(row_offsets + 1), source_y, valid, 4), source_x);
+
+	upper = _mm256_mask_i32gather_epi32(zero, (const int*)ring, upper_offset, valid, 1);
+	lower = _mm256_mask_i32gather_epi32(zero, (const int*)ring, lower_offset, valid, 1);
+	if (SourceChannels == 3)
+	{
+		upper_next = _mm256_mask_i32gather_epi32(zero, (const int*)(ring + 3), upper_offset, valid, 1);
+		lower_next = _mm256_mask_i32gather_epi32(zero, (const int*)(ring + 3), lower_offset, valid, 1);
+	}
+}
+
+// The horizontal blend is a maddubs of the source bytes interleaved with their right neighbours' and the weights 32 - fx
+// and fx, the vertical one a 16-bit multiply-add, which can't overflow as both steps are rounded to 8 bits
+PS3EYE_TARGET_AVX2 static void remap_gray_row_avx2(int out_width, const int32_t* positions, const uint16_t* fractions, const uint8_t* ring, const int32_t* row_offsets, uint8_t* dest)
+{
+	const __m256i thirty_two	= _mm256_set1_epi32(32);
+	const __m256i sixteen		= _mm256_set1_epi16(16);
+
+	int x = 0;
+	for (int last_x = out_width - 8; x <= last_x; x = next_block(x, 8, last_x))
+	{
+		// The bytes of a gray pixel and its right neighbour are already next to each other
+		__m256i upper, lower, unused;
+		remap_gather_avx2<1>(positions + x, ring, row_offsets, upper, unused, lower, unused);
+
+		__m256i fraction	= _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(fractions + x)));
+		__m256i fx			= _mm256_and_si256(fraction, _mm256_set1_epi32(0xFF));
+		__m256i fy			= _mm256_srli_epi32(fraction, 8);
+		__m256i weights_x	= _mm256_or_si256(_mm256_sub_epi32(thirty_two, fx), _mm256_slli_epi32(fx, 8));
+		__m256i weights_y	= _mm256_or_si256(_mm256_sub_epi32(thirty_two, fy), _mm256_slli_epi32(fy, 16));
+
+		// Only the low 16 bits of every pixel are used, the high ones stay 0
+		__m256i top		= _mm256_srli_epi16(_mm256_add_epi16(_mm256_maddubs_epi16(upper, weights_x), sixteen), 5);
+		__m256i bottom	= _mm256_srli_epi16(_mm256_add_epi16(_mm256_maddubs_epi16(lower, weights_x), sixteen), 5);
+		__m256i gray	= _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_or_si256(top, _mm256_slli_epi32(bottom, 16)), weights_y), _mm256_set1_epi32(16)), 5);
+
+		// Pixels 0-3 end up in the low 4 bytes of the first lane, pixels 4-7 in those of the second
+		gray = _mm256_packus_epi16(_mm256_packus_epi32(gray, gray), _mm256_setzero_si256());
+		int32_t low		= _mm_cvtsi128_si32(_mm256_castsi256_si128(gray));
+		int32_t high	= _mm_cvtsi128_si32(_mm256_extracti128_si256(gray, 1));
+		memcpy(dest + x, &low, 4);
+		memcpy(dest + x + 4, &high, 4);
+	}
+
+	remap_pixels<1>(positions, fractions, ring, row_offsets, x, out_width, dest);
+}
+
+// Like remap_gray_row_avx2, on the channels of two pixels per 64 bits: each pixel's 4 gathered bytes are interleaved
+// with its right neighbour's, and the 4th channel is ignored
+template <int Channels>
+PS3EYE_TARGET_AVX2 static void remap_color_row_avx2(int out_width, const int32_t* positions, const uint16_t* fractions, const uint8_t* ring, const int32_t* row_offsets, uint8_t* dest)
+{
+	const __m256i thirty_two	= _mm256_set1_epi32(32);
+	const __m256i sixteen		= _mm256_set1_epi16(16);
+
+	int x = 0;
+	for (int last_x = out_width - 8; x <= last_x; x = next_block(x, 8, last_x))
+	{
+		__m256i upper, upper_next, lower, lower_next;
+		remap_gather_avx2<3>(positions + x, ring, row_offsets, upper, upper_next, lower, lower_next);
+
+		// The weights of every pixel repeated in all four 16-bit lanes of its channels. The unpacks put pixels
+		// 0, 1, 4 and 5 in the low halves and pixels 2, 3, 6 and 7 in the high ones, as they do with the source bytes.
+		__m256i fraction	= _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(fractions + x)));
+		__m256i fx			= _mm256_and_si256(fraction, _mm256_set1_epi32(0xFF));
+		__m256i fy			= _mm256_srli_epi32(fraction, 8);
+		__m256i weights_x	= _mm256_or_si256(_mm256_sub_epi32(thirty_two, fx), _mm256_slli_epi32(fx, 8));
+		__m256i weights_y0	= _mm256_sub_epi32(thirty_two, fy);
+		weights_x			= _mm256_or_si256(weights_x, _mm256_slli_epi32(weights_x, 16));
+		weights_y0			= _mm256_or_si256(weights_y0, _mm256_slli_epi32(weights_y0, 16));
+		__m256i weights_y1	= _mm256_or_si256(fy, _mm256_slli_epi32(fy, 16));
+
+		__m256i top_lo		= _mm256_srli_epi16(_mm256_add_epi16(_mm256_maddubs_epi16(_mm256_unpacklo_epi8(upper, upper_next), _mm256_unpacklo_epi32(weights_x, weights_x)), sixteen), 5);
+		__m256i top_hi		= _mm256_srli_epi16(_mm256_add_epi16(_mm256_maddubs_epi16(_mm256_unpackhi_epi8(upper, upper_next), _mm256_unpackhi_epi32(weights_x, weights_x)), sixteen), 5);
+		__m256i bottom_lo	= _mm256_srli_epi16(_mm256_add_epi16(_mm256_maddubs_epi16(_mm256_unpacklo_epi8(lower, lower_next), _mm256_unpacklo_epi32(weights_x, weights_x)), sixteen), 5);
+		__m256i bottom_hi	= _mm256_srli_epi16(_mm256_add_epi16(_mm256_maddubs_epi16(_mm256_unpackhi_epi8(lower, lower_next), _mm256_unpackhi_epi32(weights_x, weights_x)), sixteen), 5);
+
+		__m256i color_lo	= _mm256_add_epi16(_mm256_mullo_epi16(top_lo, _mm256_unpacklo_epi32(weights_y0, weights_y0)), _mm256_mullo_epi16(bottom_lo, _mm256_unpacklo_epi32(weights_y1, weights_y1)));
+		__m256i color_hi	= _mm256_add_epi16(_mm256_mullo_epi16(top_hi, _mm256_unpackhi_epi32(weights_y0, weights_y0)), _mm256_mullo_epi16(bottom_hi, _mm256_unpackhi_epi32(weights_y1, weights_y1)));
+		color_lo			= _mm256_srli_epi16(_mm256_add_epi16(color_lo, sixteen), 5);
+		color_hi			= _mm256_srli_epi16(_mm256_add_epi16(color_hi, sixteen), 5);
+
+		// Pixels 0-3 in the first lane and 4-7 in the second, 4 bytes each
+		__m256i pixels = _mm256_packus_epi16(color_lo, color_hi);
+		if (Channels == 4)
+		{
+			_mm256_storeu_si256((__m256i*)(dest + x * 4), _mm256_or_si256(pixels, _mm256_set1_epi32((int)0xFF000000)));
+		}
+		else
+		{
+			store_4x3_sse2(dest + x * 3, _mm256_castsi256_si128(pixels));
+			store_4x3_sse2(dest + x * 3 + 12, _mm256_extracti128_si256(pixels, 1));
+		}
+	}
+
+	remap_pixels<Channels>(positions, fractions, ring, row_offsets, x, out_width, dest);
+}
+
+PS3EYE_TARGET_AVX2 static inline void debayer_hq_filters_avx2(__m256i center, __m256i hor1, __m256i hor2, __m256i ver1, __m256i ver2, __m256i diag,
+															   __m256i& green, __m256i& same_row, __m256i& same_col, __m256i& opposite)
+{
+	__m256i center8		= _mm256_add_epi16(_mm256_slli_epi16(center, 3), _mm256_set1_epi16(8));
+	__m256i center10	= _mm256_add_epi16(center8, _mm256_slli_epi16(center, 1));
+	__m256i center12	= _mm256_add_epi16(center8, _mm256_slli_epi16(center, 2));
+	__m256i outer		= _mm256_add_epi16(hor2, ver2);
+	__m256i diag2		= _mm256_slli_epi16(diag, 1);
+
+	green		= _mm256_sub_epi16(_mm256_add_epi16(center8, _mm256_slli_epi16(_mm256_add_epi16(hor1, ver1), 2)), _mm256_slli_epi16(outer, 1));
+	same_row	= _mm256_add_epi16(_mm256_sub_epi16(_mm256_add_epi16(center10, _mm256_slli_epi16(hor1, 3)), _mm256_add_epi16(_mm256_slli_epi16(hor2, 1), diag2)), ver2);
+	same_col	= _mm256_add_epi16(_mm256_sub_epi16(_mm256_add_epi16(center10, _mm256_slli_epi16(ver1, 3)), _mm256_add_epi16(_mm256_slli_epi16(ver2, 1), diag2)), hor2);
+	opposite	= _mm256_sub_epi16(_mm256_add_epi16(center12, _mm256_slli_epi16(diag, 2)), _mm256_add_epi16(outer, _mm256_slli_epi16(outer, 1)));
+
+	green		= _mm256_srai_epi16(green, 4);
+	same_row	= _mm256_srai_epi16(same_row, 4);
+	same_col	= _mm256_srai_epi16(same_col, 4);
+	opposite	= _mm256_srai_epi16(opposite, 4);
+}
+
+struct HQTapsAVX2
+{
+	__m256i above2, above1_l, above1_c, above1_r, row_l2, row_l1, row_c, row_r1, row_r2, below1_l, below1_c, below1_r, below2;
+};
+
+// The unpacks work within 128-bit lanes, so the low half holds bytes 0-7 and 16-23 and the high half 8-15 and 24-31,
+// which packing puts back in order
+template <bool High>
+PS3EYE_TARGET_AVX2 static inline __m256i widen_avx2(__m256i v)
+{
+	return High ? _mm256_unpackhi_epi8(v, _mm256_setzero_si256()) : _mm256_unpacklo_epi8(v, _mm256_setzero_si256());
+}
+
+template <bool High>
+PS3EYE_TARGET_AVX2 static inline void debayer_hq_half_avx2(const HQTapsAVX2& taps, __m256i& green, __m256i& same_row, __m256i& same_col, __m256i& opposite)
+{
+	__m256i center	= widen_avx2<High>(taps.row_c);
+	__m256i hor1	= _mm256_add_epi16(widen_avx2<High>(taps.row_l1), widen_avx2<High>(taps.row_r1));
+	__m256i hor2	= _mm256_add_epi16(widen_avx2<High>(taps.row_l2), widen_avx2<High>(taps.row_r2));
+	__m256i ver1	= _mm256_add_epi16(widen_avx2<High>(taps.above1_c), widen_avx2<High>(taps.below1_c));
+	__m256i ver2	= _mm256_add_epi16(widen_avx2<High>(taps.above2), widen_avx2<High>(taps.below2));
+	__m256i diag	= _mm256_add_epi16(_mm256_add_epi16(widen_avx2<High>(taps.above1_l), widen_avx2<High>(taps.above1_r)),
+									   _mm256_add_epi16(widen_avx2<High>(taps.below1_l), widen_avx2<High>(taps.below1_r)));
+	debayer_hq_filters_avx2(center, hor1, hor2, ver1, ver2, diag, green, same_row, same_col, opposite);
+}
+
+// High quality demosaic of 32 pixels starting at even x, with x - 2 and x + 33 inside the row
+PS3EYE_TARGET_AVX2 static inline void debayer_hq_block_avx2(const uint8_t* const* rows, int x, bool bg_row, __m256i& R, __m256i& G, __m256i& B)
+{
+	HQTapsAVX2 taps;
+	taps.above2		= _mm256_loadu_si256((const __m256i*)(rows[0] + x));
+	taps.above1_l	= _mm256_loadu_si256((const __m256i*)(rows[1] + x - 1));
+	taps.above1_c	= _mm256_loadu_si256((const __m256i*)(rows[1] + x));
+	taps.above1_r	= _mm256_loadu_si256((const __m256i*)(rows[1] + x + 1));
+	taps.row_l2		= _mm256_loadu_si256((const __m256i*)(rows[2] + x - 2));
+	taps.row_l1		= _mm256_loadu_si256((const __m256i*)(rows[2] + x - 1));
+	taps.row_c		= _mm256_loadu_si256((const __m256i*)(rows[2] + x));
+	taps.row_r1		= _mm256_loadu_si256((const __m256i*)(rows[2] + x + 1));
+	taps.row_r2		= _mm256_loadu_si256((const __m256i*)(rows[2] + x + 2));
+	taps.below1_l	= _mm256_loadu_si256((const __m256i*)(rows[3] + x - 1));
+	taps.below1_c	= _mm256_loadu_si256((const __m256i*)(rows[3] + x));
+	taps.below1_r	= _mm256_loadu_si256((const __m256i*)(rows[3] + x + 1));
+	taps.below2		= _mm256_loadu_si256((const __m256i*)(rows[4] + x));
+
+	__m256i green_lo, same_row_lo, same_col_lo, opposite_lo;
+	__m256i green_hi, same_row_hi, same_col_hi, opposite_hi;
+	debayer_hq_half_avx2<false>(taps, green_lo, same_row_lo, same_col_lo, opposite_lo);
+	debayer_hq_half_avx2<true>(taps, green_hi, same_row_hi, same_col_hi, opposite_hi);
+
+	__m256i green		= _mm256_packus_epi16(green_lo, green_hi);
+	__m256i same_row	= _mm256_packus_epi16(same_row_lo, same_row_hi);
+	__m256i same_col	= _mm256_packus_epi16(same_col_lo, same_col_hi);
+	__m256i opposite	= _mm256_packus_epi16(opposite_lo, opposite_hi);
+
+	const __m256i even = _mm256_set1_epi16(0x00FF);
+	if (bg_row)
+	{
+		B = _mm256_blendv_epi8(same_row, taps.row_c, even);
+		G = _mm256_blendv_epi8(taps.row_c, green, even);
+		R = _mm256_blendv_epi8(same_col, opposite, even);
+	}
+	else
+	{
+		B = _mm256_blendv_epi8(opposite, same_col, even);
+		G = _mm256_blendv_epi8(green, taps.row_c, even);
+		R = _mm256_blendv_epi8(taps.row_c, same_row, even);
+	}
+}
+
+template <int Channels, bool BGR>
+PS3EYE_TARGET_AVX2 static void debayer_hq_row_avx2(int frame_width, const uint8_t* const* rows, bool bg_row, const ColorMatrix* matrix, uint8_t* dest)
+{
+	int x = 0;
+	int last_x = (frame_width - 34) & ~1;
+	if (last_x >= 2)
+	{
+		debayer_hq_pixels<Channels, BGR>(frame_width, rows, 0, 2, bg_row, matrix, dest);
+		for (x = 2; x <= last_x; x = next_block(x, 32, last_x))
+		{
+			__m256i R, G, B;
+			debayer_hq_block_avx2(rows, x, bg_row, R, G, B);
+			store_color_avx2<Channels, BGR>(dest + x * Channels, R, G, B, false, matrix);
+		}
+	}
+
+	debayer_hq_pixels<Channels, BGR>(frame_width, rows, x, frame_width, bg_row, matrix, dest);
+}
+
+PS3EYE_TARGET_AVX2 static inline __m256i apply_gains_epu16_avx2(__m256i v, __m256i gains)
+{
+	v = _mm256_slli_epi16(v, 4);
+	return _mm256_add_epi16(_mm256_mulhi_epu16(v, gains), _mm256_srli_epi16(_mm256_mullo_epi16(v, gains), 15));
+}
+
+PS3EYE_TARGET_AVX2 static void apply_gains_avx2(uint8_t* pixels, const uint16_t* gains, int count)
+{
+	__m256i zero = _mm256_setzero_si256();
+
+	int x = 0;
+	for (; x + 32 <= count; x += 32)
+	{
+		// The unpacks work within 128-bit lanes, so pixels 0-7 and 16-23 are in lo, and the gains are permuted to match
+		__m256i v		= _mm256_loadu_si256((const __m256i*)(pixels + x));
+		__m256i gain0	= _mm256_loadu_si256((const __m256i*)(gains + x));
+		__m256i gain1	= _mm256_loadu_si256((const __m256i*)(gains + x + 16));
+		__m256i lo		= apply_gains_epu16_avx2(_mm256_unpacklo_epi8(v, zero), _mm256_permute2x128_si256(gain0, gain1, 0x20));
+		__m256i hi		= apply_gains_epu16_avx2(_mm256_unpackhi_epi8(v, zero), _mm256_permute2x128_si256(gain0, gain1, 0x31));
+		_mm256_storeu_si256((__m256i*)(pixels + x), _mm256_packus_epi16(lo, hi));
+	}
+
+	apply_gains_pixels(pixels, gains, x, count);
+}
+
+PS3EYE_TARGET_AVX2 static inline __m256i denoise_epu16_avx2(__m256i pixels, __m256i averages, __m256i diffs, __m256i strength, __m256i slope)
+{
+	__m256i weights = _mm256_sub_epi16(strength, _mm256_mullo_epi16(diffs, slope));
+	__m256i samples = _mm256_unpacklo_epi8(_mm256_set1_epi8((char)0x80), pixels);
+	samples = _mm256_mulhi_epu16(samples, _mm256_xor_si256(weights, _mm256_set1_epi16(-1)));
+	return _mm256_add_epi16(_mm256_mulhi_epu16(averages, weights), samples);
+}
+
+PS3EYE_TARGET_AVX2 static void denoise_avx2(uint8_t* pixels, uint16_t* averages, int count, uint16_t strength, uint16_t slope, uint8_t threshold)
+{
+	__m256i zero		= _mm256_setzero_si256();
+	__m256i strength16	= _mm256_set1_epi16((short)strength);
+	__m256i slope16		= _mm256_set1_epi16((short)slope);
+	__m256i threshold8	= _mm256_set1_epi8((char)threshold);
+
+	int x = 0;
+	for (; x + 32 <= count; x += 32)
+	{
+		// The unpacks and packs work within 128-bit lanes, so lo holds the averages of pixels 0-7 and 16-23 and hi those
+		// of pixels 8-15 and 24-31. Packing them gives the pixels back in order.
+		__m256i v		= _mm256_loadu_si256((const __m256i*)(pixels + x));
+		__m256i avg0	= _mm256_loadu_si256((const __m256i*)(averages + x));
+		__m256i avg1	= _mm256_loadu_si256((const __m256i*)(averages + x + 16));
+		__m256i lo		= _mm256_permute2x128_si256(avg0, avg1, 0x20);
+		__m256i hi		= _mm256_permute2x128_si256(avg0, avg1, 0x31);
+		__m256i prev	= _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+		__m256i diffs	= _mm256_min_epu8(_mm256_or_si256(_mm256_subs_epu8(v, prev), _mm256_subs_epu8(prev, v)), threshold8);
+		lo = denoise_epu16_avx2(v, lo, _mm256_unpacklo_epi8(diffs, zero), strength16, slope16);
+		hi = denoise_epu16_avx2(_mm256_unpackhi_epi64(v, v), hi, _mm256_unpackhi_epi8(diffs, zero), strength16, slope16);
+		_mm256_storeu_si256((__m256i*)(averages + x), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(averages + x + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+		_mm256_storeu_si256((__m256i*)(pixels + x), _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+	}
+
+	denoise_pixels(pixels, averages, x, count, strength, slope, threshold);
+}
+
+static void cpuid(int leaf, int subleaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuidex(info, leaf, subleaf);
+	for (int i = 0; i < 4; ++i)
+		regs[i] = (uint32_t)info[i];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t xgetbv0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static EDebayerISA detect_isa()
+{
+	uint32_t regs[4];
+
+	cpuid(0, 0, regs);
+	uint32_t max_leaf = regs[0];
+	if (max_leaf < 1)
+		return EDebayerISA::Scalar;
+
+	cpuid(1, 0, regs);
+	bool sse2		= (regs[3] & (1u << 26)) != 0;
+	bool ssse3		= (regs[2] & (1u << 9)) != 0;
+	bool osxsave	= (regs[2] & (1u << 27)) != 0;
+	bool avx		= (regs[2] & (1u << 28)) != 0;
+	if (!sse2)
+		return EDebayerISA::Scalar;
+
+	// AVX2 also needs the OS to save the YMM registers on context switch
+	if (ssse3 && osxsave && avx && max_leaf >= 7 && (xgetbv0() & 0x6) == 0x6)
+	{
+		cpuid(7, 0, regs);
+		if (regs[1] & (1u << 5))
+			return EDebayerISA::AVX2;
+	}
+
+	return EDebayerISA::SSE2;
+}
+
+#else
+
+static EDebayerISA detect_isa()
+{
+	return EDebayerISA::Scalar;
+}
+
+#endif // PS3EYE_HAVE_X86_SIMD
+
+EDebayerISA GetBestDebayerISA()
+{
+	static const EDebayerISA best_isa = detect_isa();
+	return best_isa;
+}
+
+static std::atomic<int> current_isa(-1);
+
+EDebayerISA GetDebayerISA()
+{
+	int isa = current_isa.load(std::memory_order_relaxed);
+	return isa < 0 ? GetBestDebayerISA() : (EDebayerISA)isa;
+}
+
+void SetDebayerISA(EDebayerISA isa)
+{
+	if ((int)isa > (int)GetBestDebayerISA())
+		isa = GetBestDebayerISA();
+	current_isa.store((int)isa, std::memory_order_relaxed);
+}
+
+static DebayerGrayRowFunc get_gray_row_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return debayer_gray_row_avx2;
+	case EDebayerISA::SSE2:
+		return debayer_gray_row_sse2;
+#endif
+	default:
+		return debayer_gray_row_scalar;
+	}
+}
+
+static DebayerMaskRowFunc get_mask_row_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return debayer_mask_row_avx2;
+	case EDebayerISA::SSE2:
+		return debayer_mask_row_sse2;
+#endif
+	default:
+		return debayer_mask_row_scalar;
+	}
+}
+
+static PackMaskBitsFunc get_pack_mask_bits_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return pack_mask_bits_avx2;
+	case EDebayerISA::SSE2:
+		return pack_mask_bits_sse2;
+#endif
+	default:
+		return pack_mask_bits_scalar;
+	}
+}
+
+template <int Channels, bool BGR>
+static DebayerColorRowFunc get_color_row_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return debayer_color_row_avx2<Channels, BGR>;
+	case EDebayerISA::SSE2:
+		return debayer_color_row_sse2<Channels, BGR>;
+#endif
+	default:
+		return debayer_color_row_scalar<Channels, BGR>;
+	}
+}
+
+static DebayerColorRowFunc get_color_row_func(int channels, bool inBGR)
+{
+	if (channels == 4)
+		return inBGR ? get_color_row_func<4, true>() : get_color_row_func<4, false>();
+	return inBGR ? get_color_row_func<3, true>() : get_color_row_func<3, false>();
+}
+
+template <int Channels, bool BGR>
+static DebayerHQRowFunc get_hq_row_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return debayer_hq_row_avx2<Channels, BGR>;
+	case EDebayerISA::SSE2:
+		return debayer_hq_row_sse2<Channels, BGR>;
+#endif
+	default:
+		return debayer_hq_row_scalar<Channels, BGR>;
+	}
+}
+
+static DebayerHQRowFunc get_hq_row_func(int channels, bool inBGR)
+{
+	if (channels == 4)
+		return inBGR ? get_hq_row_func<4, true>() : get_hq_row_func<4, false>();
+	return inBGR ? get_hq_row_func<3, true>() : get_hq_row_func<3, false>();
+}
+
+static DebayerHalfGrayRowFunc get_half_gray_row_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return debayer_half_gray_row_avx2;
+	case EDebayerISA::SSE2:
+		return debayer_half_gray_row_sse2;
+#endif
+	default:
+		return debayer_half_gray_row_scalar;
+	}
+}
+
+template <bool BGR>
+static DebayerHalfRGBRowFunc get_half_rgb_row_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return debayer_half_rgb_row_avx2<BGR>;
+	case EDebayerISA::SSE2:
+		return debayer_half_rgb_row_sse2<BGR>;
+#endif
+	default:
+		return debayer_half_rgb_row_scalar<BGR>;
+	}
+}
+
+static DownsampleGrayRowFunc get_downsample_gray_row_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return downsample_gray_row_avx2;
+	case EDebayerISA::SSE2:
+		return downsample_gray_row_sse2;
+#endif
+	default:
+		return downsample_gray_row_scalar;
+	}
+}
+
+static DownsampleColorRowFunc get_downsample_color_row_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return downsample_color_row_avx2;
+#endif
+	default:
+		return downsample_color_row_scalar;
+	}
+}
+
+static RemapRowFunc get_remap_row_func(int channels)
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		if (channels == 1)
+			return remap_gray_row_avx2;
+		return channels == 4 ? remap_color_row_avx2<4> : remap_color_row_avx2<3>;
+#endif
+	default:
+		if (channels == 1)
+			return remap_row_scalar<1>;
+		return channels == 4 ? remap_row_scalar<4> : remap_row_scalar<3>;
+	}
+}
+
+static DebayerYUYVRowFunc get_yuyv_row_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return debayer_yuyv_row_avx2;
+	case EDebayerISA::SSE2:
+		return debayer_yuyv_row_sse2;
+#endif
+	default:
+		return debayer_yuyv_row_scalar;
+	}
+}
+
+static DebayerYUV420RowFunc get_yuv420_row_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return debayer_yuv420_row_avx2;
+	case EDebayerISA::SSE2:
+		return debayer_yuv420_row_sse2;
+#endif
+	default:
+		return debayer_yuv420_row_scalar;
+	}
+}
+
+static ApplyGainsFunc get_apply_gains_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return apply_gains_avx2;
+	case EDebayerISA::SSE2:
+		return apply_gains_sse2;
+#endif
+	default:
+		return apply_gains_scalar;
+	}
+}
+
+static DenoiseFunc get_denoise_func()
+{
+	switch (GetDebayerISA())
+	{
+#ifdef PS3EYE_HAVE_X86_SIMD
+	case EDebayerISA::AVX2:
+		return denoise_avx2;
+	case EDebayerISA::SSE2:
+		return denoise_sse2;
+#endif
+	default:
+		return denoise_scalar;
+	}
+}
+
+// The first and last output row are copies of their inner neighbours, so they are computed from the same
+// source rows. This way every output row only depends on the source frame and row bands are independent.
+static inline int debayer_source_row(int y, int frame_height)
+{
+	return y < 1 ? 1 : (y > frame_height - 2 ? frame_height - 2 : y);
+}
+
+// Compute gray row y into dest, including the first and last pixel
+static inline void debayer_gray_row(DebayerGrayRowFunc row_func, int frame_width, int frame_height, const uint8_t* inBayer, int y, uint8_t* dest)
+{
+	int source_y		= debayer_source_row(y, frame_height);
+	const uint8_t* row	= inBayer + source_y * frame_width;
+
+	row_func(frame_width, row - frame_width, row, row + frame_width, (source_y & 1) != 0, dest);
+
+	dest[0]					= dest[1];
+	dest[frame_width - 1]	= dest[frame_width - 2];
+}
+
+// Look up the color channels of width pixels in lut. Alpha is left alone.
+template <int Channels>
+static void apply_color_lut_pixels(const ColorLUT& lut, int width, bool inBGR, uint8_t* dest)
+{
+	const uint8_t* first	= inBGR ? lut.blue : lut.red;
+	const uint8_t* green	= lut.green;
+	const uint8_t* last		= inBGR ? lut.red : lut.blue;
+
+	for (int x = 0; x < width; ++x, dest += Channels)
+	{
+		dest[0] = first[dest[0]];
+		dest[1] = green[dest[1]];
+		dest[2] = last[dest[2]];
+	}
+}
+
+// Apply lut, if any, to a color row that was just computed and is still in L1. Table lookups don't vectorize
+// (SSE2 and AVX2 have no byte gather), but the scalar loop is only a small fraction of the demosaic.
+static inline void apply_color_lut(const ColorLUT* lut, int width, int channels, bool inBGR, uint8_t* dest)
+{
+	if (!lut)
+		return;
+	if (channels == 4)
+		apply_color_lut_pixels<4>(*lut, width, inBGR, dest);
+	else
+		apply_color_lut_pixels<3>(*lut, width, inBGR, dest);
+}
+
+// Compute color row y of channels bytes per pixel into dest, including the first and last pixel
+static inline void debayer_color_row(DebayerColorRowFunc row_func, int frame_width, int frame_height, const uint8_t* inBayer, int channels, bool inBGR,
+									 const ColorMatrix* matrix, const ColorLUT* lut, int y, uint8_t* dest)
+{
+	int source_y		= debayer_source_row(y, frame_height);
+	const uint8_t* row	= inBayer + source_y * frame_width;
+	int dest_row_bytes	= frame_width * channels;
+
+	row_func(frame_width, row - frame_width, row, row + frame_width, (source_y & 1) != 0, matrix, dest);
+
+	memcpy(dest, dest + channels, channels);
+	memcpy(dest + dest_row_bytes - channels, dest + dest_row_bytes - 2 * channels, channels);
+	apply_color_lut(lut, frame_width, channels, inBGR, dest);
+}
+
+void DebayerGrayRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int row_begin, int row_end)
+{
+	DebayerGrayRowFunc row_func = get_gray_row_func();
+
+	for (int y = row_begin; y < row_end; ++y)
+		debayer_gray_row(row_func, frame_width, frame_height, inBayer, y, outBuffer + y * outStride);
+}
+
+// Compute mask row y into dest, frame_width bytes of 0/0xFF
+static inline void debayer_mask_row(DebayerMaskRowFunc row_func, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t threshold, int y, uint8_t* dest)
+{
+	int source_y		= debayer_source_row(y, frame_height);
+	const uint8_t* row	= inBayer + source_y * frame_width;
+
+	row_func(frame_width, row - frame_width, row, row + frame_width, (source_y & 1) != 0, threshold, dest);
+
+	dest[0]					= dest[1];
+	dest[frame_width - 1]	= dest[frame_width - 2];
+}
+
+void DebayerMaskRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, uint8_t threshold, bool inBits, int row_begin, int row_end)
+{
+	DebayerMaskRowFunc row_func = get_mask_row_func();
+	PackMaskBitsFunc pack_func	= get_pack_mask_bits_func();
+
+	// Bit masks go through a single row of mask bytes, which stays in L1
+	std::vector<uint8_t> line(inBits ? frame_width : 0);
+	for (int y = row_begin; y < row_end; ++y)
+	{
+		uint8_t* dest = outBuffer + y * outStride;
+		if (!inBits)
+		{
+			debayer_mask_row(row_func, frame_width, frame_height, inBayer, threshold, y, dest);
+			continue;
+		}
+
+		debayer_mask_row(row_func, frame_width, frame_height, inBayer, threshold, y, line.data());
+		pack_func(line.data(), frame_width, dest);
+	}
+}
+
+// Append the runs of set bits of a bit-packed mask row. Whole 64 pixel words that are all clear or all set are skipped at once.
+static void append_mask_row_runs(const uint8_t* bits, int width, int y, std::vector<MaskRun>& runs)
+{
+	int run_begin = -1;
+	for (int x = 0; x < width; )
+	{
+		if ((x & 63) == 0 && x + 64 <= width)
+		{
+			uint64_t word;
+			memcpy(&word, bits + x / 8, 8);
+			if (word == (run_begin < 0 ? 0 : ~(uint64_t)0))
+			{
+				x += 64;
+				continue;
+			}
+		}
+
+		bool set = ((bits[x / 8] >> (x & 7)) & 1) != 0;
+		if (set && run_begin < 0)
+		{
+			run_begin = x;
+		}
+		else if (!set && run_begin >= 0)
+		{
+			runs.push_back(MaskRun(y, run_begin, x));
+			run_begin = -1;
+		}
+		++x;
+	}
+
+	if (run_begin >= 0)
+		runs.push_back(MaskRun(y, run_begin, width));
+}
+
+void DebayerMaskRuns(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t threshold, std::vector<MaskRun>& runs)
+{
+	DebayerMaskRowFunc row_func = get_mask_row_func();
+	PackMaskBitsFunc pack_func	= get_pack_mask_bits_func();
+
+	std::vector<uint8_t> line(frame_width);
+	std::vector<uint8_t> line_bits((frame_width + 7) / 8);
+	for (int y = 0; y < frame_height; ++y)
+	{
+		debayer_mask_row(row_func, frame_width, frame_height, inBayer, threshold, y, line.data());
+		pack_func(line.data(), frame_width, line_bits.data());
+		append_mask_row_runs(line_bits.data(), frame_width, y, runs);
+	}
+}
+
+void GetMaskRuns(int width, int height, const uint8_t* mask, int stride, std::vector<MaskRun>& runs)
+{
+	for (int y = 0; y < height; ++y)
+		append_mask_row_runs(mask + y * stride, width, y, runs);
+}
+
+static void debayer_color_rows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int channels, bool inBGR,
+							   int row_begin, int row_end, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	DebayerColorRowFunc row_func = get_color_row_func(channels, inBGR);
+
+	for (int y = row_begin; y < row_end; ++y)
+		debayer_color_row(row_func, frame_width, frame_height, inBayer, channels, inBGR, matrix, lut, y, outBuffer + y * outStride);
+}
+
+void DebayerRGBRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, int row_begin, int row_end, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	debayer_color_rows(frame_width, frame_height, inBayer, outBuffer, outStride, 3, inBGR, row_begin, row_end, matrix, lut);
+}
+
+void DebayerRGBARows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGRA, int row_begin, int row_end, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	debayer_color_rows(frame_width, frame_height, inBayer, outBuffer, outStride, 4, inBGRA, row_begin, row_end, matrix, lut);
+}
+
+void DebayerRGBHQRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int channels, bool inBGR, int row_begin, int row_end, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	DebayerHQRowFunc row_func = get_hq_row_func(channels, inBGR);
+
+	for (int y = row_begin; y < row_end; ++y)
+	{
+		const uint8_t* rows[5];
+		for (int row = 0; row < 5; ++row)
+			rows[row] = inBayer + mirror_index(y + row - 2, frame_height) * frame_width;
+		row_func(frame_width, rows, (y & 1) != 0, matrix, outBuffer + y * outStride);
+		apply_color_lut(lut, frame_width, channels, inBGR, outBuffer + y * outStride);
+	}
+}
+
+void DebayerHalfGrayRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int row_begin, int row_end)
+{
+	DebayerHalfGrayRowFunc row_func = get_half_gray_row_func();
+	int out_width = frame_width / 2;
+	(void)frame_height;
+
+	// Output row y comes from source rows 2y (GR) and 2y+1 (BG)
+	for (int y = row_begin; y < row_end; ++y)
+	{
+		const uint8_t* gr_row = inBayer + 2 * y * frame_width;
+		row_func(out_width, gr_row, gr_row + frame_width, outBuffer + y * outStride);
+	}
+}
+
+void DebayerHalfRGBRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, int row_begin, int row_end, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	DebayerHalfRGBRowFunc row_func = inBGR ? get_half_rgb_row_func<true>() : get_half_rgb_row_func<false>();
+	int out_width = frame_width / 2;
+	(void)frame_height;
+
+	for (int y = row_begin; y < row_end; ++y)
+	{
+		const uint8_t* gr_row = inBayer + 2 * y * frame_width;
+		row_func(out_width, gr_row, gr_row + frame_width, matrix, outBuffer + y * outStride);
+		apply_color_lut(lut, out_width, 3, inBGR, outBuffer + y * outStride);
+	}
+}
+
+void DebayerYUYVRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int row_begin, int row_end)
+{
+	DebayerYUYVRowFunc row_func = get_yuyv_row_func();
+
+	for (int y = row_begin; y < row_end; ++y)
+	{
+		int source_y		= debayer_source_row(y, frame_height);
+		const uint8_t* row	= inBayer + source_y * frame_width;
+
+		row_func(frame_width, row - frame_width, row, row + frame_width, (source_y & 1) != 0, outBuffer + y * outStride);
+	}
+}
+
+void DebayerYUV420Rows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inNV12, int row_begin, int row_end)
+{
+	DebayerYUV420RowFunc row_func = get_yuv420_row_func();
+
+	// The chroma planes follow the Y plane. The NV12 UV plane has the same stride as the Y plane, the I420 U and V planes half of it.
+	int chroma_stride = inNV12 ? outStride : outStride / 2;
+	uint8_t* plane_y = outBuffer;
+	uint8_t* plane_u = outBuffer + outStride * frame_height;
+	uint8_t* plane_v = plane_u + chroma_stride * (frame_height / 2);
+
+	for (int y = row_begin; y < row_end; y += 2)
+	{
+		int source_y0 = debayer_source_row(y, frame_height);
+		int source_y1 = debayer_source_row(y + 1, frame_height);
+
+		uint8_t* dest_u = plane_u + (y / 2) * chroma_stride;
+		uint8_t* dest_v = inNV12 ? NULL : plane_v + (y / 2) * chroma_stride;
+
+		row_func(frame_width, inBayer + source_y0 * frame_width, (source_y0 & 1) != 0, inBayer + source_y1 * frame_width, (source_y1 & 1) != 0,
+				 inNV12, plane_y + y * outStride, plane_y + (y + 1) * outStride, dest_u, dest_v);
+	}
+}
+
+// ColorMatrix
+
+ColorMatrix::ColorMatrix()
+{
+	for (int index = 0; index < 9; ++index)
+		coefficients[index] = index % 4 == 0 ? 1 << FRACTION_BITS : 0;
+}
+
+ColorMatrix::ColorMatrix(const float* matrix)
+{
+	const float scale = (float)(1 << FRACTION_BITS);
+	for (int index = 0; index < 9; ++index)
+	{
+		float fixed = floorf(matrix[index] * scale + 0.5f);
+		coefficients[index] = (int16_t)std::max(-32768.0f, std::min(fixed, 32767.0f));
+	}
+}
+
+// ColorLUT
+
+ColorLUT::ColorLUT()
+{
+	for (int index = 0; index < 256; ++index)
+		red[index] = green[index] = blue[index] = (uint8_t)index;
+}
+
+static void build_color_lut_channel(float gain, float contrast, float gamma, uint8_t* table)
+{
+	double exponent = gamma > 0.0f ? 1.0 / gamma : 1.0;
+	for (int index = 0; index < 256; ++index)
+	{
+		double value = ((index * (double)gain - 127.5) * contrast + 127.5) / 255.0;
+		value = value < 0.0 ? 0.0 : (value > 1.0 ? 1.0 : value);
+		table[index] = (uint8_t)(255.0 * pow(value, exponent) + 0.5);
+	}
+}
+
+ColorLUT::ColorLUT(float red_gain, float green_gain, float blue_gain, float contrast, float gamma)
+{
+	build_color_lut_channel(red_gain, contrast, gamma, red);
+	build_color_lut_channel(green_gain, contrast, gamma, green);
+	build_color_lut_channel(blue_gain, contrast, gamma, blue);
+}
+
+// FramePyramid
+
+FramePyramid::FramePyramid(int num_levels, bool withColor, bool inBGR) :
+	requested_levels	(num_levels < 1 ? 1 : num_levels),
+	with_color			(withColor),
+	in_bgr				(inBGR),
+	frame_width			(0),
+	frame_height		(0)
+{
+}
+
+void FramePyramid::Allocate(int frame_width, int frame_height)
+{
+	if (!levels.empty() && frame_width == this->frame_width && frame_height == this->frame_height)
+		return;
+
+	this->frame_width	= frame_width;
+	this->frame_height	= frame_height;
+
+	// Rows are padded to whole cache lines, so that every row of every level starts on one
+	const size_t alignment = 64;
+	std::vector<size_t> offsets;
+	size_t size = 0;
+
+	levels.clear();
+	for (int index = 0; index < requested_levels; ++index)
+	{
+		Level level;
+		level.width			= frame_width >> index;
+		level.height		= frame_height >> index;
+		if (level.width < 1 || level.height < 1)
+			break;
+
+		level.gray			= NULL;
+		level.gray_stride	= (int)((level.width + alignment - 1) & ~(alignment - 1));
+		level.color			= NULL;
+		level.color_stride	= with_color ? (int)((level.width * 3 + alignment - 1) & ~(alignment - 1)) : 0;
+
+		offsets.push_back(size);
+		size += (size_t)level.gray_stride * level.height + (size_t)level.color_stride * level.height;
+		levels.push_back(level);
+	}
+
+	storage.resize(size + alignment - 1);
+	uint8_t* base = storage.data() + ((alignment - ((uintptr_t)storage.data() & (alignment - 1))) & (alignment - 1));
+	for (size_t index = 0; index < levels.size(); ++index)
+	{
+		Level& level = levels[index];
+		level.gray = base + offsets[index];
+		if (with_color)
+			level.color = level.gray + (size_t)level.gray_stride * level.height;
+	}
+}
+
+// Level 0 rows per strip. The strip of every level stays in L1/L2 until it has been downsampled into the next one.
+static const int PYRAMID_STRIP_ROWS = 16;
+
+void DebayerPyramidRows(int frame_width, int frame_height, const uint8_t* inBayer, FramePyramid& pyramid, int row_begin, int row_end)
+{
+	DownsampleGrayRowFunc gray_func		= get_downsample_gray_row_func();
+	DownsampleColorRowFunc color_func	= get_downsample_color_row_func();
+	const FramePyramid::Level& base = pyramid.GetLevel(0);
+
+	// Strips start on a multiple of the row alignment, so level 0 rows [strip_begin, strip_end) give exactly rows
+	// [strip_begin >> index, strip_end >> index) of level index: each of those only needs two rows of the level above
+	// from the same strip. A level's last row is left out by the rounding where the frame height isn't a multiple.
+	int strip_rows = std::max(pyramid.GetRowAlignment(), PYRAMID_STRIP_ROWS);
+	for (int strip_begin = row_begin; strip_begin < row_end; strip_begin += strip_rows)
+	{
+		int strip_end = std::min(strip_begin + strip_rows, row_end);
+
+		DebayerGrayRows(frame_width, frame_height, inBayer, base.gray, base.gray_stride, strip_begin, strip_end);
+		if (base.color)
+			DebayerRGBRows(frame_width, frame_height, inBayer, base.color, base.color_stride, pyramid.IsBGR(), strip_begin, strip_end);
+
+		for (int index = 1; index < pyramid.GetNumLevels(); ++index)
+		{
+			const FramePyramid::Level& above = pyramid.GetLevel(index - 1);
+			const FramePyramid::Level& level = pyramid.GetLevel(index);
+
+			for (int y = strip_begin >> index; y < (strip_end >> index); ++y)
+			{
+				gray_func(level.width, above.gray + 2 * y * above.gray_stride, above.gray + (2 * y + 1) * above.gray_stride, level.gray + y * level.gray_stride);
+				if (level.color)
+					color_func(level.width, above.color + 2 * y * above.color_stride, above.color + (2 * y + 1) * above.color_stride, level.color + y * level.color_stride);
+			}
+		}
+	}
+}
+
+// RemapTable
+
+RemapTable::RemapTable(int width, int height, const float* map_x, const float* map_y) :
+	width				(width),
+	height				(height),
+	positions			(width * height),
+	fractions			(width * height),
+	first_source_row	(height),
+	last_source_row		(height)
+{
+	for (int y = 0; y < height; ++y)
+	{
+		int first_row	= height;
+		int last_row	= -1;
+		for (int x = 0; x < width; ++x)
+		{
+			int index		= y * width + x;
+			float source_x	= map_x[index];
+			float source_y	= map_y[index];
+
+			// Written as a negation so that NaNs are outside too
+			if (!(source_x >= 0.0f && source_x <= (float)(width - 1) && source_y >= 0.0f && source_y <= (float)(height - 1)))
+			{
+				positions[index] = -1;
+				fractions[index] = 0;
+				continue;
+			}
+
+			// Every pixel is blended with its right and lower neighbours, so the last column and row are reached from
+			// the ones before them with a weight of 32
+			int fixed_x		= (int)(source_x * 32.0f + 0.5f);
+			int fixed_y		= (int)(source_y * 32.0f + 0.5f);
+			int pixel_x		= std::min(fixed_x >> 5, width - 2);
+			int pixel_y		= std::min(fixed_y >> 5, height - 2);
+			positions[index] = pixel_y << 16 | pixel_x;
+			fractions[index] = (uint16_t)((fixed_x - pixel_x * 32) | (fixed_y - pixel_y * 32) << 8);
+
+			first_row	= std::min(first_row, pixel_y);
+			last_row	= std::max(last_row, pixel_y + 1);
+		}
+		first_source_row[y]	= first_row;
+		last_source_row[y]	= last_row;
+	}
+}
+
+void RemapTable::GetSourceRows(int row_begin, int row_end, int& first_row, int& last_row) const
+{
+	first_row	= height;
+	last_row	= -1;
+	for (int y = row_begin; y < row_end; ++y)
+	{
+		first_row	= std::min(first_row, first_source_row[y]);
+		last_row	= std::max(last_row, last_source_row[y]);
+	}
+}
+
+// Output rows per strip. The source rows of a strip are demosaiced before its output rows are interpolated.
+static const int REMAP_STRIP_ROWS = 8;
+
+void DebayerRemapRect(int frame_width, int frame_height, const uint8_t* inBayer, const RemapTable& table, uint8_t* outBuffer, int outStride, int channels, bool inBGR,
+					  int x_begin, int x_end, int row_begin, int row_end, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	RemapRowFunc remap_func			= get_remap_row_func(channels);
+	DebayerGrayRowFunc gray_func	= channels == 1 ? get_gray_row_func() : NULL;
+	DebayerColorRowFunc color_func	= channels == 1 ? NULL : get_color_row_func(3, inBGR);
+	int source_row_bytes			= frame_width * (channels == 1 ? 1 : 3);
+
+	// The ring holds the source rows of the strip that needs the most of them. The kernels read up to 4 bytes from
+	// the last byte of a row's last pixel, so the ring has a few bytes of padding.
+	int ring_rows = 0;
+	for (int strip_begin = row_begin; strip_begin < row_end; strip_begin += REMAP_STRIP_ROWS)
+	{
+		int first_row, last_row;
+		table.GetSourceRows(strip_begin, std::min(strip_begin + REMAP_STRIP_ROWS, row_end), first_row, last_row);
+		ring_rows = std::max(ring_rows, last_row - first_row + 1);
+	}
+
+	std::vector<uint8_t> ring(ring_rows * source_row_bytes + 16);
+	std::vector<int32_t> row_offsets(frame_height);
+	int cached_first	= 0;
+	int cached_last		= -1;
+
+	for (int strip_begin = row_begin; strip_begin < row_end; strip_begin += REMAP_STRIP_ROWS)
+	{
+		int strip_end = std::min(strip_begin + REMAP_STRIP_ROWS, row_end);
+
+		// Demosaic the source rows that aren't cached yet. The ring only has to start over if the strip's rows don't follow
+		// on from the cached ones; otherwise the rows it overwrites are above the strip's first row.
+		int first_row, last_row;
+		table.GetSourceRows(strip_begin, strip_end, first_row, last_row);
+		if (first_row < cached_first || first_row > cached_last + 1)
+		{
+			cached_first	= first_row;
+			cached_last		= first_row - 1;
+		}
+		for (int y = cached_last + 1; y <= last_row; ++y)
+		{
+			row_offsets[y] = (y % ring_rows) * source_row_bytes;
+			if (gray_func)
+				debayer_gray_row(gray_func, frame_width, frame_height, inBayer, y, &ring[row_offsets[y]]);
+			else
+				debayer_color_row(color_func, frame_width, frame_height, inBayer, 3, inBGR, matrix, lut, y, &ring[row_offsets[y]]);
+		}
+		cached_last		= std::max(cached_last, last_row);
+		cached_first	= std::max(cached_first, cached_last - ring_rows + 1);
+
+		for (int y = strip_begin; y < strip_end; ++y)
+		{
+			remap_func(x_end - x_begin, table.GetPositions(y) + x_begin, table.GetFractions(y) + x_begin, ring.data(), row_offsets.data(),
+					   outBuffer + (y - row_begin) * outStride);
+		}
+	}
+}
+
+// BayerCorrection
+
+BayerCorrection::BayerCorrection(int width, int height) :
+	width	(width),
+	height	(height)
+{
+}
+
+void BayerCorrection::SetDefects(const uint32_t* pixels, size_t count)
+{
+	defects.clear();
+	for (size_t index = 0; index < count; ++index)
+	{
+		if (pixels[index] < (uint32_t)(width * height))
+			defects.push_back(pixels[index]);
+	}
+	updateFixes();
+}
+
+void BayerCorrection::LearnDefects(const uint8_t* dark_frame, uint8_t threshold)
+{
+	for (uint32_t pixel = 0; pixel < (uint32_t)(width * height); ++pixel)
+	{
+		if (dark_frame[pixel] >= threshold)
+			defects.push_back(pixel);
+	}
+	updateFixes();
+}
+
+void BayerCorrection::updateFixes()
+{
+	std::sort(defects.begin(), defects.end());
+	defects.erase(std::unique(defects.begin(), defects.end()), defects.end());
+
+	// The nearest pixels of the same color are two pixels away in either direction, for every color of the GRBG pattern.
+	// Neighbours that are defects themselves are skipped, unless all of them are.
+	fixes.clear();
+	for (size_t index = 0; index < defects.size(); ++index)
+	{
+		int x = (int)(defects[index] % width);
+		int y = (int)(defects[index] / width);
+		const int offsets[4][2] = { { -2, 0 }, { 2, 0 }, { 0, -2 }, { 0, 2 } };
+
+		DefectFix fix;
+		fix.pixel			= defects[index];
+		fix.num_neighbours	= 0;
+		uint32_t defective[4];
+		uint32_t num_defective = 0;
+		for (int neighbour = 0; neighbour < 4; ++neighbour)
+		{
+			int nx = x + offsets[neighbour][0];
+			int ny = y + offsets[neighbour][1];
+			if (nx < 0 || nx >= width || ny < 0 || ny >= height)
+				continue;
+
+			uint32_t pixel = (uint32_t)(ny * width + nx);
+			if (std::binary_search(defects.begin(), defects.end(), pixel))
+				defective[num_defective++] = pixel;
+			else
+				fix.neighbours[fix.num_neighbours++] = pixel;
+		}
+		if (fix.num_neighbours == 0)
+		{
+			memcpy(fix.neighbours, defective, sizeof(defective));
+			fix.num_neighbours = num_defective;
+		}
+		if (fix.num_neighbours > 0)
+			fixes.push_back(fix);
+	}
+}
+
+void BayerCorrection::SetGains(const float* gains)
+{
+	if (!gains)
+	{
+		this->gains.clear();
+		return;
+	}
+
+	const float scale = (float)(1 << GAIN_FRACTION_BITS);
+	this->gains.resize(width * height);
+	for (int index = 0; index < width * height; ++index)
+	{
+		// Written as a negation so that NaNs become 0 too
+		float fixed = gains[index] * scale + 0.5f;
+		this->gains[index] = !(fixed >= 0.0f) ? 0 : (uint16_t)std::min(fixed, 65535.0f);
+	}
+}
+
+void BayerCorrection::Apply(uint8_t* bayer) const
+{
+	// Defects first, so they are replaced by neighbours without the gains, which are applied to them afterwards like to
+	// any other pixel. Their neighbours are only defects themselves where all of them are.
+	for (size_t index = 0; index < fixes.size(); ++index)
+	{
+		const DefectFix& fix = fixes[index];
+		uint32_t sum = fix.num_neighbours / 2;
+		for (uint32_t neighbour = 0; neighbour < fix.num_neighbours; ++neighbour)
+			sum += bayer[fix.neighbours[neighbour]];
+		bayer[fix.pixel] = (uint8_t)(sum / fix.num_neighbours);
+	}
+
+	if (!gains.empty())
+		get_apply_gains_func()(bayer, gains.data(), width * height);
+}
+
+// TemporalDenoiser
+
+const float TemporalDenoiser::MAX_STRENGTH = 0.9375f;
+
+void TemporalDenoiser::Apply(uint8_t* bayer, int count, float strength, uint8_t motion_threshold)
+{
+	if (averages.size() != (size_t)count)
+	{
+		// Start the averages at the pixels, as v + 0.5 like every new pixel
+		averages.resize(count);
+		for (int index = 0; index < count; ++index)
+			averages[index] = (uint16_t)((bayer[index] << 8) | 0x80);
+		return;
+	}
+
+	// The slope is rounded down, so the weight ends up just above 0 at the threshold instead of below it
+	strength = std::min(std::max(strength, 0.0f), MAX_STRENGTH);
+	uint8_t threshold	= std::max(motion_threshold, (uint8_t)1);
+	uint16_t weight		= (uint16_t)(strength * 65536.0f + 0.5f);
+	uint16_t slope		= (uint16_t)(weight / threshold);
+	get_denoise_func()(bayer, averages.data(), count, weight, slope, threshold);
+}
+
+void DebayerMask(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, uint8_t threshold, bool inBits)
+{
+	DebayerMaskRows(frame_width, frame_height, inBayer, outBuffer, outStride, threshold, inBits, 0, frame_height);
+}
+
+void DebayerGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride)
+{
+	DebayerGrayRows(frame_width, frame_height, inBayer, outBuffer, outStride, 0, frame_height);
+}
+
+void DebayerRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	DebayerRGBRows(frame_width, frame_height, inBayer, outBuffer, outStride, inBGR, 0, frame_height, matrix, lut);
+}
+
+void DebayerRGBA(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGRA, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	DebayerRGBARows(frame_width, frame_height, inBayer, outBuffer, outStride, inBGRA, 0, frame_height, matrix, lut);
+}
+
+void DebayerRGBHQ(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int channels, bool inBGR, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	DebayerRGBHQRows(frame_width, frame_height, inBayer, outBuffer, outStride, channels, inBGR, 0, frame_height, matrix, lut);
+}
+
+void DebayerHalfGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride)
+{
+	DebayerHalfGrayRows(frame_width, frame_height, inBayer, outBuffer, outStride, 0, frame_height / 2);
+}
+
+void DebayerHalfRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	DebayerHalfRGBRows(frame_width, frame_height, inBayer, outBuffer, outStride, inBGR, 0, frame_height / 2, matrix, lut);
+}
+
+void DebayerYUYV(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride)
+{
+	DebayerYUYVRows(frame_width, frame_height, inBayer, outBuffer, outStride, 0, frame_height);
+}
+
+void DebayerYUV420(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inNV12)
+{
+	DebayerYUV420Rows(frame_width, frame_height, inBayer, outBuffer, outStride, inNV12, 0, frame_height);
+}
+
+void DebayerPyramid(int frame_width, int frame_height, const uint8_t* inBayer, FramePyramid& pyramid)
+{
+	pyramid.Allocate(frame_width, frame_height);
+	if (pyramid.GetNumLevels() > 0)
+		DebayerPyramidRows(frame_width, frame_height, inBayer, pyramid, 0, frame_height);
+}
+
+void DebayerRemap(int frame_width, int frame_height, const uint8_t* inBayer, const RemapTable& table, uint8_t* outBuffer, int outStride, int channels, bool inBGR, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	DebayerRemapRect(frame_width, frame_height, inBayer, table, outBuffer, outStride, channels, inBGR, 0, frame_width, 0, frame_height, matrix, lut);
+}
+
+// DebayerThreadPool
+
+DebayerThreadPool::DebayerThreadPool(uint32_t num_threads) :
+	num_threads		(num_threads < 1 ? 1 : num_threads),
+	generation		(0),
+	pending_bands	(0),
+	exit_signaled	(false),
+	job				(NULL),
+	job_rows		(0)
+{
+	// The calling thread converts the first band itself, so we only need num_threads-1 workers
+	for (uint32_t band = 1; band < this->num_threads; ++band)
+		workers.push_back(std::thread(&DebayerThreadPool::workerThreadFunc, this, band));
+}
+
+DebayerThreadPool::~DebayerThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		exit_signaled = true;
+	}
+	work_condition.notify_all();
+
+	for (size_t index = 0; index < workers.size(); ++index)
+		workers[index].join();
+}
+
+void DebayerThreadPool::runBand(uint32_t band, int num_rows, const std::function<void(int, int)>& func)
+{
+	int row_begin	= (int)(((int64_t)num_rows * band) / num_threads);
+	int row_end		= (int)(((int64_t)num_rows * (band + 1)) / num_threads);
+	if (row_begin < row_end)
+		func(row_begin, row_end);
+}
+
+void DebayerThreadPool::ParallelRows(int num_rows, const std::function<void(int, int)>& func)
+{
+	if (workers.empty())
+	{
+		func(0, num_rows);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job				= &func;
+		job_rows		= num_rows;
+		pending_bands	= (uint32_t)workers.size();
+		++generation;
+	}
+	work_condition.notify_all();
+
+	runBand(0, num_rows, func);
+
+	// Wait for the workers to finish their bands before func goes out of scope
+	std::unique_lock<std::mutex> lock(mutex);
+	done_condition.wait(lock, [this]() { return pending_bands == 0; });
+	job = NULL;
+}
+
+void DebayerThreadPool::workerThreadFunc(uint32_t band)
+{
+	uint32_t seen_generation = 0;
+
+	for (;;)
+	{
+		const std::function<void(int, int)>* cur_job;
+		int num_rows;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			work_condition.wait(lock, [&]() { return exit_signaled || generation != seen_generation; });
+			if (exit_signaled)
+				return;
+
+			seen_generation	= generation;
+			cur_job			= job;
+			num_rows		= job_rows;
+		}
+
+		runBand(band, num_rows, *cur_job);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--pending_bands == 0)
+			done_condition.notify_one();
+	}
+}
+
+void DebayerThreadPool::DebayerGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride)
+{
+	ParallelRows(frame_height, [=](int row_begin, int row_end) {
+		DebayerGrayRows(frame_width, frame_height, inBayer, outBuffer, outStride, row_begin, row_end);
+	});
+}
+
+void DebayerThreadPool::DebayerMask(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, uint8_t threshold, bool inBits)
+{
+	ParallelRows(frame_height, [=](int row_begin, int row_end) {
+		DebayerMaskRows(frame_width, frame_height, inBayer, outBuffer, outStride, threshold, inBits, row_begin, row_end);
+	});
+}
+
+void DebayerThreadPool::DebayerRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	ParallelRows(frame_height, [=](int row_begin, int row_end) {
+		DebayerRGBRows(frame_width, frame_height, inBayer, outBuffer, outStride, inBGR, row_begin, row_end, matrix, lut);
+	});
+}
+
+void DebayerThreadPool::DebayerRGBA(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGRA, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	ParallelRows(frame_height, [=](int row_begin, int row_end) {
+		DebayerRGBARows(frame_width, frame_height, inBayer, outBuffer, outStride, inBGRA, row_begin, row_end, matrix, lut);
+	});
+}
+
+void DebayerThreadPool::DebayerRGBHQ(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int channels, bool inBGR, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	ParallelRows(frame_height, [=](int row_begin, int row_end) {
+		DebayerRGBHQRows(frame_width, frame_height, inBayer, outBuffer, outStride, channels, inBGR, row_begin, row_end, matrix, lut);
+	});
+}
+
+void DebayerThreadPool::DebayerHalfGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride)
+{
+	ParallelRows(frame_height / 2, [=](int row_begin, int row_end) {
+		DebayerHalfGrayRows(frame_width, frame_height, inBayer, outBuffer, outStride, row_begin, row_end);
+	});
+}
+
+void DebayerThreadPool::DebayerHalfRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	ParallelRows(frame_height / 2, [=](int row_begin, int row_end) {
+		DebayerHalfRGBRows(frame_width, frame_height, inBayer, outBuffer, outStride, inBGR, row_begin, row_end, matrix, lut);
+	});
+}
+
+void DebayerThreadPool::DebayerYUYV(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride)
+{
+	ParallelRows(frame_height, [=](int row_begin, int row_end) {
+		DebayerYUYVRows(frame_width, frame_height, inBayer, outBuffer, outStride, row_begin, row_end);
+	});
+}
+
+void DebayerThreadPool::DebayerYUV420(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inNV12)
+{
+	// Bands have to start on an even row, so split the frame into row pairs
+	ParallelRows(frame_height / 2, [=](int pair_begin, int pair_end) {
+		DebayerYUV420Rows(frame_width, frame_height, inBayer, outBuffer, outStride, inNV12, pair_begin * 2, pair_end * 2);
+	});
+}
+
+void DebayerThreadPool::DebayerPyramid(int frame_width, int frame_height, const uint8_t* inBayer, FramePyramid& pyramid)
+{
+	pyramid.Allocate(frame_width, frame_height);
+	if (pyramid.GetNumLevels() == 0)
+		return;
+
+	// Bands have to start on a multiple of the row alignment, so split the frame into blocks of that many rows
+	int alignment = pyramid.GetRowAlignment();
+	FramePyramid* target = &pyramid;
+	ParallelRows((frame_height + alignment - 1) / alignment, [=](int block_begin, int block_end) {
+		DebayerPyramidRows(frame_width, frame_height, inBayer, *target, block_begin * alignment, std::min(block_end * alignment, frame_height));
+	});
+}
+
+void DebayerThreadPool::DebayerRemap(int frame_width, int frame_height, const uint8_t* inBayer, const RemapTable& table, uint8_t* outBuffer, int outStride, int channels, bool inBGR, const ColorMatrix* matrix, const ColorLUT* lut)
+{
+	const RemapTable* remap = &table;
+	ParallelRows(frame_height, [=](int row_begin, int row_end) {
+		DebayerRemapRect(frame_width, frame_height, inBayer, *remap, outBuffer + row_begin * outStride, outStride, channels, inBGR, 0, frame_width, row_begin, row_end, matrix, lut);
+	});
+}
+
+} // namespace
@@ -0,0 +1,350 @@
+// source code from https://github.com/inspirit/PS3EYEDriver
+#ifndef PS3EYE_DEBAYER_H
+#define PS3EYE_DEBAYER_H
+
+#include <stdint.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+namespace ps3eye {
+
+// Instruction set used by the demosaic kernels. The best one supported by the CPU is
+// picked at runtime; all of them produce bit-identical output to the scalar reference.
+enum class EDebayerISA
+{
+	Scalar,
+	SSE2,
+	AVX2
+};
+
+// Best instruction set supported by this CPU
+EDebayerISA GetBestDebayerISA();
+
+// Instruction set currently used by DebayerGray/DebayerRGB
+EDebayerISA GetDebayerISA();
+
+// Override the instruction set (e.g. for benchmarking). Requests for an instruction set
+// the CPU does not support are clamped to the best supported one.
+void SetDebayerISA(EDebayerISA isa);
+
+// A 3x3 color correction matrix for the color conversions, e.g. from a color chart calibration. The kernels multiply the
+// demosaiced pixels by it in fixed point before they store them, so it costs no pass of its own.
+struct ColorMatrix
+{
+	static const int FRACTION_BITS = 12;
+
+	// Identity
+	ColorMatrix();
+
+	// Row-major, output R, G, B rows of input R, G, B columns. The coefficients are rounded to multiples of 1/4096
+	// and clamped to [-8, 8); the products are summed in 32 bits and the results clamped to [0, 255].
+	explicit ColorMatrix(const float* matrix);
+
+	int16_t coefficients[9];
+};
+
+// Per-channel lookup tables for the color conversions, e.g. software white balance, contrast and gamma in one. The color
+// channels of every output row go through them right after the row is demosaiced, while it is still in the cache.
+struct ColorLUT
+{
+	// Identity tables
+	ColorLUT();
+
+	// Scale each channel by its gain, stretch the result around mid gray by contrast, then apply a gamma curve:
+	// v becomes 255 * (((v * gain - 127.5) * contrast + 127.5) / 255) ^ (1 / gamma), rounded and clamped to [0, 255]
+	ColorLUT(float red_gain, float green_gain, float blue_gain, float contrast = 1.0f, float gamma = 1.0f);
+
+	uint8_t red[256];
+	uint8_t green[256];
+	uint8_t blue[256];
+};
+
+// outStride is the distance in bytes between the starts of two output rows. It must be at least the packed row size
+// (frame_width bytes per pixel, or half that for the half resolution formats); the bytes past the row are left untouched.
+
+// Convert a GRBG Bayer frame to 8-bit grayscale. outBuffer must be outStride * frame_height bytes.
+void DebayerGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride);
+
+// Threshold the grayscale image of a GRBG Bayer frame without writing it, e.g. to find IR markers. A pixel is set if
+// its DebayerGray value is at least threshold. With inBits = false every pixel is a byte, 0xFF if set and 0 if not.
+// With inBits = true pixels are bits, pixel x of a row going to bit x % 8 of byte x / 8 of the row, so outStride
+// must be at least (frame_width + 7) / 8. outBuffer must be outStride * frame_height bytes.
+void DebayerMask(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, uint8_t threshold, bool inBits);
+
+// A run of set pixels [x_begin, x_end) of mask row y
+struct MaskRun
+{
+	MaskRun() : y(0), x_begin(0), x_end(0) {}
+	MaskRun(int y, int x_begin, int x_end) : y(y), x_begin(x_begin), x_end(x_end) {}
+
+	int y, x_begin, x_end;
+};
+
+// Like DebayerMask, but append the runs of set pixels to runs, row by row, instead of writing a mask
+void DebayerMaskRuns(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t threshold, std::vector<MaskRun>& runs);
+
+// Append the runs of set pixels of a bit mask written by DebayerMask to runs, row by row
+void GetMaskRuns(int width, int height, const uint8_t* mask, int stride, std::vector<MaskRun>& runs);
+
+// Convert a GRBG Bayer frame to packed 24-bit BGR (inBGR = true) or RGB (inBGR = false).
+// outBuffer must be outStride * frame_height bytes. The color conversions multiply their pixels by matrix, then look them up
+// in lut, skipping either step when it is NULL.
+void DebayerRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+
+// Convert a GRBG Bayer frame to 32-bit BGRA (inBGRA = true) or RGBA (inBGRA = false) with an opaque alpha.
+// outBuffer must be outStride * frame_height bytes. The SIMD kernels use aligned stores when the rows are 16 (SSE2)
+// or 32 (AVX2) byte aligned, so pass an aligned buffer and stride for the best performance.
+void DebayerRGBA(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGRA, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+
+// Like DebayerRGB (channels = 3) or DebayerRGBA (channels = 4), with the Malvar-He-Cutler demosaic: the 5x5 gradient-corrected
+// filters interpolate along edges instead of across them, which avoids most of the color fringes of the bilinear demosaic
+// at two to three times its cost. Pixels past the frame border are mirrored, so the border rows and columns are interpolated too.
+void DebayerRGBHQ(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int channels, bool inBGR, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+
+// Convert a GRBG Bayer frame to half resolution, turning every 2x2 quad into one pixel without interpolation.
+// frame_width and frame_height are those of the Bayer frame; outBuffer must be outStride * (frame_height / 2) bytes.
+void DebayerHalfGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride);
+void DebayerHalfRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+
+// Convert a GRBG Bayer frame to packed YUYV 4:2:2 (BT.601 limited range). outBuffer must be outStride * frame_height bytes.
+void DebayerYUYV(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride);
+
+// Convert a GRBG Bayer frame to planar YUV 4:2:0 (BT.601 limited range): a Y plane followed by an interleaved UV plane
+// (inNV12 = true, NV12) or by a U and a V plane (inNV12 = false, I420). The UV plane has the stride of the Y plane, the U and
+// V planes half of it, so outStride must be even for I420 and outBuffer must be outStride * frame_height * 3 / 2 bytes.
+void DebayerYUV420(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inNV12);
+
+// An image pyramid of a GRBG Bayer frame. Level 0 is the DebayerGray image, and optionally the DebayerRGB image too;
+// every further level is the previous one downsampled with a 2x2 box filter, its size rounded down. All levels live in
+// a single 64-byte aligned allocation with 64-byte aligned rows, which is kept as long as the frame size stays the same.
+class FramePyramid
+{
+public:
+	struct Level
+	{
+		int width, height;
+		uint8_t* gray;
+		int gray_stride;
+		uint8_t* color;			// 3 bytes per pixel in BGR or RGB order, NULL if the pyramid has no color levels
+		int color_stride;
+	};
+
+	// num_levels includes level 0. Levels that would be smaller than 1x1 are left out once the frame size is known.
+	explicit FramePyramid(int num_levels = 4, bool withColor = false, bool inBGR = true);
+
+	// Lay out the levels for frames of frame_width x frame_height. Does nothing if they already are.
+	void Allocate(int frame_width, int frame_height);
+
+	int GetFrameWidth() const { return frame_width; }
+	int GetFrameHeight() const { return frame_height; }
+	// 0 until Allocate is called
+	int GetNumLevels() const { return (int)levels.size(); }
+	const Level& GetLevel(int level) const { return levels[level]; }
+	bool HasColor() const { return with_color; }
+	bool IsBGR() const { return in_bgr; }
+
+	// Level 0 row bands must start on a multiple of this, so that every row of the other levels falls in a single band
+	int GetRowAlignment() const { return 1 << (GetNumLevels() - 1); }
+
+private:
+	FramePyramid(const FramePyramid&);
+	void operator=(const FramePyramid&);
+
+	int						requested_levels;
+	bool					with_color;
+	bool					in_bgr;
+	int						frame_width;
+	int						frame_height;
+	std::vector<Level>		levels;
+	std::vector<uint8_t>	storage;			// Every level of the pyramid, starting at the first 64-byte aligned byte
+};
+
+// Fill all levels of pyramid from a GRBG Bayer frame in a single pass, allocating it for the frame size if needed.
+// Level 0 is converted in strips of rows, and every strip is downsampled into the other levels while it is still in cache,
+// so no level is read back from memory. The result is the same as downsampling the whole level 0 image level by level.
+void DebayerPyramid(int frame_width, int frame_height, const uint8_t* inBayer, FramePyramid& pyramid);
+
+// A remap of the demosaiced frame, e.g. to undo the barrel distortion of the lens: every output pixel is interpolated
+// bilinearly at a source position in the frame. Positions are kept in fixed point with 1/32 pixel precision, along with
+// the source rows every output row needs, so that frames can be remapped without demosaicing them to memory first.
+class RemapTable
+{
+public:
+	// map_x and map_y hold the source position of every pixel of a width x height frame, in pixels, like the CV_32FC1
+	// maps of OpenCV's initUndistortRectifyMap. Output pixels whose source is outside the frame are black.
+	RemapTable(int width, int height, const float* map_x, const float* map_y);
+
+	int GetWidth() const { return width; }
+	int GetHeight() const { return height; }
+
+	// Per output pixel of row y: the source pixel as y << 16 | x, or -1 if the source is outside the frame, and the
+	// weights of its right and lower neighbours as fx | fy << 8, both in [0, 32]
+	const int32_t* GetPositions(int y) const { return &positions[y * width]; }
+	const uint16_t* GetFractions(int y) const { return &fractions[y * width]; }
+
+	// Source rows [first_row, last_row] that output rows [row_begin, row_end) sample. first_row > last_row if there are none.
+	void GetSourceRows(int row_begin, int row_end, int& first_row, int& last_row) const;
+
+private:
+	int						width;
+	int						height;
+	std::vector<int32_t>	positions;
+	std::vector<uint16_t>	fractions;
+	std::vector<int>		first_source_row;		// Per output row
+	std::vector<int>		last_source_row;
+};
+
+// Convert a GRBG Bayer frame through a remap table of the same size, to grayscale (channels = 1), packed 24-bit BGR/RGB
+// (channels = 3) or 32-bit BGRA/RGBA with an opaque alpha (channels = 4). inBGR selects the channel order.
+// The source rows are demosaiced into a small ring of rows as the output rows need them, each of them once per frame
+// for maps that move down the frame with the output rows, as lens undistortion maps do. outBuffer must be outStride * frame_height bytes.
+// Color remaps apply matrix and lut to the source rows, gray remaps ignore them.
+void DebayerRemap(int frame_width, int frame_height, const uint8_t* inBayer, const RemapTable& table, uint8_t* outBuffer, int outStride, int channels, bool inBGR, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+
+// Corrections of the raw GRBG frames of one sensor, applied in place before they are demosaiced: defective (hot or stuck)
+// pixels are replaced by the mean of their nearest same-color neighbours, then every pixel is scaled by its flat-field
+// gain, e.g. to undo the vignetting of the lens. The neighbours of the defects are looked up once, when they are set.
+class BayerCorrection
+{
+public:
+	static const int GAIN_FRACTION_BITS = 12;
+
+	BayerCorrection(int width, int height);
+
+	int GetWidth() const { return width; }
+	int GetHeight() const { return height; }
+	bool IsEmpty() const { return defects.empty() && gains.empty(); }
+
+	// Defective pixels as y * width + x, in any order. Duplicates and pixels outside the frame are ignored.
+	void SetDefects(const uint32_t* pixels, size_t count);
+	// Add the pixels of a dark frame (lens covered) that are at least threshold to the defects. Call it with a few
+	// dark frames to also catch the pixels that are only hot some of the time.
+	void LearnDefects(const uint8_t* dark_frame, uint8_t threshold);
+	// Sorted by position
+	const std::vector<uint32_t>& GetDefects() const { return defects; }
+
+	// Flat-field gains of all width * height pixels, or NULL for none. They are kept as multiples of 1/4096 up to 16:
+	// pixel v becomes v * gain rounded to the nearest integer and clamped to 255.
+	void SetGains(const float* gains);
+	bool HasGains() const { return !gains.empty(); }
+
+	// Correct a frame of this size in place
+	void Apply(uint8_t* bayer) const;
+
+private:
+	// A defect and the same-color pixels it is replaced by
+	struct DefectFix
+	{
+		uint32_t pixel;
+		uint32_t neighbours[4];
+		uint32_t num_neighbours;
+	};
+
+	void updateFixes();
+
+	int							width;
+	int							height;
+	std::vector<uint32_t>		defects;
+	std::vector<DefectFix>		fixes;
+	std::vector<uint16_t>		gains;
+};
+
+// Recursive (IIR) temporal filter of raw frames against the noise of low light and high gain. Every pixel is blended into
+// a running average of that pixel, kept in 8.8 fixed point, and replaced by it. The weight of the average falls linearly
+// with the difference between the new pixel and the average, down to 0 at motion_threshold, so that moving objects don't
+// leave trails; set the threshold above the noise of still pixels. One pass over the frame, with SIMD kernels.
+class TemporalDenoiser
+{
+public:
+	// Highest strength; more would keep too much of the past, and of its rounding error
+	static const float MAX_STRENGTH;
+
+	// Filter a frame of count pixels in place. strength is the weight of the average on still pixels, from 0 (no
+	// filtering) to MAX_STRENGTH. The first frame, and the first one after the size changed or Reset(), starts the averages.
+	void Apply(uint8_t* bayer, int count, float strength, uint8_t motion_threshold);
+	void Reset() { averages.clear(); }
+
+private:
+	std::vector<uint16_t>		averages;
+};
+
+// Convert output rows [row_begin, row_end) only. Every output row depends on the source frame alone,
+// so disjoint row bands of the same frame can be converted concurrently.
+void DebayerGrayRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int row_begin, int row_end);
+void DebayerMaskRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, uint8_t threshold, bool inBits, int row_begin, int row_end);
+void DebayerRGBRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, int row_begin, int row_end, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+void DebayerRGBARows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGRA, int row_begin, int row_end, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+void DebayerRGBHQRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int channels, bool inBGR, int row_begin, int row_end, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+// For the half resolution formats, the rows are output rows, so [0, frame_height / 2)
+void DebayerHalfGrayRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int row_begin, int row_end);
+void DebayerHalfRGBRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, int row_begin, int row_end, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+void DebayerYUYVRows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int row_begin, int row_end);
+// row_begin and row_end must be even, since every chroma row covers two output rows
+void DebayerYUV420Rows(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inNV12, int row_begin, int row_end);
+
+// Level 0 rows [row_begin, row_end) and the rows of the other levels computed from them. The pyramid must already be
+// allocated for the frame size, row_begin must be a multiple of its row alignment and so must row_end, unless it is frame_height.
+void DebayerPyramidRows(int frame_width, int frame_height, const uint8_t* inBayer, FramePyramid& pyramid, int row_begin, int row_end);
+
+// Remap output pixels [x_begin, x_end) of output rows [row_begin, row_end) only. outBuffer points at pixel (x_begin, row_begin).
+void DebayerRemapRect(int frame_width, int frame_height, const uint8_t* inBayer, const RemapTable& table, uint8_t* outBuffer, int outStride, int channels, bool inBGR,
+					  int x_begin, int x_end, int row_begin, int row_end, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+
+// Scalar reference implementations
+void DebayerGrayScalar(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer);
+void DebayerRGBScalar(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR);
+
+// Converts frames in horizontal row bands, one band per thread
+class DebayerThreadPool
+{
+public:
+	// num_threads includes the calling thread, which converts the first band itself
+	explicit DebayerThreadPool(uint32_t num_threads);
+	~DebayerThreadPool();
+
+	uint32_t GetNumThreads() const { return num_threads; }
+
+	// Split rows [0, num_rows) into one band per thread and call func(row_begin, row_end) for each band.
+	// Blocks until all bands are done. Must not be called from more than one thread at a time.
+	void ParallelRows(int num_rows, const std::function<void(int, int)>& func);
+
+	void DebayerGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride);
+	void DebayerMask(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, uint8_t threshold, bool inBits);
+	void DebayerRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+	void DebayerRGBA(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGRA, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+	void DebayerRGBHQ(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, int channels, bool inBGR, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+	void DebayerHalfGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride);
+	void DebayerHalfRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inBGR, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+	void DebayerYUYV(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride);
+	void DebayerYUV420(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, int outStride, bool inNV12);
+	void DebayerPyramid(int frame_width, int frame_height, const uint8_t* inBayer, FramePyramid& pyramid);
+	void DebayerRemap(int frame_width, int frame_height, const uint8_t* inBayer, const RemapTable& table, uint8_t* outBuffer, int outStride, int channels, bool inBGR, const ColorMatrix* matrix = NULL, const ColorLUT* lut = NULL);
+
+private:
+	DebayerThreadPool(const DebayerThreadPool&);
+	void operator=(const DebayerThreadPool&);
+
+	void runBand(uint32_t band, int num_rows, const std::function<void(int, int)>& func);
+	void workerThreadFunc(uint32_t band);
+
+	uint32_t								num_threads;
+	std::vector<std::thread>				workers;
+
+	std::mutex								mutex;
+	std::condition_variable					work_condition;
+	std::condition_variable					done_condition;
+	uint32_t								generation;
+	uint32_t								pending_bands;
+	bool									exit_signaled;
+	const std::function<void(int, int)>*	job;
+	int										job_rows;
+};
+
+} // namespace
+
+
+#endif